@@ -0,0 +1,145 @@
+/*
+ //  ctctl.c
+ //  ctrader
+ //  Client for the control socket of a headless ctrader (ctrader -d path).
+ //
+ //      ctctl -s ctrader.sock POSITION              one command, exit status 1 on ERR
+ //      ctctl -s ctrader.sock                       commands from stdin, one per line
+ //      ctctl -s ctrader.sock -w [-i ms] [levels]   redraw book and position until ^C
+ //
+ //  Commands: PLACE buy|sell <amount> <price>, REPLACE <amount> <price>, CANCEL,
+ //  LOCK <index>, BOOK [levels], POSITION, PING, MARKET [SYMBOL1/SYMBOL2],
+ //  TRADES [count] [buy|sell] [profit|loss] [from=<time>] [to=<time>],
+ //  STATS [from=<time>] [to=<time>], LATENCY [reset], LEVELS <index> ...
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_INTERVAL_MS 500
+/*****************************  FUNCTION PROTOTYPES ****************************/
+int control_connect(const char *path);
+int control_request(int fd, FILE *in, const char *command, FILE *out);
+int watch(int fd, FILE *in, int interval_ms, int levels);
+/***************************** END FUNCTION PROTOTYPES *************************/
+
+
+
+/***************************** FUNCTION DEFINITION *****************************/
+
+int control_connect(const char *path){
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// send one command and copy the answer to out, up to and including its OK/ERR line.
+// returns 0 for OK, 1 for ERR, -1 if the connection went away
+int control_request(int fd, FILE *in, const char *command, FILE *out){
+    char line[512];
+    size_t len = strlen(command);
+
+    if(write(fd, command, len) != (ssize_t)len || (command[len-1] != '\n' && write(fd, "\n", 1) != 1))
+        return -1;
+    while(fgets(line, sizeof(line), in)){
+        fputs(line, out);
+        if(strncmp(line, "OK", 2) == 0)
+            return 0;
+        if(strncmp(line, "ERR", 3) == 0)
+            return 1;
+    }
+    return -1;
+}
+
+// a thin console: position and book, redrawn in place
+int watch(int fd, FILE *in, int interval_ms, int levels){
+    char command[32];
+    snprintf(command, sizeof(command), "BOOK %d", levels);
+    for(;;){
+        printf("\033[H\033[2J");
+        if(control_request(fd, in, "POSITION", stdout) < 0 || control_request(fd, in, command, stdout) < 0)
+            return 1;
+        fflush(stdout);
+        usleep(interval_ms * 1000);
+    }
+}
+
+
+/*----------------------------------- main --------------------------------------*/
+
+int main(int argc, char *argv[]){
+
+    const char *path = NULL;
+    int opt, fd, status = 0;
+    int watching = 0, interval_ms = DEFAULT_INTERVAL_MS;
+    char command[512];
+    FILE *in;
+
+    while((opt = getopt(argc, argv, "s:wi:")) != -1){
+        switch(opt){
+            case 's':
+                path = optarg;
+                break;
+            case 'w':
+                watching = 1;
+                break;
+            case 'i':
+                interval_ms = atoi(optarg);
+                break;
+            default:
+                path = NULL;
+                optind = argc;
+                break;
+        }
+    }
+    if(path == NULL){
+        fprintf(stderr, "usage: %s -s control_socket [command ...] | -w [-i ms] [levels]\n", argv[0]);
+        return 2;
+    }
+    if((fd = control_connect(path)) < 0){
+        perror(path);
+        return 2;
+    }
+    in = fdopen(dup(fd), "r");
+
+    if(watching){
+        status = watch(fd, in, interval_ms, optind < argc ? atoi(argv[optind]) : 20);
+    }else if(optind < argc){
+        // the rest of the arguments are one command
+        size_t len = 0;
+        command[0] = 0;
+        for(int i = optind; i < argc && len < sizeof(command) - 2; i++)
+            len += snprintf(command + len, sizeof(command) - len, "%s%s", i > optind ? " " : "", argv[i]);
+        status = control_request(fd, in, command, stdout);
+    }else{
+        while(fgets(command, sizeof(command), stdin)){
+            if(command[0] == '\n')
+                continue;
+            if((status = control_request(fd, in, command, stdout)) < 0)
+                break;
+            fflush(stdout);
+        }
+    }
+
+    fclose(in);
+    close(fd);
+    return status < 0 ? 2 : status;
+}
+
+/*----------------------------------- main --------------------------------------*/
@@ -10,60 +10,540 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include <db.h>
-#include <openssl/hmac.h>
+#include <zlib.h>
+#define OPENSSL_SUPPRESS_DEPRECATED   /* SHA256_CTX is copied by value, see signer_init */
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
 #include <jansson.h>
 #include <ncurses.h>
 
 #define DEFAULT_HOMEDIR "./"
 #define TRADESDB "trades.db"
+#define NONCEFILE "nonce.dat"
+#define ARCHIVE_CACHE_BYTES (8 << 20)
+#define MAX_HTTP_POOLS 4
+#define MAX_HTTP_REQUESTS 8
+#define CEX_WS_URL "wss://ws.cex.io/ws/"
+#define MDFEED_RETRY_SECS 5
+#define BOOK_INITIAL_LEVELS 256
+#define JSON_MAX_DEPTH 16
+#define JSON_MAX_TOKEN 256
+#define FIXED_MAX_DECIMALS 18
+#define CEX_API_URL "https://cex.io/api"
+#define TICK_ARENA_SIZE (1 << 20)
+#define NONCE_RESERVE_US 60000000ULL
+#define ARCHIVE_PAGE_SIZE 100
+#define ARCHIVE_PAGE_MAX 3200
+#define COLUMN_BATCH 1024
+#define WHEEL_SLOTS 64
+#define WHEEL_TICK_MS 50
+#define BUDGET_WINDOW_MS 60000
+#define SNAPSHOT_LEVELS 100
+#define COMMAND_QUEUE_SIZE 16
+#define NOTICE_QUEUE_SIZE 64
+#define ARCHIVE_WAIT_MS 50
+#define UI_FRAME_MS 50
+#define HEADER_ROWS 9
+#define BOOK_ROWS 40
+#define LOG_MIN_ROWS 4
+#define MAX_CONTROL_CLIENTS 16
+#define CONTROL_LINE_MAX 512
+#define CONTROL_REPLY_MAX 16384
+#define CONTROL_STATUS_MAX 64
+#define MAX_MARKETS 8
+#define RECORD_RING_BYTES (4 << 20)
+#define RECORD_BLOCK_BYTES (1 << 20)
+#define RECORD_INDEX_BLOCKS 64
+#define RECORD_FLUSH_MS 1000
+#define BENCH_LEVELS 1000
+#define BENCH_TRADES 20000
+#define HIST_SUB_BITS 4
+#define HIST_MAX_EXPONENT 40
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+#define LATENCYFILE "latency.txt"
+#define TRACE_QUEUE_SIZE 256
 /*****************************  STRUCTURES *****************************************/
 
 
+// Prices and amounts are integers counting the smallest step of their market: a price of
+// 6512.37 with price_decimals 2 is 651237. Exact to compare, add and hash.
+typedef int64_t fixed_t;
+
+
+typedef struct market {
+    const struct exchange *exchange;
+    char symbol1[8];            /* base currency, amounts are in it */
+    char symbol2[8];            /* quote currency, prices, costs and fees are in it */
+    int price_decimals;         /* tick = 10^-price_decimals */
+    int amount_decimals;        /* lot = 10^-amount_decimals */
+    long fee_ppm;               /* taker fee in millionths of the cost, from the exchange's schedule */
+    char db_name[64];           /* trades database of this market */
+} MARKET;
+
+
+// Bump allocator for memory that only lives for one tick of the main loop. Reset at the
+// end of every iteration, so the steady state loop does not go through malloc at all.
+typedef struct arena {
+    char *base;
+    size_t capacity;
+    size_t used;
+    size_t last;                /* offset of the newest allocation, the one that can grow in place */
+    size_t high_water;          /* most used in a single tick */
+} ARENA;
+
+
 struct RespData {
     char *memory;
     size_t size;
+    ARENA *arena;               /* NULL: memory is realloc'd from the heap */
+};
+
+
+typedef struct http_pool {
+    char host[128];             /* scheme://host[:port] this pool serves */
+    CURLSH *share;              /* dns, tls session and connection cache for this host */
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];     /* one per shared cache, taken by curl */
+    struct curl_slist *json_headers;
+} HTTP_POOL;
+
+
+typedef struct http_transport {
+    HTTP_POOL pools[MAX_HTTP_POOLS];
+    int npools;
+    pthread_mutex_t lock;       /* pools are added by whichever thread asks first */
+} HTTP_TRANSPORT;
+
+
+enum json_event_type { JS_OBJECT_START, JS_OBJECT_END, JS_ARRAY_START, JS_ARRAY_END, JS_KEY, JS_STRING, JS_NUMBER, JS_LITERAL };
+
+enum json_field { F_NONE, F_BIDS, F_ASKS, F_LOW, F_HIGH, F_DATA, F_LPRICE, F_ID, F_TYPE, F_PRICE, F_AMOUNT,
+    F_SYMBOL1, F_SYMBOL2, F_AVAILABLE, F_ORDERID, F_LASTTXTIME, F_TFA, F_FA, F_TTA, F_TA };
+
+typedef struct json_stream JSON_STREAM;
+typedef void (*json_event)(JSON_STREAM *, int event, const char *value, size_t len);
+
+// Incremental tokenizer fed straight from the curl write callback. Tokens are handed to
+// the handler as pointers into the received chunk; only a token split across two
+// chunks is stitched together in token[]. String escapes are passed through as is.
+struct json_stream {
+    json_event handler;                 /* shape specific, fills target */
+    void *target;
+    int depth;                          /* 0 = outside any container */
+    char container[JSON_MAX_DEPTH];     /* '{' or '[' per depth */
+    long index[JSON_MAX_DEPTH];         /* element index of arrays */
+    int field[JSON_MAX_DEPTH];          /* enum json_field of the current key of objects */
+    int expect_key;
+    int in_string, escaped, in_bare;
+    char token[JSON_MAX_TOKEN];
+    size_t token_len;
+    fixed_t level[2];                   /* [price, amount] pair being read */
+    int error;
+    int record;                         /* enum source the raw body is recorded as, -1: not */
+    int record_stream;                  /* request slot, the chunks of one body share it */
+};
+
+
+struct ticker {
+    fixed_t low;
+    fixed_t high;
+    int received;
+};
+
+
+struct last_price {
+    fixed_t price;
+    int received;
+};
+
+
+// btc/usd stand for the base and quote currency of the market
+struct balance {
+    fixed_t btc_available;
+    fixed_t usd_available;
+    int btc_found;
+    int usd_found;
+};
+
+
+typedef struct http_request HTTP_REQUEST;
+typedef void (*request_done)(HTTP_REQUEST *, void *userdata);
+
+struct http_request {
+    CURL *curl_handle;
+    struct RespData response;
+    char post_params[3000];     /* copied, the caller's buffer is reused right away */
+    JSON_STREAM stream;         /* used instead of response when the request has a parser */
+    request_done done;          /* called from engine_perform once the transfer ends */
+    void *userdata;
+    CURLcode result;
+    int in_use;
+    int stage;                  /* enum stage of the endpoint, -1: not one of the market's */
+};
+
+
+typedef struct request_engine {
+    CURLM *multi;
+    HTTP_REQUEST requests[MAX_HTTP_REQUESTS];
+    int pending;
+} REQUEST_ENGINE;
+
+
+// every polled data source runs on its own timer
+enum source { SRC_TICKER, SRC_LASTPRICE, SRC_BOOK, SRC_OPEN_ORDERS, SRC_BALANCE, SRC_TRADES, SRC_COUNT };
+
+typedef struct sched_timer SCHED_TIMER;
+
+struct sched_timer {
+    int source;
+    long interval_ms;
+    uint64_t due_ms;
+    int budget;                 /* requests allowed per BUDGET_WINDOW_MS */
+    int spent;
+    uint64_t window_start_ms;
+    SCHED_TIMER *next;          /* chain of the wheel slot the timer sits in */
+    int armed;
+};
+
+
+// Hashed timer wheel: a timer due at t sits in slot (t / WHEEL_TICK_MS) % WHEEL_SLOTS,
+// expiring walks the slots between the last visit and now instead of every timer.
+typedef struct scheduler {
+    SCHED_TIMER timers[SRC_COUNT];
+    SCHED_TIMER *wheel[WHEEL_SLOTS];
+    uint64_t cursor_ms;         /* start of the slot visited last */
+} SCHEDULER;
+
+
+struct balance_chain {
+    const char *url;
+    const char *json;
+    struct authdata *auth;      /* signed together with the open_orders request */
+    int wanted;                 /* balance timer is due */
+    struct order *open_order;
+    struct balance *balance;
+};
+
+
+struct book_side {
+    fixed_t *price;             /* best level first: bids descending, asks ascending */
+    fixed_t *amount;
+    fixed_t *depth;             /* depth[i] = amount of levels 0..i */
+    size_t count;
+    size_t capacity;
+    int descending;
+    int depth_dirty;            /* depth[] is rebuilt lazily after updates */
+    fixed_t *level;             /* distinct whole-unit prices, best first */
+    size_t *level_count;        /* price levels that fall in level[i], NULL on views */
+    size_t levels;
+    size_t level_capacity;
 };
 
 
+typedef struct order_book {
+    struct book_side bids;
+    struct book_side asks;
+} ORDER_BOOK;
+
+
+typedef struct md_feed {
+    CURL *curl_handle;          /* CONNECT_ONLY websocket handle, polled without blocking */
+    char url[256];
+    struct RespData frame;      /* reassembles a message spread over several recv calls */
+    ORDER_BOOK book;
+    long book_id;               /* id of the last applied snapshot/md_update, gaps trigger a resync */
+    int connected;
+    int subscribed;             /* snapshot applied, book is usable */
+    fixed_t lastprice;          /* from the tickers room, 0 until the first tick */
+    time_t last_attempt;
+    uint64_t recv_ns;           /* CLOCK_MONOTONIC, the message being handled arrived */
+    uint64_t book_ns;           /* the last message applied to the book arrived */
+} MD_FEED;
+
+
+// urls are built from the market once at startup, bodies are printf templates
+typedef struct api_endpoints {
+    char ticker_url[160];
+    char lastprice_url[160];
+    char order_book_url[160];
+    char order_book_top_url[160];
+    char open_order_url[160];
+    char balance_url[160];
+    char place_order_url[160];
+    char replace_url[160];
+    char cancel_url[160];
+    char archived_orders_url[160];
+    const char *open_order_json;
+    const char *balance_json;
+    const char *place_order_json;
+    const char *replace_json;
+    const char *cancel_json;
+    const char *archived_orders_json;
+    json_event decode_ticker;           /* response decoders for the exchange's formats */
+    json_event decode_last_price;
+    json_event decode_order_book;
+    json_event decode_open_order;
+    json_event decode_balance;
+    json_event decode_archived_orders;
+} API_ENDPOINTS;
+
+
+// HMAC-SHA256 keyed once: inner and outer hold the hash state after the padded key block,
+// a signature only hashes the message on copies of them.
+typedef struct signer {
+    SHA256_CTX inner;           /* after key ^ ipad */
+    SHA256_CTX outer;           /* after key ^ opad */
+    char apikey[64];
+    char id_apikey[128];        /* user id + api key, signed after the nonce */
+} SIGNER;
+
+
+// Strictly increasing 64-bit nonces in microseconds. The wall clock is read once, after
+// that time comes from the monotonic clock so a clock step can not make nonces go back.
+// A value a minute ahead is kept on disk, a restart continues above it.
+typedef struct nonce_service {
+    _Atomic uint64_t last;          /* last nonce handed out */
+    _Atomic uint64_t reserved;      /* persisted bound, every nonce issued so far is below it */
+    uint64_t base_us;               /* wall clock at init */
+    struct timespec start;          /* monotonic clock at init */
+    pthread_mutex_t lock;           /* serializes writes of the reservation */
+    int failing;                    /* the last write of the reservation failed, under lock */
+    char path[256];
+} NONCE_SERVICE;
+
+
 struct authdata{
-    const char *id;
     const char *apikey;
-    const char *secret_key;
-    const char *id_apikey;
-    const char *message;
-    const char *signature;
+    char nonce[24];
+    char signature[SHA256_DIGEST_LENGTH * 2 + 1];
+};
+
+
+// fee of a trade from a 30 day volume (in the quote currency) on
+struct fee_tier {
+    long volume;
+    long maker_ppm;
+    long taker_ppm;
 };
 
 
+// What is specific to an exchange: how its urls look, how a request is signed, how its
+// responses decode and what it charges. One static instance per supported exchange.
+typedef struct exchange {
+    const char *name;           /* as given to -m */
+    const char *title;          /* for the header */
+    const char *api_url;
+    const char *ws_url;         /* streaming book, NULL: the REST book is polled */
+    void (*endpoints)(API_ENDPOINTS *api, const MARKET *market, const char *base_url);
+    void (*sign)(struct authdata *a, size_t count);     /* a[i].nonce is filled in */
+    const struct fee_tier *fees;    /* ascending volume, the first starts at 0 */
+    int nfees;
+} EXCHANGE;
+
+
 struct prices{
-    double highest_bid;
-    double lowest_ask;
-    double lock_bid_ask;
-    double higher_bid_ask;
-    double lower_bid_ask;
-    double index_bid_ask;
+    fixed_t highest_bid;
+    fixed_t lowest_ask;
+    fixed_t lock_bid_ask;
+    fixed_t higher_bid_ask;
+    fixed_t lower_bid_ask;
+    fixed_t index_bid_ask;
     
 };
 
+// Lock and auto-place parameters. The order thread runs with LOCK_PARAMS_DEFAULT, the
+// backtest (-b) with every combination of a grid around them.
+typedef struct lock_params {
+    int lock_index;             /* distinct whole-unit level the order is kept behind */
+    int kick_count;             /* reprices before the lock moves a level out */
+    int kick_max_index;         /* the lock stops moving out past this level */
+    int offset_units;           /* whole quote units in front of the lock level */
+    int ask_samples;            /* tally samples before a sell target is picked */
+    int bid_samples;            /* and before a buy target */
+} LOCK_PARAMS;
+
+#define LOCK_PARAMS_DEFAULT { 5, 4, 5, 2, 60, 8 }
+
+struct lock_state {
+    int lock_index;
+    int kickcount;
+};
+
+
+// auto-place tally: how often the best price was seen per 10 cent slot between the
+// whole-unit midpoint of the day's range and its high (asks) or low (bids)
+struct tally {
+    fixed_t midpoint;
+    fixed_t step;
+    int ask_size, bid_size;
+    int *ask, *bid;
+    int counter;                /* samples of both sides */
+    int best;                   /* count of the slot picked last */
+    fixed_t target_sell;        /* 0 until enough samples */
+    fixed_t target_buy;
+    int verbose;                /* notify the slots when a target is picked */
+};
+
+
 struct order{
-    double price;
-    double amount;
+    fixed_t price;
+    fixed_t amount;
     char order_id[11];
     char type[6];
     int placed;
 };
 
+// Single producer, single consumer ring of fixed size slots. head is only written by the
+// producer and tail only by the consumer, so neither side ever waits for the other.
+typedef struct ring {
+    char *slots;
+    size_t slot_size;
+    unsigned capacity;          /* power of two */
+    _Atomic unsigned head;      /* next slot to write */
+    _Atomic unsigned tail;      /* next slot to read */
+} RING;
+
+
+// top of one side of the book as the market data thread last saw it
+struct snapshot_side {
+    fixed_t price[SNAPSHOT_LEVELS];
+    fixed_t amount[SNAPSHOT_LEVELS];
+    fixed_t depth[SNAPSHOT_LEVELS];
+    fixed_t level[SNAPSHOT_LEVELS];
+    size_t count;
+    size_t levels;
+};
+
+
+struct md_state {
+    unsigned long version;      /* bumped on every publish */
+    struct snapshot_side bids;
+    struct snapshot_side asks;
+    fixed_t low;
+    fixed_t high;
+    fixed_t lastprice;
+    unsigned long range_breaks; /* times the ticker broke the low or the high */
+    uint64_t recv_ns;           /* CLOCK_MONOTONIC, the newest data in the book arrived */
+    uint64_t publish_ns;        /* the md thread published it */
+};
+
+
+// Seqlock: one writer that never waits, readers copy the state out and retry if seq was
+// odd (a publish in progress) or moved while they copied.
+typedef struct md_snapshot {
+    _Atomic unsigned seq;
+    struct md_state state;
+} MD_SNAPSHOT;
+
+
+struct order_state {
+    unsigned long version;
+    struct order open;          /* type[0] == 0 when there is no open order */
+    fixed_t btc_available;
+    fixed_t usd_available;
+    int lock_index;
+};
+
+
+typedef struct order_snapshot {
+    _Atomic unsigned seq;
+    struct order_state state;
+} ORDER_SNAPSHOT;
+
+
+// what the UI asks the order thread to do, it never sends order requests itself
+enum command_type { CMD_REPLACE, CMD_CANCEL, CMD_PLACE, CMD_SET_LOCK, CMD_MOVE_LOCK };
+
+typedef struct command {
+    int type;
+    char order_type[6];         /* CMD_PLACE: buy or sell */
+    fixed_t price;              /* CMD_REPLACE, CMD_PLACE */
+    fixed_t amount;
+    int index;                  /* CMD_SET_LOCK: lock index, CMD_MOVE_LOCK: added to it */
+} COMMAND;
+
+
+// a line for the UI to print, beeps > 0 also flashes the screen
+struct notice {
+    char text[120];
+    int beeps;
+};
+
+
+// secondary indexes of a trades database, keys are built by trade_index_key
+enum trade_index { BY_TIME, BY_TYPE, BY_PROFIT, TRADE_INDEXES };
+
+// Append-only copy of the trades in one file per column, memory-mapped for the stats
+// scans. Rows are in the order they were stored, not sorted by time; the row count of
+// trades.db lives in its sync database and a store that disagrees is rebuilt on open.
+enum trade_column { COL_TIME, COL_PRICE, COL_AMOUNT, COL_FEE, COL_COST, COL_SIDE, COL_PROFIT, TRADE_COLUMNS };
+
+typedef struct column_store {
+    int fd[TRADE_COLUMNS];
+    const void *map[TRADE_COLUMNS];     /* time int64_t ms, fixed_t in market precision, side/profit uint8_t */
+    size_t rows;
+    char *path;                         /* "<trades db>.", the column name is appended */
+} COLUMN_STORE;
+
+
+// over the trades of a window; costs and fees in the quote currency
+typedef struct trade_stats {
+    size_t count, buys, wins;
+    fixed_t bought, sold;               /* amount_decimals */
+    fixed_t spent, received;            /* cost of the buys and of the sells */
+    fixed_t fees;
+    fixed_t pnl;                        /* received - spent - fees */
+    fixed_t avg_entry;                  /* spent / bought, 0 without buys */
+    double win_rate;                    /* wins / count */
+} TRADE_STATS;
+
+
 typedef struct archive_dbs {
+    DB_ENV *db_envp;            /* archive_env, shared by the databases of every market */
     DB *trades_dbp;
+    DB *index_dbp[TRADE_INDEXES];   /* associated with trades_dbp, kept up to date by BDB */
+    DB *sync_dbp;               /* sync marks, keyed by archived_orders status */
     const char *db_home_dir;
     char *trades_db_name;
+    char *index_db_name;        /* one file, a named database per index and one for sync marks */
+    COLUMN_STORE columns;
 } ARCHIVE_DBS;
 
 
 typedef struct trade {
+    char order_id[11];
+    char time[25];
+    char type[5];
+    char profit[2];
+    fixed_t price;
+    fixed_t amount;
+    fixed_t fee;                /* fee and cost are in the quote currency, price_decimals */
+    fixed_t cost;
+    int price_decimals;         /* precision the record was written with */
+    int amount_decimals;
+    
+} TRADE;
+
+
+// trades.db records written before TRADE went fixed point, told apart by their size
+struct trade_v1 {
     char order_id[11];
     char time[25];
     char type[5];
@@ -72,8 +552,288 @@ typedef struct trade {
     double amount;
     double fee;
     double cost;
-    
-} TRADE;
+};
+
+
+// a range of the archive for trades_query
+typedef struct trade_query {
+    const char *type;           /* "buy" or "sell", NULL: either */
+    char profit;                /* 'y' or 'n', 0: either */
+    const char *from;           /* lastTxTime from, inclusive, NULL: the first trade */
+    const char *to;             /* up to, exclusive, NULL: the last trade */
+    int newest_first;
+} TRADE_QUERY;
+
+
+// high-water mark of the archived_orders sync of one status, moves in the same
+// transaction as the trades it covers
+struct sync_mark {
+    char time[25];              /* lastTxTime of the newest stored order */
+    char order_id[11];
+};
+
+
+struct archive_page {
+    TRADE *trades;              /* in response order, newest first */
+    size_t count;
+    size_t capacity;
+    int total_fee, total_cost;  /* tfa:/tta: seen for the current order, they win over fa:/ta: */
+};
+
+
+// Raw market data as received, for tuning offline. Records are framed by record_header;
+// the recorder thread packs them into zlib compressed data blocks and, every
+// RECORD_INDEX_BLOCKS blocks and at the end, an index block listing the blocks before it:
+//
+//     file   := (record_block payload)*
+//     data   := "CTRD", payload = compressed (record_header bytes[len])*
+//     index  := "CTRI", payload = record_index_entry[records], not compressed
+//
+// A REST body that lost a chunk to a full ring ends in an empty RECORD_DROPPED record.
+enum record_flags { RECORD_END = 1, RECORD_DROPPED = 2 };
+
+#define RECORD_WS SRC_COUNT     /* source of a websocket message */
+
+struct record_header {
+    uint64_t recv_ns;           /* CLOCK_REALTIME when it arrived */
+    uint32_t len;               /* payload bytes after the header */
+    uint8_t market;             /* index in markets[] */
+    uint8_t source;             /* enum source of a REST poll, RECORD_WS */
+    uint8_t stream;             /* REST request slot, chunks of one body share it */
+    uint8_t flags;              /* RECORD_END: the body is complete, RECORD_DROPPED: discard it */
+};
+
+struct record_block {
+    char magic[4];              /* "CTRD" or "CTRI" */
+    uint32_t raw_len;
+    uint32_t stored_len;        /* bytes that follow */
+    uint32_t records;           /* records of a data block, entries of an index block */
+    uint64_t first_ns;
+    uint64_t last_ns;
+    int64_t previous_index;     /* offset of the index block before this one, -1: none */
+};
+
+struct record_index_entry {
+    int64_t offset;             /* of the data block */
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+// a complete message read back from a recording, source is RECORD_WS or a REST poll
+typedef void (*record_handler)(void *ctx, uint64_t ns, int source, const char *body, size_t len);
+
+// Single producer, single consumer ring of bytes, a record is a header and its payload
+// copied in one piece. A record that does not fit is dropped and counted.
+struct record_ring {
+    char *buffer;
+    size_t capacity;            /* power of two, 0: not recording */
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic unsigned long dropped;
+    unsigned broken;            /* request slots whose body lost a chunk, md thread only */
+};
+
+
+typedef struct recorder {
+    FILE *fp;
+    pthread_t tid;
+    atomic_int running;
+    char *block;                /* records of the data block being filled */
+    size_t block_len;
+    uint32_t records;
+    uint64_t first_ns, last_ns;
+    unsigned char *compressed;
+    uLongf compressed_cap;
+    struct record_index_entry index[RECORD_INDEX_BLOCKS];
+    int indexed;                /* data blocks since the last index block */
+    int64_t previous_index;
+} RECORDER;
+
+
+// Tick to trade of one repricing: the book it was decided on, the decision, and the
+// replace on its way to the exchange and back. Times are CLOCK_MONOTONIC ns. The trace
+// log (-t) is a trace_header at every start, then fixed size records:
+//
+//     file   := (trace_header trace_record*)*
+enum trace_status { TRACE_ACKED, TRACE_REJECTED, TRACE_NO_ANSWER };
+
+struct trace_header {
+    char magic[4];              /* "CTTR" */
+    uint32_t record_size;
+    int64_t realtime_ns;        /* CLOCK_REALTIME - CLOCK_MONOTONIC when it was written */
+};
+
+struct trace_record {
+    uint8_t market;             /* index in markets[], never 'C' where a header starts */
+    uint8_t side;               /* 'b' or 's' */
+    uint8_t status;             /* enum trace_status */
+    uint8_t lock_index;         /* after the decision */
+    char order_id[12];          /* the order replaced */
+    uint64_t trace_id;          /* the market's decisions count up from 1 every start */
+    uint64_t recv_ns;           /* the newest book data of the decision arrived */
+    uint64_t publish_ns;        /* the md thread published that book */
+    uint64_t decide_ns;         /* lock_reprice moved the order */
+    uint64_t signed_ns;         /* the replace was signed */
+    uint64_t wire_ns;           /* curl started sending it */
+    uint64_t ack_ns;            /* the answer was in */
+    fixed_t from_price;
+    fixed_t to_price;
+};
+
+// the last Getjson/Getstream of a thread
+struct transfer_times {
+    uint64_t start_ns;
+    uint64_t sent_ns;
+    uint64_t done_ns;
+};
+
+
+// A recording decoded once into book, ticker and last price events that every
+// parameter set of a backtest replays.
+enum bt_kind { BT_CLEAR, BT_BID, BT_ASK, BT_BOOK, BT_TICKER, BT_LAST };
+
+struct bt_event {
+    uint64_t ns;                /* receive time */
+    int kind;                   /* BT_BOOK closes the levels of one message */
+    fixed_t price;              /* BT_TICKER: low */
+    fixed_t amount;             /* BT_TICKER: high */
+};
+
+typedef struct bt_tape {
+    struct bt_event *events;
+    size_t count;
+    size_t capacity;
+} BT_TAPE;
+
+
+typedef struct bt_params {
+    LOCK_PARAMS lock;
+    int use_tally;              /* place at the tally target, 0: at the lock level */
+    int quote_units;            /* starting balance in whole quote units */
+} BT_PARAMS;
+
+
+typedef struct bt_result {
+    BT_PARAMS params;
+    size_t placed, replaces, fills;
+    fixed_t fees;
+    fixed_t quote, base;        /* balances at the end */
+    fixed_t pnl;                /* quote + base at the last price, less the start */
+    double queue_ahead;         /* amount ahead of the order when placed or replaced, summed */
+    double wait_s;              /* from placing to the fill, summed over fills */
+} BT_RESULT;
+
+
+// Where the time of a tick goes. A request is split with curl's own timings into name
+// lookup, connect, TLS handshake, server (request sent to first byte) and the rest of the
+// transfer, and each endpoint also gets the whole call; the rest are stretches of code.
+enum stage {
+    STAGE_DNS, STAGE_CONNECT, STAGE_TLS, STAGE_SERVER, STAGE_TRANSFER,
+    STAGE_TICKER, STAGE_LASTPRICE, STAGE_ORDER_BOOK, STAGE_ORDER_BOOK_TOP, STAGE_OPEN_ORDER,
+    STAGE_BALANCE, STAGE_PLACE_ORDER, STAGE_REPLACE, STAGE_CANCEL, STAGE_ARCHIVED_ORDERS,
+    STAGE_WS_PARSE,             /* json_loadb and mdfeed_message of a websocket message */
+    STAGE_PUBLISH,              /* md_state_fill and the snapshot publish */
+    STAGE_REPRICE,              /* the order thread's book_adjust and lock_reprice */
+    STAGE_RENDER,               /* show_order_book */
+    STAGE_SIGN,                 /* create_authdata */
+    STAGE_SYNC,                 /* get_trades update */
+    STAGE_HISTORY,              /* get_trades view */
+    STAGES
+};
+
+// Log-linear buckets as in HdrHistogram: 2^HIST_SUB_BITS per power of two, so a value is
+// kept to about 6%. Recorded from any thread with relaxed atomic adds, no lock.
+typedef struct histogram {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+} HISTOGRAM;
+
+
+// One benchmark run: a sample per timed call, the first warmup of them dropped.
+typedef struct bench {
+    uint64_t *ns;               /* samples, sorted when reported */
+    size_t count;
+    size_t rounds;              /* calls to make, warmup included */
+    size_t warmup;
+    size_t skipped;
+    size_t items;               /* levels, trades, .. one call handles */
+    int levels;                 /* per side of the synthetic books */
+    const char *record_file;    /* -b, replayed by the tick benchmark */
+} BENCH;
+
+
+// complete messages the tick benchmark replays, from a recording or made up
+struct bench_message {
+    int source;                 /* enum source of a REST poll, RECORD_WS */
+    char *body;
+    size_t len;
+};
+
+struct bench_tape {
+    struct bench_message *messages;
+    size_t count;
+    size_t capacity;
+};
+
+
+// trades database syncs the order thread asks the archive thread for
+enum archive_request { ARCHIVE_DONE = 1, ARCHIVE_PARTIAL = 2 };
+
+// Everything that belongs to one traded market. Its threads only touch their own shard,
+// shards have nothing in common but the transport, the signer and the nonces.
+typedef struct shard {
+    MARKET *market;
+    API_ENDPOINTS api;
+    const char *ws_url;         /* NULL: poll the REST book */
+    MD_SNAPSHOT md;
+    ORDER_SNAPSHOT orders;
+    RING commands;              /* UI -> order thread */
+    RING notices;               /* order thread -> UI */
+    CURLM *_Atomic order_multi; /* order thread's engine, curl_multi_wakeup wakes it */
+    pthread_t md_tid;
+    pthread_t order_tid;
+    pthread_t archive_tid;
+    atomic_uint archive_due;    /* enum archive_request bits, order thread -> archive thread */
+    RING archive_notices;       /* archive thread -> UI */
+    TRADE last_trade;           /* UI thread, newest trade in the market's database */
+    ARCHIVE_DBS archive;        /* open for the life of the process, under archive_lock */
+    struct record_ring recorded;    /* md thread -> recorder, unused unless recording */
+    RING traces;                /* order thread -> trace log, unused unless tracing */
+} SHARD;
+
+
+// A fixed-position window and the cells last drawn into it. Rows are composed in full and
+// compared with what is on screen, only the columns that differ are written again.
+typedef struct render_pane {
+    WINDOW *win;
+    int rows;
+    int cols;
+    chtype *cells;              /* rows * cols, 0 = unknown, draw it */
+    int dirty;                  /* written since the last wnoutrefresh */
+} RENDER_PANE;
+
+
+typedef struct renderer {
+    RENDER_PANE header;         /* title, pending order, low/high, last price, volume */
+    RENDER_PANE book;           /* BOOK_ROWS rows of bids and asks */
+    WINDOW *log;                /* notices and prompts, scrolls */
+} RENDERER;
+
+typedef struct control_client {
+    int fd;                     /* -1: free slot */
+    char line[CONTROL_LINE_MAX];    /* partial command, until its newline arrives */
+    size_t len;
+    SHARD *shard;               /* market the commands are for, see MARKET */
+} CONTROL_CLIENT;
+
+
+struct control_reply {
+    char text[CONTROL_REPLY_MAX];
+    size_t len;
+    int truncated;              /* lines were dropped, the answer ends in ERR truncated */
+};
 
 /***************************** END STRUCTURES *****************************************/
 
@@ -81,22 +841,211 @@ typedef struct trade {
 
 /*****************************  FUNCTION PROTOTYPES ****************************/
 char *itoa(long n, char s[]);
-const char *make_signature(const char *message, const char *secret_key);
+void signer_init(SIGNER *signer, const char *id, const char *apikey, const char *secret_key);
+void signer_sign(const SIGNER *signer, const char *message, size_t len, char *signature);
+void signer_sign_batch(const SIGNER *signer, const char *const *messages, size_t count, char (*signatures)[SHA256_DIGEST_LENGTH * 2 + 1]);
+void create_authdata_batch(struct authdata *a, size_t count);
+void cex_sign(struct authdata *a, size_t count);
+void cex_endpoints(API_ENDPOINTS *api, const MARKET *market, const char *base_url);
+int nonce_init(NONCE_SERVICE *ns, const char *path);
+uint64_t nonce_next(NONCE_SERVICE *ns);
+char *nonce_string(NONCE_SERVICE *ns, char *buffer);
 int kbhit(void);
+fixed_t scan_price(void);
+int ui_post(int type, const char *order_type, fixed_t price, fixed_t amount, int index);
 char *reverse(char s[]);
-void create_authdata(struct authdata *, char *);
+void create_authdata(struct authdata *, const char *nonce);
+
+void book_adjust(ORDER_BOOK *book, const char *mytype, fixed_t myprice, struct prices *adj_price, int price_index, int lock_index);
+void render_init(RENDERER *screen);
+void render_invalidate(RENDERER *screen);
+int render_text(chtype *line, int cols, int col, attr_t attr, const char *format, ...);
+void render_line(RENDER_PANE *pane, int row, const chtype *line);
+void render_flush(RENDERER *screen);
+void show_order_book(ORDER_BOOK *book, const char *mytype, fixed_t myamount, fixed_t myprice, const struct prices *, int lock_index, fixed_t low, fixed_t high, fixed_t lastprice, TRADE last_trade);
+int Getjson(struct RespData *, const char *url, char *post_params);
+int Getstream(const char *url, char *post_params, JSON_STREAM *js);
+static size_t StreamRes(void *contents, size_t size, size_t nmemb, void *destination);
+void api_init(API_ENDPOINTS *api, const MARKET *market, const char *base_url);
+void arena_init(ARENA *arena, size_t capacity);
+void *arena_alloc(ARENA *arena, size_t size);
+void *arena_grow(ARENA *arena, void *ptr, size_t old_size, size_t size);
+int arena_owns(ARENA *arena, const void *ptr);
+void arena_reset(ARENA *arena);
+void resp_init(struct RespData *resp, ARENA *arena);
+void transport_init(void);
+void transport_cleanup(void);
+void transport_thread_cleanup(void);
+HTTP_POOL *transport_pool(const char *url);
+CURL *transport_handle(HTTP_POOL *pool);
+void transport_configure(CURL *curl_handle, HTTP_POOL *pool);
+void engine_init(void);
+void engine_cleanup(void);
+HTTP_REQUEST *engine_submit(const char *url, const char *post_params, json_event parse, void *target, request_done done, void *userdata);
+int engine_perform(int timeout_ms);
+void engine_wait(void);
+void on_open_orders(HTTP_REQUEST *req, void *userdata);
+uint64_t mono_ms(void);
+void sched_init(SCHEDULER *sched);
+void sched_add(SCHEDULER *sched, int source, long interval_ms, int budget, long delay_ms);
+long sched_timeout(SCHEDULER *sched);
+int sched_expire(SCHEDULER *sched, int due[SRC_COUNT]);
+int sched_wait(SCHEDULER *sched, int fd);
+int mdfeed_open(MD_FEED *feed, const char *url);
+void mdfeed_close(MD_FEED *feed);
+void mdfeed_poll(MD_FEED *feed);
+void mdfeed_send(MD_FEED *feed, const char *message);
+void mdfeed_message(MD_FEED *feed, json_t *msg);
+void mdfeed_subscribe(MD_FEED *feed);
+void mdfeed_apply(struct book_side *side, json_t *levels);
+int mdfeed_socket(MD_FEED *feed);
+
+/************ Markets ***************/
+const EXCHANGE *exchange_find(const char *name);
+long exchange_fee_ppm(const EXCHANGE *exchange, long volume, int maker);
+MARKET *market_add(const char *spec);
+void shard_enter(SHARD *shard);
+
+/************ Threads ***************/
+int ring_init(RING *ring, unsigned capacity, size_t slot_size);
+int ring_push(RING *ring, const void *item);
+int ring_pop(RING *ring, void *item);
+void snapshot_publish(_Atomic unsigned *seq, void *dst, const void *src, size_t size);
+void snapshot_read(_Atomic unsigned *seq, void *dst, const void *src, size_t size);
+void md_state_fill(struct md_state *state, ORDER_BOOK *book);
+void md_state_book(struct md_state *state, ORDER_BOOK *view);
+void notify(int beeps, const char *format, ...);
+int notice_pop(SHARD *s, struct notice *notice);
+void archive_request(unsigned requests);
+void *archive_thread(void *arg);
+int order_post(int type, const char *order_type, fixed_t price, fixed_t amount, int index);
+void order_wakeup(void);
+void *md_thread(void *arg);
+void *order_thread(void *arg);
+void threads_start(SHARD *shard);
+void threads_stop(void);
+
+/************ Recorder ***************/
+int recorder_start(const char *file_name);
+void recorder_stop(void);
+void record(int source, int stream, int flags, const void *data, size_t len);
+void *recorder_thread(void *arg);
+int record_replay(const char *file_name, int market_index, record_handler handler, void *ctx);
+
+/************ Backtest ***************/
+int backtest_load(const char *file_name, int market_index, BT_TAPE *tape);
+void backtest_run(const BT_TAPE *tape, const BT_PARAMS *params, BT_RESULT *result);
+int backtest(const char *file_name, const char *grid, int threads);
+
+/************ Trace ***************/
+void trace_decision(struct trace_record *trace, const struct md_state *md, const struct order *order, fixed_t from_price, int lock_index);
+void trace_answer(struct trace_record *trace, const struct RespData *response);
+int trace_start(const char *file_name);
+void trace_push(struct trace_record *trace);
+void trace_drain(void);
+void trace_stop(void);
+int trace_print(const char *file_name);
 
-void show_order_book(json_t *orders, const char *mytype, double myamount, double myprice, struct prices *, int price_index, int lock_index, double low, double high, double lastprice, TRADE last_trade);
-void Getjson(struct RespData *, const char *url, char *post_params);
+/************ Latency ***************/
+uint64_t stage_now(void);
+void stage_record(int stage, uint64_t ns);
+void stage_end(int stage, uint64_t start);
+int stage_endpoint(const char *url);
+void stage_request(CURL *curl_handle, int endpoint);
+int latency_line(int stage, char *line, size_t size);
+void latency_reset(void);
+void latency_dump(void);
+
+/************ Benchmarks ***************/
+int bench(const char *spec, const char *record_file);
+
+/************ Control socket ***************/
+int control_listen(const char *path);
+void control_command(struct control_reply *reply, char *line, SHARD **selected);
+int control_serve(const char *path);
+
+/************ Fixed point ***************/
+fixed_t fixed_parse(const char *value, size_t len, int decimals);
+fixed_t fixed_from_double(double value, int decimals);
+double fixed_to_double(fixed_t value, int decimals);
+fixed_t fixed_rescale(fixed_t value, int from_decimals, int to_decimals);
+fixed_t fixed_mul(fixed_t a, fixed_t b, int b_decimals);
+fixed_t fixed_div(fixed_t a, fixed_t b, int result_decimals);
+const char *fixed_str(fixed_t value, int decimals);
+fixed_t price_parse(const char *value, size_t len);
+fixed_t amount_parse(const char *value, size_t len);
+fixed_t to_price(double value);
+fixed_t to_amount(double value);
+double price_double(fixed_t price);
+double amount_double(fixed_t amount);
+const char *price_str(fixed_t price);
+const char *amount_str(fixed_t amount);
+fixed_t price_floor(fixed_t price);
+fixed_t price_units(long units);
+fixed_t cost_of(fixed_t price, fixed_t amount);
+fixed_t amount_for(fixed_t cost, fixed_t price);
+fixed_t fee_of(fixed_t cost);
+void trade_load(TRADE *trade, u_int32_t size);
+
+/************ Order Book ***************/
+void book_init(ORDER_BOOK *book);
+void book_free(ORDER_BOOK *book);
+void book_clear(ORDER_BOOK *book);
+void book_set(struct book_side *side, fixed_t price, fixed_t amount);
+size_t book_rank(struct book_side *side, fixed_t price);
+long book_find(struct book_side *side, fixed_t price);
+fixed_t book_price(struct book_side *side, long i);
+fixed_t book_amount(struct book_side *side, long i);
+fixed_t book_depth(struct book_side *side, size_t levels);
+fixed_t book_distinct_price(struct book_side *side, int n);
+int book_distinct_rank(struct book_side *side, fixed_t price);
+void book_distinct_prices(struct book_side *side, const int *n, fixed_t *prices, int count);
+void book_append(struct book_side *side, fixed_t price, fixed_t amount);
+
+/************ Strategy ***************/
+void tally_init(struct tally *t, fixed_t low, fixed_t high);
+void tally_free(struct tally *t);
+void tally_ask(struct tally *t, const LOCK_PARAMS *p, fixed_t lowest_ask);
+void tally_bid(struct tally *t, const LOCK_PARAMS *p, fixed_t highest_bid);
+int lock_reprice(struct lock_state *ls, const LOCK_PARAMS *p, const struct prices *adj_price, struct order *order);
+
+/************ Response parsing ***************/
+void json_stream_init(JSON_STREAM *js, json_event handler, void *target);
+void json_stream_feed(JSON_STREAM *js, const char *data, size_t len);
+void json_stream_copy(char *dst, size_t size, const char *value, size_t len);
+void parse_order_book(JSON_STREAM *js, int event, const char *value, size_t len);
+void parse_ticker(JSON_STREAM *js, int event, const char *value, size_t len);
+void parse_last_price(JSON_STREAM *js, int event, const char *value, size_t len);
+void parse_open_order(JSON_STREAM *js, int event, const char *value, size_t len);
+void parse_balance(JSON_STREAM *js, int event, const char *value, size_t len);
+void parse_archived_orders(JSON_STREAM *js, int event, const char *value, size_t len);
 static size_t SaveRes(void *contents, size_t size, size_t nmemb, void *destination);
 TRADE get_trades(ARCHIVE_DBS *archivedbs, char *nonce, char *request_params, char *timestamp, struct authdata* a, const char *, const char *, int last);
+void archive_update(const char *trade_status);
+TRADE *archive_page_add(struct archive_page *page);
+int archive_sync(ARCHIVE_DBS *dbs, const char *trade_status);
+int archive_store(ARCHIVE_DBS *dbs, const char *trade_status, const struct archive_page *delta, TRADE *previous);
+void archive_close(void);
 
 /************ BDB Database ***************/
+int env_setup(DB_ENV **, const char *, const char *, FILE *);
+int env_close(DB_ENV *);
+int env_check(int ret);
 void initialize_archivedbs(ARCHIVE_DBS *);
 void set_db_filenames(ARCHIVE_DBS *my_archive);
 int databases_setup(ARCHIVE_DBS *, const char *, FILE *);
-int open_database(DB **, const char *, const char *,
-                  FILE *);
+int open_database(DB **, DB_ENV *, const char *, const char *, const char *,
+                  FILE *, int);
+size_t trades_query(ARCHIVE_DBS *dbs, const TRADE_QUERY *q, TRADE *out, size_t max);
+int64_t trade_time_ms(const char *time);
+int columns_open(COLUMN_STORE *cols, const char *trades_db_name);
+int columns_append(COLUMN_STORE *cols, const TRADE *trades, size_t count);
+void columns_close(COLUMN_STORE *cols);
+int columns_rebuild(ARCHIVE_DBS *dbs);
+int archive_rows_get(ARCHIVE_DBS *dbs, DB_TXN *txn, uint64_t *rows);
+int archive_rows_put(ARCHIVE_DBS *dbs, DB_TXN *txn, uint64_t rows);
+int archive_rekey(ARCHIVE_DBS *dbs);
+void trade_stats(const COLUMN_STORE *cols, int64_t from_ms, int64_t to_ms, TRADE_STATS *stats);
 int databases_close(ARCHIVE_DBS *);
 
 int db_create(DB **dbp, DB_ENV *dbenv, u_int32_t flags);
@@ -109,7 +1058,35 @@ int db_env_create(DB_ENV **dbenvp, u_int32_t flags);
 
 /***************************** GLOBAL VARIABLES ********************************/
 
-json_t *open_orders_root, *cancel_orders_root, *account_balance_root, *archived_orders_root;
+HTTP_TRANSPORT transport;
+SIGNER signer;                      /* CEX.io credentials */
+NONCE_SERVICE nonces;
+
+// market registry, one shard per market
+MARKET markets[MAX_MARKETS];
+int nmarkets;
+SHARD shards[MAX_MARKETS];
+int nshards;
+
+// per thread: every thread drives its own transfers and owns its tick memory
+_Thread_local REQUEST_ENGINE engine;
+_Thread_local ARENA tick_arena;
+_Thread_local CURL *sync_handles[MAX_HTTP_POOLS];  /* Getjson/Getstream handle per pool */
+_Thread_local SHARD *shard;                         /* market the thread works on, see shard_enter */
+_Thread_local MARKET *market;
+_Thread_local API_ENDPOINTS *api;
+_Thread_local struct transfer_times last_transfer;
+_Thread_local RING *notice_ring;    /* NULL: the shard's notices */
+
+atomic_int running = 1;
+DB_ENV *archive_env;                /* opened once, see env_setup */
+pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;  /* the database handles are not DB_THREAD */
+
+RENDERER screen;                    /* UI thread only */
+RECORDER recorder;                  /* -r, see recorder_start */
+HISTOGRAM latency[STAGES];          /* per stage, see stage_record */
+volatile sig_atomic_t latency_requested;    /* SIGUSR1, dumped by the UI or control loop */
+FILE *trace_fp;                     /* -t, see trace_start */
 
 
 /***************************** END GLOBAL VARIABLES ****************************/
@@ -123,9 +1100,17 @@ json_t *open_orders_root, *cancel_orders_root, *account_balance_root, *archived_
 
 void initialize_archivedbs(ARCHIVE_DBS *my_archive)
 {
+    my_archive->db_envp = archive_env;
     my_archive->db_home_dir = DEFAULT_HOMEDIR;
     my_archive->trades_dbp = NULL;
     my_archive->trades_db_name = NULL;
+    my_archive->index_db_name = NULL;
+    my_archive->sync_dbp = NULL;
+    memset(&my_archive->columns, 0, sizeof(COLUMN_STORE));
+    for (int i = 0; i < TRADE_COLUMNS; i++)
+        my_archive->columns.fd[i] = -1;
+    for (int i = 0; i < TRADE_INDEXES; i++)
+        my_archive->index_dbp[i] = NULL;
 }
 /*------------------- end initialize_archivedbs ----------------------------------------*/
 
@@ -135,31 +1120,145 @@ void set_db_filenames(ARCHIVE_DBS *my_archive)
 {
     size_t size;
     
-    /* Create the Trades DB file name */
-    size = strlen(my_archive->db_home_dir) + strlen(TRADESDB) + 1;
+    /* Create the Trades DB file name, one database per market */
+    size = strlen(my_archive->db_home_dir) + strlen(market->db_name) + 1;
     my_archive->trades_db_name = malloc(size);
-    snprintf(my_archive->trades_db_name, size, "%s%s", my_archive->db_home_dir, TRADESDB);
+    snprintf(my_archive->trades_db_name, size, "%s%s", my_archive->db_home_dir, market->db_name);
+    
+    /* And the file of its indexes next to it */
+    size += strlen(".idx");
+    my_archive->index_db_name = malloc(size);
+    snprintf(my_archive->index_db_name, size, "%s%s.idx", my_archive->db_home_dir, market->db_name);
 }
 /*------------------- end setup home directories ----------------------------------------*/
 
 
+/*--------------------------------- env_setup ----------------------------------------*/
+
+/*
+ * Databases that were created before there was an environment carry no log sequence
+ * numbers this environment knows, they are adopted (lsn_reset) when it is first created.
+ */
+static int env_adopt = 0;
+
+/*
+ * An environment was created in home before: it keeps a log file there, the newest one
+ * is never removed, or its region files. Log 1 alone goes once logs are removed.
+ */
+static int env_exists(const char *home)
+{
+    DIR *dir = opendir(home[0] ? home : ".");
+    struct dirent *entry;
+    int found = 0;
+    
+    if (dir == NULL)
+        return (0);
+    while (!found && (entry = readdir(dir)) != NULL)
+        found = strncmp(entry->d_name, "log.", 4) == 0 || strncmp(entry->d_name, "__db.", 5) == 0;
+    closedir(dir);
+    return (found);
+}
+
+/*
+ * Set once the environment panicked or an operation answered DB_RUNRECOVERY. Every
+ * handle in it is useless from then on, archive_recover opens them all again.
+ */
+static atomic_int env_failed = 0;
+
+static void env_event(DB_ENV *envp, u_int32_t event, void *info)
+{
+    if (event == DB_EVENT_PANIC)
+        atomic_store(&env_failed, 1);
+}
+
+/* Notes a DB_RUNRECOVERY, true once the environment has to be recovered */
+int env_check(int ret)
+{
+    if (ret == DB_RUNRECOVERY)
+        atomic_store(&env_failed, 1);
+    return (atomic_load(&env_failed));
+}
+
+/* Opens the environment the trades databases live in, once for the whole process */
+int env_setup(DB_ENV **envpp,               /* The environment handle we are opening */
+              const char *home,             /* Directory of the environment and databases */
+              const char *program_name,     /* Name of the program calling this function */
+              FILE *error_file_pointer)     /* File where we want error messages sent */
+{
+    DB_ENV *envp;
+    u_int32_t env_flags;
+    int ret;
+    
+    env_adopt = !env_exists(home);
+    
+    ret = db_env_create(&envp, 0);
+    if (ret != 0) {
+        fprintf(error_file_pointer, "%s: %s\n", program_name,
+                db_strerror(ret));
+        return(ret);
+    }
+    *envpp = envp;
+    envp->set_errfile(envp, error_file_pointer);
+    envp->set_errpfx(envp, program_name);
+    
+    /* Pages of every market's trades stay cached between syncs */
+    envp->set_cachesize(envp, 0, ARCHIVE_CACHE_BYTES, 1);
+    /* Log files of checkpointed transactions are not needed for recovery */
+    envp->log_set_config(envp, DB_LOG_AUTO_REMOVE, 1);
+    envp->set_event_notify(envp, env_event);
+    
+    /*
+     * Transactions make a sync all or nothing; commits of several markets that are
+     * flushing at the same time share one log write (group commit). Several ctrader
+     * processes share the environment: DB_REGISTER runs the recovery only when no
+     * other process is attached, or one of them died inside it.
+     */
+    env_flags = DB_CREATE | DB_INIT_MPOOL | DB_INIT_TXN | DB_INIT_LOG | DB_INIT_LOCK | DB_RECOVER | DB_REGISTER | DB_THREAD;
+    ret = envp->open(envp, home, env_flags, 0);
+    if (ret != 0) {
+        envp->err(envp, ret, "Environment '%s' open failed.", home);
+        envp->close(envp, 0);
+        *envpp = NULL;
+        return(ret);
+    }
+    return (0);
+}
+
+/* Checkpoints and closes the environment */
+int env_close(DB_ENV *envp)
+{
+    if (envp == NULL)
+        return (0);
+    envp->txn_checkpoint(envp, 0, 0, 0);
+    return envp->close(envp, 0);
+}
+/*--------------------------------- end env_setup ----------------------------------------*/
+
+
 /*--------------------------------- open_database ----------------------------------------*/
 
-/* Opens a database */
+/* Opens a database, inside envp unless it is NULL */
 
 int open_database(DB **dbpp,       /* The DB handle that we are opening */
+                  DB_ENV *envp,              /* The environment it lives in */
                   const char *file_name,     /* The file in which the db lives */
+                  const char *db_name,       /* Logical db name, NULL: the whole file */
                   const char *program_name,  /* Name of the program calling this
                                               * function */
-                  FILE *error_file_pointer)  /* File where we want error messages
+                  FILE *error_file_pointer,  /* File where we want error messages
                                               sent */
+                  int is_secondary)          /* Index, keys repeat */
 {
     DB *dbp;    /* For convenience */
     u_int32_t open_flags;
     int ret;
     
+    /* A database file from before the environment existed */
+    if (envp != NULL && env_adopt && access(file_name, F_OK) == 0)
+        envp->lsn_reset(envp, file_name, 0);
+    
     /* Initialize the DB handle */
-    ret = db_create(&dbp, NULL, 0);
+    ret = db_create(&dbp, envp, 0);
     if (ret != 0) {
         fprintf(error_file_pointer, "%s: %s\n", program_name,
                 db_strerror(ret));
@@ -173,14 +1272,29 @@ int open_database(DB **dbpp,       /* The DB handle that we are opening */
     dbp->set_errfile(dbp, error_file_pointer);
     dbp->set_errpfx(dbp, program_name);
     
-    /* Set the open flags */
+    /*
+     * If this is a secondary database, then we want to allow
+     * sorted duplicates.
+     */
+    if (is_secondary) {
+        ret = dbp->set_flags(dbp, DB_DUPSORT);
+        if (ret != 0) {
+            dbp->err(dbp, ret, "Attempt to set DUPSORT flags on '%s' failed.",
+                     file_name);
+            return (ret);
+        }
+    }
+    
+    /* Set the open flags, opening is a transaction of its own in an environment */
     open_flags = DB_CREATE;
+    if (envp != NULL)
+        open_flags |= DB_AUTO_COMMIT;
     
     /* Now open the database */
     ret = dbp->open(dbp,        /* Pointer to the database */
                     NULL,       /* Txn pointer */
                     file_name,  /* File name */
-                    NULL,       /* Logical db name (unneeded) */
+                    db_name,    /* Logical db name */
                     DB_BTREE,   /* Database type (using btree) */
                     open_flags, /* Open flags */
                     0);         /* File mode. Using defaults */
@@ -193,24 +1307,524 @@ int open_database(DB **dbpp,       /* The DB handle that we are opening */
 }
 /*--------------------------------- end open_database ----------------------------------------*/
 
-/*--------------------------------- databases_setup ----------------------------------------*/
-/* opens all databases */
-int
-databases_setup(ARCHIVE_DBS *my_archive, const char *program_name,
-                FILE *error_file_pointer)
+/*--------------------------------- trade indexes ----------------------------------------*/
+
+/*
+ * Index keys are the indexed value followed by lastTxTime, so one index answers "these
+ * trades between T1 and T2" in time order. ISO 8601 times sort as text. Type and
+ * profit are copied up to their terminator and zero padded, whatever followed it in
+ * older records.
+ */
+#define TRADE_TIME_LEN sizeof(((TRADE *)0)->time)
+#define TRADE_INDEX_KEY_MAX (sizeof(((TRADE *)0)->type) + TRADE_TIME_LEN)
+
+static const char *trade_index_names[TRADE_INDEXES] = { "time", "type", "profit" };
+
+/* time NULL: after any time */
+static u_int32_t trade_index_key(int index, const char *value, const char *time, char *key)
 {
-    int ret;
-    
-    /* Open the trades database */
-    ret = open_database(&(my_archive->trades_dbp),
-                        my_archive->trades_db_name,
-                        program_name, error_file_pointer);
-    if (ret != 0)
-    /*
-     * Error reporting is handled in open_database() so just return
-     * the return code here.
-     */
-        return (ret);
+    size_t prefix = index == BY_TYPE ? sizeof(((TRADE *)0)->type) :
+                    index == BY_PROFIT ? sizeof(((TRADE *)0)->profit) : 0;
+    
+    memset(key, 0, prefix);
+    if (value != NULL)
+        strncpy(key, value, prefix);
+    if (time != NULL)
+        strncpy(key + prefix, time, TRADE_TIME_LEN);
+    else
+        memset(key + prefix, 0xff, TRADE_TIME_LEN);
+    return (u_int32_t)(prefix + TRADE_TIME_LEN);
+}
+
+/* Builds the secondary key of a trades record, trade_v1 has the same text fields */
+static int trade_index_record(int index, const DBT *pdata, DBT *skey)
+{
+    const TRADE *trade = (const TRADE *)pdata->data;
+    char *key;
+    
+    if (pdata->size < offsetof(TRADE, profit) + sizeof(trade->profit))
+        return (DB_DONOTINDEX);
+    key = malloc(TRADE_INDEX_KEY_MAX);
+    if (key == NULL)
+        return (ENOMEM);
+    memset(skey, 0, sizeof(DBT));
+    skey->size = trade_index_key(index, index == BY_TYPE ? trade->type : trade->profit, trade->time, key);
+    skey->data = key;
+    skey->flags = DB_DBT_APPMALLOC;     /* BDB frees it */
+    return (0);
+}
+
+static int index_by_time(DB *sdbp, const DBT *pkey, const DBT *pdata, DBT *skey)
+{
+    return trade_index_record(BY_TIME, pdata, skey);
+}
+
+static int index_by_type(DB *sdbp, const DBT *pkey, const DBT *pdata, DBT *skey)
+{
+    return trade_index_record(BY_TYPE, pdata, skey);
+}
+
+static int index_by_profit(DB *sdbp, const DBT *pkey, const DBT *pdata, DBT *skey)
+{
+    return trade_index_record(BY_PROFIT, pdata, skey);
+}
+
+static int (*const trade_index_callbacks[TRADE_INDEXES])(DB *, const DBT *, const DBT *, DBT *) = {
+    index_by_time, index_by_type, index_by_profit
+};
+
+/*
+ * Trades matching q into out, at most max of them; returns how many. Walks the index
+ * that covers the query from one end of the range to the other, nothing outside the
+ * range is read. A query on both type and profit walks the type index.
+ */
+size_t trades_query(ARCHIVE_DBS *dbs, const TRADE_QUERY *q, TRADE *out, size_t max)
+{
+    int index = q->type ? BY_TYPE : q->profit ? BY_PROFIT : BY_TIME;
+    char profit[2] = { q->profit, 0 };
+    const char *value = index == BY_TYPE ? q->type : index == BY_PROFIT ? profit : NULL;
+    char low[TRADE_INDEX_KEY_MAX], high[TRADE_INDEX_KEY_MAX], found[TRADE_INDEX_KEY_MAX];
+    char order_id[sizeof(((TRADE *)0)->order_id)];
+    u_int32_t len;
+    DBC *cursorp;
+    DBT skey, pkey, pdata;
+    size_t count = 0;
+    int ret;
+    
+    if (max == 0 || dbs->index_dbp[index] == NULL)
+        return (0);
+    len = trade_index_key(index, value, q->from ? q->from : "", low);
+    trade_index_key(index, value, q->to, high);
+    if (dbs->index_dbp[index]->cursor(dbs->index_dbp[index], NULL, &cursorp, 0) != 0)
+        return (0);
+    
+    memset(&skey, 0, sizeof(DBT));
+    memset(&pkey, 0, sizeof(DBT));
+    memset(&pdata, 0, sizeof(DBT));
+    skey.data = found;
+    skey.ulen = sizeof(found);
+    skey.flags = DB_DBT_USERMEM;
+    pkey.data = order_id;
+    pkey.ulen = sizeof(order_id);
+    pkey.flags = DB_DBT_USERMEM;
+    pdata.ulen = sizeof(TRADE);
+    pdata.flags = DB_DBT_USERMEM;
+    
+    /* Position on the first key of the range, or on the first one past it */
+    memcpy(found, q->newest_first ? high : low, len);
+    skey.size = len;
+    pdata.data = &out[count];
+    ret = cursorp->pget(cursorp, &skey, &pkey, &pdata, DB_SET_RANGE);
+    if (q->newest_first) {
+        /* the range ends before high, the newest match is the key before it */
+        ret = cursorp->pget(cursorp, &skey, &pkey, &pdata, ret == DB_NOTFOUND ? DB_LAST : DB_PREV);
+    }
+    
+    while (ret == 0 && skey.size == len && memcmp(found, low, len) >= 0 && memcmp(found, high, len) < 0) {
+        trade_load(&out[count], pdata.size);
+        if (!q->profit || out[count].profit[0] == q->profit)
+            count++;
+        if (count == max)
+            break;
+        pdata.data = &out[count];
+        ret = cursorp->pget(cursorp, &skey, &pkey, &pdata, q->newest_first ? DB_PREV : DB_NEXT);
+    }
+    
+    cursorp->close(cursorp);
+    return (count);
+}
+/*--------------------------------- end trade indexes ----------------------------------------*/
+
+
+/*--------------------------------- trade columns ----------------------------------------*/
+// The stats read the whole history: a pass over a few mapped arrays instead of a cursor
+// step and a TRADE copy per trade.
+
+static const struct {
+    const char *name;
+    size_t width;
+} trade_column_files[TRADE_COLUMNS] = {
+    { "time", sizeof(int64_t) }, { "price", sizeof(fixed_t) }, { "amount", sizeof(fixed_t) },
+    { "fee", sizeof(fixed_t) }, { "cost", sizeof(fixed_t) }, { "side", sizeof(uint8_t) },
+    { "profit", sizeof(uint8_t) },
+};
+
+// lastTxTime "2018-04-14T12:32:44.047Z" in ms since the epoch, 0 if it does not parse
+int64_t trade_time_ms(const char *time){
+    struct tm tm = {0};
+    int64_t ms = 0;
+    if(sscanf(time, "%4d-%2d-%2dT%2d:%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    if(time[19] == '.')
+        for(int i = 20; i < 23; i++)
+            ms = ms * 10 + (isdigit((unsigned char)time[i]) ? time[i] - '0' : 0);
+    return (int64_t)timegm(&tm) * 1000 + ms;
+}
+
+static void columns_unmap(COLUMN_STORE *cols){
+    for(int c = 0; c < TRADE_COLUMNS; c++){
+        if(cols->map[c])
+            munmap((void *)cols->map[c], cols->rows * trade_column_files[c].width);
+        cols->map[c] = NULL;
+    }
+}
+
+static int columns_map(COLUMN_STORE *cols, size_t rows){
+    columns_unmap(cols);
+    cols->rows = rows;
+    if(rows == 0)
+        return 0;
+    for(int c = 0; c < TRADE_COLUMNS; c++){
+        void *map = mmap(NULL, rows * trade_column_files[c].width, PROT_READ, MAP_SHARED, cols->fd[c], 0);
+        if(map == MAP_FAILED){
+            cols->rows = 0;
+            columns_unmap(cols);
+            return -1;
+        }
+        cols->map[c] = map;
+    }
+    return 0;
+}
+
+// a column longer than the others is the tail of an append that did not finish, cut off
+int columns_open(COLUMN_STORE *cols, const char *trades_db_name){
+    size_t rows = SIZE_MAX, size = strlen(trades_db_name) + 2;
+    struct stat st;
+    
+    cols->path = malloc(size);
+    snprintf(cols->path, size, "%s.", trades_db_name);
+    for(int c = 0; c < TRADE_COLUMNS; c++){
+        char name[512];
+        snprintf(name, sizeof(name), "%s%s", cols->path, trade_column_files[c].name);
+        cols->fd[c] = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if(cols->fd[c] < 0 || fstat(cols->fd[c], &st) < 0)
+            return -1;
+        if((size_t)st.st_size / trade_column_files[c].width < rows)
+            rows = (size_t)st.st_size / trade_column_files[c].width;
+    }
+    for(int c = 0; c < TRADE_COLUMNS; c++)
+        if(ftruncate(cols->fd[c], (off_t)(rows * trade_column_files[c].width)) < 0)
+            return -1;
+    return columns_map(cols, rows);
+}
+
+static int column_write(int fd, const void *data, size_t len){
+    while(len){
+        ssize_t n = write(fd, data, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data = (const char *)data + n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// trades already in market precision (trade_load), in batches of COLUMN_BATCH
+int columns_append(COLUMN_STORE *cols, const TRADE *trades, size_t count){
+    static _Thread_local int64_t wide[TRADE_COLUMNS][COLUMN_BATCH];
+    static _Thread_local uint8_t narrow[TRADE_COLUMNS][COLUMN_BATCH];
+    size_t rows = cols->rows;
+    int ret = 0;
+    
+    if(cols->path == NULL)
+        return -1;
+    for(size_t done = 0; done < count && ret == 0; ){
+        size_t n = count - done < COLUMN_BATCH ? count - done : COLUMN_BATCH;
+        for(size_t i = 0; i < n; i++){
+            const TRADE *t = &trades[done + i];
+            wide[COL_TIME][i] = trade_time_ms(t->time);
+            wide[COL_PRICE][i] = t->price;
+            wide[COL_AMOUNT][i] = t->amount;
+            wide[COL_FEE][i] = t->fee;
+            wide[COL_COST][i] = t->cost;
+            narrow[COL_SIDE][i] = strcmp(t->type, "buy") == 0;
+            narrow[COL_PROFIT][i] = strcmp(t->profit, "y") == 0;
+        }
+        for(int c = 0; c < TRADE_COLUMNS && ret == 0; c++)
+            ret = column_write(cols->fd[c], trade_column_files[c].width == 1 ? (void *)narrow[c] : (void *)wide[c], n * trade_column_files[c].width);
+        done += n;
+        rows += ret == 0 ? n : 0;
+    }
+    if(columns_map(cols, rows) != 0)
+        return -1;
+    return ret;
+}
+
+void columns_close(COLUMN_STORE *cols){
+    columns_unmap(cols);
+    cols->rows = 0;
+    for(int c = 0; c < TRADE_COLUMNS; c++){
+        if(cols->fd[c] >= 0)
+            close(cols->fd[c]);
+        cols->fd[c] = -1;
+    }
+    free(cols->path);
+    cols->path = NULL;
+}
+
+/*
+ * Rows in trades.db, kept in its sync database and moved in the transaction that
+ * stores the trades. The columns are appended after that commit, so a store with a
+ * different count missed an append and is rebuilt. Read inside that transaction, it
+ * holds the write lock on the sync database by then.
+ */
+int archive_rows_get(ARCHIVE_DBS *dbs, DB_TXN *txn, uint64_t *rows)
+{
+    DBT key, data;
+    
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = "rows";
+    key.size = 4;
+    data.data = rows;
+    data.ulen = sizeof(uint64_t);
+    data.flags = DB_DBT_USERMEM;
+    if (dbs->sync_dbp == NULL)
+        return (DB_NOTFOUND);
+    return (dbs->sync_dbp->get(dbs->sync_dbp, txn, &key, &data, 0));
+}
+
+int archive_rows_put(ARCHIVE_DBS *dbs, DB_TXN *txn, uint64_t rows)
+{
+    DBT key, data;
+    
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = "rows";
+    key.size = 4;
+    data.data = &rows;
+    data.size = sizeof(uint64_t);
+    if (dbs->sync_dbp == NULL)
+        return (0);
+    return (dbs->sync_dbp->put(dbs->sync_dbp, txn, &key, &data, 0));
+}
+
+/*
+ * Trades used to be keyed by the first sizeof(long) bytes of their order id. Those
+ * records move to the full order_id key in one transaction, or go if a sync already
+ * stored the same trade under it. A "keys" entry in the sync database marks it done.
+ */
+int archive_rekey(ARCHIVE_DBS *dbs)
+{
+    DB_ENV *envp = dbs->db_envp;
+    DB_TXN *txn = NULL;
+    DBC *cursorp;
+    DBT key, data, done;
+    TRADE trade;
+    u_int32_t key_size = sizeof(trade.order_id), keyed = 0;
+    uint64_t rows = 0;
+    size_t removed = 0;
+    int ret;
+    
+    memset(&done, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    done.data = "keys";
+    done.size = 4;
+    data.data = &keyed;
+    data.ulen = sizeof(keyed);
+    data.flags = DB_DBT_USERMEM;
+    if (dbs->sync_dbp == NULL ||
+        dbs->sync_dbp->get(dbs->sync_dbp, NULL, &done, &data, 0) == 0)
+        return (0);
+    if (envp != NULL && (ret = envp->txn_begin(envp, NULL, &txn, 0)) != 0)
+        return (ret);
+    if ((ret = dbs->trades_dbp->cursor(dbs->trades_dbp, txn, &cursorp, 0)) != 0) {
+        if (txn != NULL)
+            txn->abort(txn);
+        return (ret);
+    }
+    
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    while ((ret = cursorp->get(cursorp, &key, &data, DB_NEXT)) == 0) {
+        if (key.size == key_size || data.size > sizeof(TRADE))
+            continue;
+        /* the record as it is, a v1 record is converted when it is read */
+        memset(&trade, 0, sizeof(TRADE));
+        memcpy(&trade, data.data, data.size);
+        key.data = trade.order_id;
+        key.size = key_size;
+        data.data = &trade;
+        ret = dbs->trades_dbp->put(dbs->trades_dbp, txn, &key, &data, DB_NOOVERWRITE);
+        if (ret == DB_KEYEXIST)
+            removed++;
+        else if (ret != 0)
+            break;
+        if ((ret = cursorp->del(cursorp, 0)) != 0)
+            break;
+    }
+    if (ret == DB_NOTFOUND)
+        ret = 0;
+    cursorp->close(cursorp);
+    
+    /* the columns held the duplicates too, the count tells them to rebuild */
+    if (ret == 0 && removed && archive_rows_get(dbs, txn, &rows) == 0)
+        ret = archive_rows_put(dbs, txn, rows - removed);
+    if (ret == 0) {
+        memset(&data, 0, sizeof(DBT));
+        data.data = &key_size;
+        data.size = sizeof(key_size);
+        ret = dbs->sync_dbp->put(dbs->sync_dbp, txn, &done, &data, 0);
+    }
+    if (txn != NULL && ret != 0)
+        txn->abort(txn);
+    else if (txn != NULL)
+        ret = txn->commit(txn, 0);
+    return (ret);
+}
+
+/* Writes the columns again from every record of trades.db, in btree order */
+int columns_rebuild(ARCHIVE_DBS *dbs)
+{
+    COLUMN_STORE *cols = &dbs->columns;
+    TRADE *batch;
+    DBC *cursorp;
+    DBT key, data;
+    size_t n = 0;
+    uint64_t rows = 0;
+    int ret;
+    
+    columns_map(cols, 0);
+    for (int c = 0; c < TRADE_COLUMNS; c++)
+        if (ftruncate(cols->fd[c], 0) < 0)
+            return (-1);
+    if (dbs->trades_dbp->cursor(dbs->trades_dbp, NULL, &cursorp, 0) != 0)
+        return (-1);
+    batch = malloc(sizeof(TRADE) * COLUMN_BATCH);
+    
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    data.ulen = sizeof(TRADE);
+    data.flags = DB_DBT_USERMEM;
+    data.data = &batch[n];
+    while ((ret = cursorp->get(cursorp, &key, &data, DB_NEXT)) == 0) {
+        trade_load(&batch[n], data.size);
+        if (++n == COLUMN_BATCH) {
+            if (columns_append(cols, batch, n) != 0)
+                break;
+            rows += n;
+            n = 0;
+        }
+        data.data = &batch[n];
+    }
+    cursorp->close(cursorp);
+    if (ret == DB_NOTFOUND && columns_append(cols, batch, n) == 0) {
+        rows += n;
+        ret = archive_rows_put(dbs, NULL, rows);
+    }
+    free(batch);
+    return (ret == 0 ? 0 : -1);
+}
+
+// Branch-free over contiguous arrays so the compiler vectorizes the loop: every row
+// turns its window test into an all-ones/zero mask and the sums are masked adds.
+void trade_stats(const COLUMN_STORE *cols, int64_t from_ms, int64_t to_ms, TRADE_STATS *stats){
+    const int64_t *restrict time = cols->map[COL_TIME];
+    const fixed_t *restrict amount = cols->map[COL_AMOUNT];
+    const fixed_t *restrict fee = cols->map[COL_FEE];
+    const fixed_t *restrict cost = cols->map[COL_COST];
+    const uint8_t *restrict side = cols->map[COL_SIDE];
+    const uint8_t *restrict profit = cols->map[COL_PROFIT];
+    int64_t count = 0, buys = 0, wins = 0;
+    int64_t bought = 0, sold = 0, spent = 0, received = 0, fees = 0;
+    
+    for(size_t i = 0; i < cols->rows; i++){
+        int64_t in = -(int64_t)((time[i] >= from_ms) & (time[i] < to_ms));
+        int64_t buy = in & -(int64_t)side[i];
+        int64_t sell = in & ~buy;
+        count -= in;
+        buys -= buy;
+        wins += in & profit[i];
+        bought += amount[i] & buy;
+        sold += amount[i] & sell;
+        spent += cost[i] & buy;
+        received += cost[i] & sell;
+        fees += fee[i] & in;
+    }
+    
+    memset(stats, 0, sizeof(TRADE_STATS));
+    stats->count = (size_t)count;
+    stats->buys = (size_t)buys;
+    stats->wins = (size_t)wins;
+    stats->bought = bought;
+    stats->sold = sold;
+    stats->spent = spent;
+    stats->received = received;
+    stats->fees = fees;
+    stats->pnl = received - spent - fees;
+    stats->avg_entry = fixed_div(spent, bought, market->amount_decimals);
+    stats->win_rate = count ? (double)wins / (double)count : 0;
+}
+/*--------------------------------- end trade columns ----------------------------------------*/
+
+/*--------------------------------- databases_setup ----------------------------------------*/
+/* opens all databases */
+int
+databases_setup(ARCHIVE_DBS *my_archive, const char *program_name,
+                FILE *error_file_pointer)
+{
+    int ret;
+    
+    /* Open the trades database */
+    ret = open_database(&(my_archive->trades_dbp),
+                        my_archive->db_envp,
+                        my_archive->trades_db_name,
+                        NULL,
+                        program_name, error_file_pointer, 0);
+    if (ret != 0)
+    /*
+     * Error reporting is handled in open_database() so just return
+     * the return code here.
+     */
+        return (ret);
+    
+    /*
+     * Open the indexes and associate them with the trades database. DB_CREATE builds
+     * an index that is still empty from the trades already there.
+     */
+    for (int i = 0; i < TRADE_INDEXES; i++) {
+        ret = open_database(&(my_archive->index_dbp[i]),
+                            my_archive->db_envp,
+                            my_archive->index_db_name,
+                            trade_index_names[i],
+                            program_name, error_file_pointer, 1);
+        if (ret != 0)
+            return (ret);
+        ret = my_archive->trades_dbp->associate(my_archive->trades_dbp, NULL,
+                                                my_archive->index_dbp[i],
+                                                trade_index_callbacks[i], DB_CREATE);
+        if (ret != 0) {
+            my_archive->trades_dbp->err(my_archive->trades_dbp, ret,
+                                        "Attempt to associate index '%s' failed.", trade_index_names[i]);
+            return (ret);
+        }
+    }
+    
+    /* Open the sync marks */
+    ret = open_database(&(my_archive->sync_dbp),
+                        my_archive->db_envp,
+                        my_archive->index_db_name,
+                        "sync",
+                        program_name, error_file_pointer, 0);
+    if (ret != 0)
+        return (ret);
+    
+    /* Move trades stored under the old short keys */
+    ret = archive_rekey(my_archive);
+    if (ret != 0)
+        my_archive->trades_dbp->err(my_archive->trades_dbp, ret,
+                                    "Rekeying the trades of '%s' failed.", my_archive->trades_db_name);
+    
+    /* Open the trade columns, rebuilt from the trades if they fell behind */
+    uint64_t rows = 0;
+    if (columns_open(&my_archive->columns, my_archive->trades_db_name) != 0)
+        fprintf(stderr, "%s: trade columns of %s: %s\n", program_name, my_archive->trades_db_name, strerror(errno));
+    else if (archive_rows_get(my_archive, NULL, &rows) != 0 || rows != my_archive->columns.rows)
+        columns_rebuild(my_archive);
     
     //printf("databases opened successfully\n");
     return (0);
@@ -226,571 +1840,4812 @@ databases_close(ARCHIVE_DBS *my_archive)
     int ret;
     /*
      * Note that closing a database automatically flushes its cached data
-     * to disk, so no sync is required here.
+     * to disk, so no sync is required here. Secondaries are closed first.
      */
     
+    columns_close(&my_archive->columns);
+    
+    if (my_archive->sync_dbp != NULL) {
+        ret = my_archive->sync_dbp->close(my_archive->sync_dbp, 0);
+        if (ret != 0)
+            db_strerror(ret);
+        my_archive->sync_dbp = NULL;
+    }
+    
+    for (int i = 0; i < TRADE_INDEXES; i++) {
+        if (my_archive->index_dbp[i] != NULL) {
+            ret = my_archive->index_dbp[i]->close(my_archive->index_dbp[i], 0);
+            if (ret != 0)
+                db_strerror(ret);
+            my_archive->index_dbp[i] = NULL;
+        }
+    }
+    
     if (my_archive->trades_dbp != NULL) {
         ret = my_archive->trades_dbp->close(my_archive->trades_dbp, 0);
         if (ret != 0)
             //fprintf(stderr, "Trades database close failed: %s\n",
             db_strerror(ret);
     }
+    free(my_archive->trades_db_name);
+    my_archive->trades_db_name = NULL;
+    free(my_archive->index_db_name);
+    my_archive->index_db_name = NULL;
+    
+    //printf("databases closed.\n");
+    return (0);
+}
+/*--------------------------------- end databases_close ----------------------------------------*/
+
+
+/*------------------- create_auth_data ----------------------------------------*/
+// signed the way the exchange of the thread's market wants it
+void create_authdata(struct authdata *a, const char *nonce){
+    uint64_t start = stage_now();
+    snprintf(a->nonce, sizeof(a->nonce), "%s", nonce);
+    market->exchange->sign(a, 1);
+    stage_end(STAGE_SIGN, start);
+}
+
+// sign several requests in one go, the caller has filled in a[i].nonce
+void create_authdata_batch(struct authdata *a, size_t count){
+    uint64_t start = stage_now();
+    market->exchange->sign(a, count);
+    stage_end(STAGE_SIGN, start);
+}
+
+// CEX.io signs nonce + user id + api key
+void cex_sign(struct authdata *a, size_t count){
+    
+    char messages[8][200];
+    const char *message_ptrs[8];
+    char signatures[8][SHA256_DIGEST_LENGTH * 2 + 1];
+    
+    for(size_t done = 0; done < count; ){
+        size_t n = count - done < 8 ? count - done : 8;
+        for(size_t i = 0; i < n; i++){
+            snprintf(messages[i], sizeof(messages[i]), "%s%s", a[done+i].nonce, signer.id_apikey);
+            message_ptrs[i] = messages[i];
+        }
+        signer_sign_batch(&signer, message_ptrs, n, signatures);
+        for(size_t i = 0; i < n; i++){
+            a[done+i].apikey = signer.apikey;
+            memcpy(a[done+i].signature, signatures[i], sizeof(signatures[i]));
+        }
+        done += n;
+    }
+}
+/*----------------end create_auth_data ----------------------------------------*/
+
+/*--------------------------- signer ---------------------------------*/
+// HMAC(K, m) = H((K ^ opad) || H((K ^ ipad) || m)). Both padded key blocks are hashed
+// once in signer_init, after that a signature costs the message and one digest block.
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static void hex_encode(const unsigned char *data, size_t len, char *out){
+    for(size_t i = 0; i < len; i++){
+        out[2*i] = hex_digits[data[i] >> 4];
+        out[2*i+1] = hex_digits[data[i] & 0x0f];
+    }
+    out[2*len] = 0;
+}
+
+void signer_init(SIGNER *signer, const char *id, const char *apikey, const char *secret_key){
+    
+    unsigned char key[SHA256_CBLOCK], pad[SHA256_CBLOCK];
+    size_t keylen = strlen(secret_key);
+    
+    memset(key, 0, sizeof(key));
+    if(keylen > SHA256_CBLOCK)
+        SHA256((const unsigned char *)secret_key, keylen, key);
+    else
+        memcpy(key, secret_key, keylen);
+    
+    for(int i = 0; i < SHA256_CBLOCK; i++)
+        pad[i] = key[i] ^ 0x36;
+    SHA256_Init(&signer->inner);
+    SHA256_Update(&signer->inner, pad, SHA256_CBLOCK);
+    
+    for(int i = 0; i < SHA256_CBLOCK; i++)
+        pad[i] = key[i] ^ 0x5c;
+    SHA256_Init(&signer->outer);
+    SHA256_Update(&signer->outer, pad, SHA256_CBLOCK);
+    
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(pad, sizeof(pad));
+    snprintf(signer->apikey, sizeof(signer->apikey), "%s", apikey);
+    snprintf(signer->id_apikey, sizeof(signer->id_apikey), "%s%s", id, apikey);
+}
+
+// signature receives the uppercase hex digest, 65 bytes
+void signer_sign(const SIGNER *signer, const char *message, size_t len, char *signature){
+    
+    SHA256_CTX ctx = signer->inner;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    
+    SHA256_Update(&ctx, message, len);
+    SHA256_Final(digest, &ctx);
+    ctx = signer->outer;
+    SHA256_Update(&ctx, digest, SHA256_DIGEST_LENGTH);
+    SHA256_Final(digest, &ctx);
+    hex_encode(digest, SHA256_DIGEST_LENGTH, signature);
+    OPENSSL_cleanse(&ctx, sizeof(ctx));
+}
+
+void signer_sign_batch(const SIGNER *signer, const char *const *messages, size_t count, char (*signatures)[SHA256_DIGEST_LENGTH * 2 + 1]){
+    for(size_t i = 0; i < count; i++)
+        signer_sign(signer, messages[i], strlen(messages[i]), signatures[i]);
+}
+/*--------------------------- end signer ---------------------------------*/
+
+/*--------------------------- nonce ---------------------------------*/
+
+static uint64_t nonce_clock(NONCE_SERVICE *ns){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ns->base_us + (uint64_t)(now.tv_sec - ns->start.tv_sec) * 1000000ULL + (now.tv_nsec - ns->start.tv_nsec) / 1000;
+}
+
+// write-then-rename so a crash leaves either the old or the new reservation
+static int nonce_persist(NONCE_SERVICE *ns, uint64_t reserved){
+    char tmp[sizeof(ns->path) + 4];
+    FILE *fp;
+    int ok;
+    
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ns->path);
+    fp = fopen(tmp, "w");
+    if(fp == NULL)
+        return -1;
+    ok = fprintf(fp, "%llu\n", (unsigned long long)reserved) > 0;
+    ok = fflush(fp) == 0 && ok;
+    ok = fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, ns->path) != 0)
+        return -1;
+    atomic_store(&ns->reserved, reserved);
+    return 0;
+}
+
+int nonce_init(NONCE_SERVICE *ns, const char *path){
+    
+    struct timespec wall;
+    unsigned long long floor = 0;
+    FILE *fp;
+    
+    memset(ns, 0, sizeof(NONCE_SERVICE));
+    snprintf(ns->path, sizeof(ns->path), "%s", path);
+    pthread_mutex_init(&ns->lock, NULL);
+    
+    fp = fopen(ns->path, "r");
+    if(fp){
+        if(fscanf(fp, "%llu", &floor) != 1)
+            floor = 0;
+        fclose(fp);
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &ns->start);
+    ns->base_us = (uint64_t)wall.tv_sec * 1000000ULL + wall.tv_nsec / 1000;
+    atomic_store(&ns->last, floor ? floor - 1 : 0);
+    atomic_store(&ns->reserved, floor);   /* the first nonce moves the reservation on */
+    return 0;
+}
+
+// safe to call from several threads, each caller gets a distinct and larger value. 0 while
+// the reservation can not be written: a nonce past it could be repeated after a crash
+uint64_t nonce_next(NONCE_SERVICE *ns){
+    
+    uint64_t last = atomic_load(&ns->last), next;
+    
+    do {
+        next = nonce_clock(ns);
+        if(next <= last)
+            next = last + 1;
+    } while(!atomic_compare_exchange_weak(&ns->last, &last, next));
+    
+    if(next >= atomic_load(&ns->reserved)){
+        pthread_mutex_lock(&ns->lock);
+        if(next >= atomic_load(&ns->reserved)){
+            if(nonce_persist(ns, next + NONCE_RESERVE_US) != 0){
+                if(!ns->failing)
+                    notify(1, "nonce reservation %s not saved (%s), private requests stopped\n", ns->path, strerror(errno));
+                ns->failing = 1;
+                next = 0;
+            }else if(ns->failing){
+                notify(0, "nonce reservation saved, private requests resume\n");
+                ns->failing = 0;
+            }
+        }
+        pthread_mutex_unlock(&ns->lock);
+    }
+    return next;
+}
+
+// buffer needs room for 21 characters, NULL when there is no nonce to sign with
+char *nonce_string(NONCE_SERVICE *ns, char *buffer){
+    uint64_t nonce = nonce_next(ns);
+    if(nonce == 0)
+        return NULL;
+    sprintf(buffer, "%llu", (unsigned long long)nonce);
+    return buffer;
+}
+/*--------------------------- end nonce ---------------------------------*/
+
+
+/*------------------------------- SaveRes  ------------------------------------*/
+// CURL WRITEFUNCTION - https://curl.haxx.se/libcurl/c/getinmemory.html
+static size_t SaveRes(void *contents, size_t size, size_t nmemb, void *destination)
+{
+    size_t realsize = size * nmemb;
+    struct RespData *mem = (struct RespData *)destination;
+    if(mem->arena)
+        mem->memory = arena_grow(mem->arena, mem->memory, mem->memory ? mem->size + 1 : 0, mem->size + realsize + 1);
+    else
+        mem->memory = realloc(mem->memory, mem->size + realsize + 1);
+    if(mem->memory == NULL)
+        return 0;   /* fails the transfer with CURLE_WRITE_ERROR */
+    
+    memcpy(&(mem->memory[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->memory[mem->size]=0;
+    return realsize;
+}
+
+// CURL WRITEFUNCTION for parsed responses, chunks go straight into the json stream
+static size_t StreamRes(void *contents, size_t size, size_t nmemb, void *destination)
+{
+    size_t realsize = size * nmemb;
+    JSON_STREAM *js = (JSON_STREAM *)destination;
+    if(js->record >= 0)
+        record(js->record, js->record_stream, 0, contents, realsize);
+    json_stream_feed(js, contents, realsize);
+    return realsize;
+}
+/*------------------------------- end SaveRes ---------------------------------*/
+
+
+/*------------------------------- arena  ------------------------------------*/
+
+void arena_init(ARENA *arena, size_t capacity){
+    memset(arena, 0, sizeof(ARENA));
+    arena->base = malloc(capacity);
+    arena->capacity = arena->base ? capacity : 0;
+}
+
+// 16 byte aligned, NULL once the arena is full
+void *arena_alloc(ARENA *arena, size_t size){
+    size_t start = (arena->used + 15) & ~(size_t)15;
+    if(start + size > arena->capacity)
+        return NULL;
+    arena->last = start;
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+// realloc for arena memory: the newest allocation grows in place, anything else is copied to the top
+void *arena_grow(ARENA *arena, void *ptr, size_t old_size, size_t size){
+    void *moved;
+    if(ptr == NULL)
+        return arena_alloc(arena, size);
+    if((char *)ptr == arena->base + arena->last){
+        if(arena->last + size > arena->capacity)
+            return NULL;
+        arena->used = arena->last + size;
+        return ptr;
+    }
+    moved = arena_alloc(arena, size);
+    if(moved)
+        memcpy(moved, ptr, old_size < size ? old_size : size);
+    return moved;
+}
+
+int arena_owns(ARENA *arena, const void *ptr){
+    return arena->base && (const char *)ptr >= arena->base && (const char *)ptr < arena->base + arena->capacity;
+}
+
+void arena_reset(ARENA *arena){
+    if(arena->used > arena->high_water)
+        arena->high_water = arena->used;
+    arena->used = arena->last = 0;
+}
+
+void resp_init(struct RespData *resp, ARENA *arena){
+    resp->memory = NULL;
+    resp->size = 0;
+    resp->arena = arena;
+}
+
+// jansson allocations of the websocket messages, they never outlive the tick that parsed them
+static void *tick_json_malloc(size_t size){
+    void *ptr = arena_alloc(&tick_arena, size);
+    return ptr ? ptr : malloc(size);
+}
+
+static void tick_json_free(void *ptr){
+    if(ptr && !arena_owns(&tick_arena, ptr))
+        free(ptr);
+}
+/*------------------------------- end arena ---------------------------------*/
+
+
+/*------------------------------- endpoints  ------------------------------------*/
+
+// base_url NULL: the exchange's own
+void api_init(API_ENDPOINTS *api, const MARKET *market, const char *base_url){
+    market->exchange->endpoints(api, market, base_url ? base_url : market->exchange->api_url);
+}
+
+void cex_endpoints(API_ENDPOINTS *api, const MARKET *market, const char *base_url){
+    const char *s1 = market->symbol1, *s2 = market->symbol2;
+    
+    snprintf(api->ticker_url, sizeof(api->ticker_url), "%s/ticker/%s/%s/", base_url, s1, s2);
+    snprintf(api->lastprice_url, sizeof(api->lastprice_url), "%s/last_prices/%s/%s/", base_url, s1, s2);
+    snprintf(api->order_book_url, sizeof(api->order_book_url), "%s/order_book/%s/%s/", base_url, s1, s2);
+    snprintf(api->order_book_top_url, sizeof(api->order_book_top_url), "%s/order_book/%s/%s/?depth=1", base_url, s1, s2);
+    snprintf(api->open_order_url, sizeof(api->open_order_url), "%s/open_orders/", base_url);
+    snprintf(api->balance_url, sizeof(api->balance_url), "%s/balance/", base_url);
+    snprintf(api->place_order_url, sizeof(api->place_order_url), "%s/place_order/%s/%s/", base_url, s1, s2);
+    snprintf(api->replace_url, sizeof(api->replace_url), "%s/cancel_replace_order/%s/%s/", base_url, s1, s2);
+    snprintf(api->cancel_url, sizeof(api->cancel_url), "%s/cancel_order/", base_url);
+    snprintf(api->archived_orders_url, sizeof(api->archived_orders_url), "%s/archived_orders/%s/%s/", base_url, s1, s2);
+    
+    api->open_order_json = "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\"}";
+    api->balance_json = "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\"}";
+    api->place_order_json = "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"type\":\"%s\",\"amount\":\"%s\",\"price\":\"%s\"}";
+    api->replace_json = "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"type\":\"%s\",\"amount\":\"%s\",\"price\":\"%s\",\"order_id\":\"%s\"}";
+    api->cancel_json = "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"id\":\"%s\"}";
+    api->archived_orders_json = "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"limit\":%d%s,\"status\":\"%s\"}";
+    
+    api->decode_ticker = parse_ticker;
+    api->decode_last_price = parse_last_price;
+    api->decode_order_book = parse_order_book;
+    api->decode_open_order = parse_open_order;
+    api->decode_balance = parse_balance;
+    api->decode_archived_orders = parse_archived_orders;
+}
+/*------------------------------- end endpoints ---------------------------------*/
+
+
+/*------------------------------- markets  ------------------------------------*/
+// Exchange adapters and the registry of traded markets. Every market gets a shard with
+// its own book, open order and lock state and its own pair of threads; REST connections
+// to a host are still shared through the transport pools.
+
+static const struct fee_tier cex_fees[] = {
+    { 0, 2600, 2600 },
+};
+
+const EXCHANGE cex_exchange = {
+    "cex", "CEX.io", CEX_API_URL, CEX_WS_URL, cex_endpoints, cex_sign,
+    cex_fees, sizeof(cex_fees) / sizeof(cex_fees[0])
+};
+
+static const EXCHANGE *exchanges[] = { &cex_exchange };
+
+const EXCHANGE *exchange_find(const char *name){
+    for(size_t i = 0; i < sizeof(exchanges) / sizeof(exchanges[0]); i++){
+        if(strcmp(exchanges[i]->name, name) == 0)
+            return exchanges[i];
+    }
+    return NULL;
+}
+
+// fee in millionths for a 30 day volume
+long exchange_fee_ppm(const EXCHANGE *exchange, long volume, int maker){
+    const struct fee_tier *tier = &exchange->fees[0];
+    for(int i = 1; i < exchange->nfees && exchange->fees[i].volume <= volume; i++)
+        tier = &exchange->fees[i];
+    return maker ? tier->maker_ppm : tier->taker_ppm;
+}
+
+// "[exchange:]SYMBOL1/SYMBOL2[:price_decimals:amount_decimals]", e.g. cex:ETH/USD:2:6
+MARKET *market_add(const char *spec){
+    
+    MARKET *m;
+    char name[16] = "cex";
+    const char *pair = spec, *slash, *colon;
+    size_t len1, len2;
+    
+    if(nmarkets == MAX_MARKETS)
+        return NULL;
+    m = &markets[nmarkets];
+    memset(m, 0, sizeof(MARKET));
+    
+    colon = strchr(spec, ':');
+    slash = strchr(spec, '/');
+    if(colon && slash && colon < slash){
+        snprintf(name, sizeof(name), "%.*s", (int)(colon - spec), spec);
+        pair = colon + 1;
+    }
+    if((m->exchange = exchange_find(name)) == NULL || (slash = strchr(pair, '/')) == NULL)
+        return NULL;
+    len1 = slash - pair;
+    colon = strchr(slash + 1, ':');
+    len2 = colon ? (size_t)(colon - slash - 1) : strlen(slash + 1);
+    if(len1 == 0 || len1 >= sizeof(m->symbol1) || len2 == 0 || len2 >= sizeof(m->symbol2))
+        return NULL;
+    memcpy(m->symbol1, pair, len1);
+    memcpy(m->symbol2, slash + 1, len2);
+    
+    m->price_decimals = 2;
+    m->amount_decimals = 8;
+    if(colon && sscanf(colon + 1, "%d:%d", &m->price_decimals, &m->amount_decimals) != 2)
+        return NULL;
+    if(m->price_decimals < 0 || m->price_decimals > 8 || m->amount_decimals < 0 || m->amount_decimals > 10)
+        return NULL;
+    m->fee_ppm = exchange_fee_ppm(m->exchange, 0, 0);
+    
+    // BTC/USD on CEX.io keeps the database it had before there were other markets
+    if(strcmp(name, "cex") == 0 && strcmp(m->symbol1, "BTC") == 0 && strcmp(m->symbol2, "USD") == 0)
+        snprintf(m->db_name, sizeof(m->db_name), "%s", TRADESDB);
+    else
+        snprintf(m->db_name, sizeof(m->db_name), "trades_%s_%s%s.db", name, m->symbol1, m->symbol2);
+    
+    for(int i = 0; i < nmarkets; i++){
+        if(markets[i].exchange == m->exchange && strcmp(markets[i].symbol1, m->symbol1) == 0 && strcmp(markets[i].symbol2, m->symbol2) == 0)
+            return NULL;
+    }
+    return &markets[nmarkets++];
+}
+
+// the thread works on this market from now on, the price and order helpers follow it
+void shard_enter(SHARD *s){
+    shard = s;
+    market = s->market;
+    api = &s->api;
+}
+/*------------------------------- end markets ---------------------------------*/
+
+
+/*------------------------------- transport  ------------------------------------*/
+// One pool per exchange host. Easy handles are never cleaned up between calls so curl
+// keeps the TCP+TLS connection alive and reuses it for the next request; the pool's
+// share handle lets the handles of every thread use the same connections.
+
+void transport_init(void){
+    curl_global_init(CURL_GLOBAL_ALL);
+    memset(&transport, 0, sizeof(HTTP_TRANSPORT));
+    pthread_mutex_init(&transport.lock, NULL);
+}
+
+// the share handle is used from several threads, curl takes these around each cache
+static void transport_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr){
+    pthread_mutex_lock(&((HTTP_POOL *)userptr)->locks[data]);
+}
+
+static void transport_unlock(CURL *handle, curl_lock_data data, void *userptr){
+    pthread_mutex_unlock(&((HTTP_POOL *)userptr)->locks[data]);
+}
+
+HTTP_POOL *transport_pool(const char *url){
+    
+    HTTP_POOL *pool;
+    char host[128];
+    const char *start, *end;
+    size_t len;
+    
+    // scheme://host[:port] part of the url is the pool key
+    start = strstr(url, "://");
+    start = start ? start + 3 : url;
+    end = strchr(start, '/');
+    len = end ? (size_t)(end - url) : strlen(url);
+    if(len >= sizeof(host))
+        len = sizeof(host) - 1;
+    memcpy(host, url, len);
+    host[len] = 0;
+    
+    pthread_mutex_lock(&transport.lock);
+    for(int i = 0; i < transport.npools; i++){
+        if(strcmp(transport.pools[i].host, host) == 0){
+            pthread_mutex_unlock(&transport.lock);
+            return &transport.pools[i];
+        }
+    }
+    
+    if(transport.npools == MAX_HTTP_POOLS){
+        pthread_mutex_unlock(&transport.lock);
+        return NULL;
+    }
+    
+    pool = &transport.pools[transport.npools];
+    strcpy(pool->host, host);
+    for(int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&pool->locks[i], NULL);
+    
+    pool->share = curl_share_init();
+    curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, transport_lock);
+    curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, transport_unlock);
+    curl_share_setopt(pool->share, CURLSHOPT_USERDATA, pool);
+    curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    
+    pool->json_headers = curl_slist_append(NULL, "Content-Type: application/json");
+    
+    transport.npools++;     /* published complete, lookups above only run under the lock */
+    pthread_mutex_unlock(&transport.lock);
+    return pool;
+}
+
+// long-lived easy handle of the calling thread for sync calls, an easy handle can not be
+// used by two threads at once but the connection it keeps open is in the pool's share
+CURL *transport_handle(HTTP_POOL *pool){
+    int i = (int)(pool - transport.pools);
+    if(sync_handles[i] == NULL){
+        sync_handles[i] = curl_easy_init();
+        transport_configure(sync_handles[i], pool);
+    }
+    return sync_handles[i];
+}
+
+void transport_thread_cleanup(void){
+    for(int i = 0; i < MAX_HTTP_POOLS; i++){
+        if(sync_handles[i])
+            curl_easy_cleanup(sync_handles[i]);
+        sync_handles[i] = NULL;
+    }
+}
+
+// options every handle talking to a pooled host gets, sync (Getjson) or async (engine)
+void transport_configure(CURL *curl_handle, HTTP_POOL *pool){
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, pool->share);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, SaveRes);
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPIDLE, 30L);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPINTVL, 15L);
+    curl_easy_setopt(curl_handle, CURLOPT_SSL_SESSIONID_CACHE, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+    //curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
+}
+
+void transport_cleanup(void){
+    for(int i = 0; i < transport.npools; i++){
+        curl_share_cleanup(transport.pools[i].share);
+        curl_slist_free_all(transport.pools[i].json_headers);
+        for(int l = 0; l < CURL_LOCK_DATA_LAST; l++)
+            pthread_mutex_destroy(&transport.pools[i].locks[l]);
+    }
+    transport.npools = 0;
+    curl_global_cleanup();
+}
+/*------------------------------- end transport ---------------------------------*/
+
+
+/*------------------------------- request engine  ------------------------------------*/
+// Async requests on top of curl multi. Independent calls of one tick are submitted
+// together and complete in parallel; each one hands its response to a done callback.
+
+void engine_init(void){
+    memset(&engine, 0, sizeof(REQUEST_ENGINE));
+    engine.multi = curl_multi_init();
+    curl_multi_setopt(engine.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    for(int i = 0; i < MAX_HTTP_REQUESTS; i++){
+        engine.requests[i].curl_handle = curl_easy_init();
+    }
+}
+
+// with a parse handler the body is decoded into target as it arrives instead of being buffered
+HTTP_REQUEST *engine_submit(const char *url, const char *post_params, json_event parse, void *target, request_done done, void *userdata){
+    
+    HTTP_REQUEST *req = NULL;
+    HTTP_POOL *pool = transport_pool(url);
+    if(pool == NULL)
+        return NULL;
+    
+    for(int i = 0; i < MAX_HTTP_REQUESTS; i++){
+        if(!engine.requests[i].in_use){
+            req = &engine.requests[i];
+            break;
+        }
+    }
+    if(req == NULL)
+        return NULL;
+    
+    req->in_use = 1;
+    req->stage = stage_endpoint(url);
+    req->done = done;
+    req->userdata = userdata;
+    req->result = CURLE_OK;
+    req->response.size = 0;
+    if(req->response.memory)
+        req->response.memory[0] = 0;
+    
+    transport_configure(req->curl_handle, pool);
+    if(parse){
+        json_stream_init(&req->stream, parse, target);
+        curl_easy_setopt(req->curl_handle, CURLOPT_WRITEFUNCTION, StreamRes);
+        curl_easy_setopt(req->curl_handle, CURLOPT_WRITEDATA, (void *)&req->stream);
+    }else{
+        curl_easy_setopt(req->curl_handle, CURLOPT_WRITEDATA, (void *)&req->response);
+    }
+    curl_easy_setopt(req->curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(req->curl_handle, CURLOPT_PRIVATE, (void *)req);
+    if(post_params != NULL){
+        strncpy(req->post_params, post_params, sizeof(req->post_params) - 1);
+        curl_easy_setopt(req->curl_handle, CURLOPT_POSTFIELDS, req->post_params);
+        curl_easy_setopt(req->curl_handle, CURLOPT_HTTPHEADER, pool->json_headers);
+    }else{
+        curl_easy_setopt(req->curl_handle, CURLOPT_HTTPHEADER, NULL);
+        curl_easy_setopt(req->curl_handle, CURLOPT_HTTPGET, 1L);
+    }
+    
+    curl_multi_add_handle(engine.multi, req->curl_handle);
+    engine.pending++;
+    return req;
+}
+
+// drive transfers for up to timeout_ms, fire callbacks of finished ones, return how many are left
+int engine_perform(int timeout_ms){
+    
+    int running, msgs;
+    CURLMsg *msg;
+    HTTP_REQUEST *req;
+    
+    curl_multi_perform(engine.multi, &running);
+    if(running)
+        curl_multi_poll(engine.multi, NULL, 0, timeout_ms, NULL);
+    curl_multi_perform(engine.multi, &running);
+    
+    while((msg = curl_multi_info_read(engine.multi, &msgs))){
+        if(msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+        req->result = msg->data.result;
+        stage_request(req->curl_handle, req->stage);
+        curl_multi_remove_handle(engine.multi, req->curl_handle);
+        engine.pending--;
+        if(req->stream.record >= 0)
+            record(req->stream.record, req->stream.record_stream, RECORD_END, NULL, 0);
+        // callbacks may submit follow-up requests, so the slot is released first
+        req->in_use = 0;
+        if(req->done)
+            req->done(req, req->userdata);
+    }
+    return engine.pending;
+}
+
+void engine_wait(void){
+    while(engine_perform(100))
+        ;
+}
+
+void engine_cleanup(void){
+    for(int i = 0; i < MAX_HTTP_REQUESTS; i++){
+        if(engine.requests[i].in_use)
+            curl_multi_remove_handle(engine.multi, engine.requests[i].curl_handle);
+        curl_easy_cleanup(engine.requests[i].curl_handle);
+        free(engine.requests[i].response.memory);
+    }
+    curl_multi_cleanup(engine.multi);
+}
+
+// no open order means the balance is needed too, chain it while the rest of the tick is in flight
+void on_open_orders(HTTP_REQUEST *req, void *userdata){
+    struct balance_chain *chain = (struct balance_chain *)userdata;
+    char request_params[3000];
+    
+    if (!chain->wanted || chain->open_order->type[0])
+        return;
+    
+    sprintf(request_params, chain->json, chain->auth->apikey, chain->auth->signature, chain->auth->nonce);
+    engine_submit(chain->url, request_params, api->decode_balance, chain->balance, NULL, NULL);
+}
+/*------------------------------- end request engine ---------------------------------*/
+
+
+/*------------------------------- latency  ------------------------------------*/
+// Per stage histograms of how long things take, see enum stage. Timestamps come from the
+// vDSO monotonic clock, tens of ns a call and comparable across cores, unlike a raw TSC.
+// kill -USR1 writes them to LATENCYFILE, the control socket has them as LATENCY.
+
+static const char *const stage_names[STAGES] = {
+    "dns", "connect", "tls", "server", "transfer",
+    "ticker", "last_price", "order_book", "order_book_top", "open_order",
+    "balance", "place_order", "replace", "cancel", "archived_orders",
+    "ws_parse", "publish", "reprice", "render", "sign", "sync", "history",
+};
+
+// the endpoints in the order of their stages, STAGE_TICKER on
+static const size_t stage_urls[] = {
+    offsetof(API_ENDPOINTS, ticker_url), offsetof(API_ENDPOINTS, lastprice_url),
+    offsetof(API_ENDPOINTS, order_book_url), offsetof(API_ENDPOINTS, order_book_top_url),
+    offsetof(API_ENDPOINTS, open_order_url), offsetof(API_ENDPOINTS, balance_url),
+    offsetof(API_ENDPOINTS, place_order_url), offsetof(API_ENDPOINTS, replace_url),
+    offsetof(API_ENDPOINTS, cancel_url), offsetof(API_ENDPOINTS, archived_orders_url),
+};
+
+uint64_t stage_now(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns){
+    int exponent;
+    if(ns < (1u << HIST_SUB_BITS))
+        return (int)ns;
+    exponent = 63 - __builtin_clzll(ns);
+    if(exponent > HIST_MAX_EXPONENT)
+        return HIST_BUCKETS - 1;
+    return ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((ns >> (exponent - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// highest value that lands in a bucket
+static uint64_t hist_bucket_top(int bucket){
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(bucket & ((1 << HIST_SUB_BITS) - 1)) | (1u << HIST_SUB_BITS);
+    if(shift < 0)
+        return (uint64_t)bucket;
+    return ((sub + 1) << shift) - 1;
+}
+
+void stage_record(int stage, uint64_t ns){
+    HISTOGRAM *h = &latency[stage];
+    uint64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->counts[hist_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+    while(ns > max && !atomic_compare_exchange_weak_explicit(&h->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void stage_end(int stage, uint64_t start){
+    stage_record(stage, stage_now() - start);
+}
+
+// stage of one of the thread's market endpoints, by the url it was called with; -1 if none
+int stage_endpoint(const char *url){
+    for(size_t i = 0; api && i < sizeof(stage_urls) / sizeof(stage_urls[0]); i++){
+        if(url == (const char *)api + stage_urls[i])
+            return STAGE_TICKER + (int)i;
+    }
+    return -1;
+}
+
+// a finished transfer: its phases, and the whole call for its endpoint. Name lookup,
+// connect and TLS only count when the transfer opened a connection
+void stage_request(CURL *curl_handle, int endpoint){
+    curl_off_t lookup = 0, connect = 0, tls = 0, sent = 0, first_byte = 0, total = 0;
+    long connects = 0;
+    
+    curl_easy_getinfo(curl_handle, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    curl_easy_getinfo(curl_handle, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl_handle, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl_handle, CURLINFO_PRETRANSFER_TIME_T, &sent);
+    curl_easy_getinfo(curl_handle, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl_handle, CURLINFO_NUM_CONNECTS, &connects);
+    
+    // curl's times are in us from the start of the transfer, each one includes the last
+    if(connects > 0){
+        stage_record(STAGE_DNS, (uint64_t)lookup * 1000);
+        stage_record(STAGE_CONNECT, (uint64_t)(connect - lookup) * 1000);
+        if(tls > connect)
+            stage_record(STAGE_TLS, (uint64_t)(tls - connect) * 1000);
+    }
+    if(first_byte >= sent && first_byte > 0){
+        stage_record(STAGE_SERVER, (uint64_t)(first_byte - sent) * 1000);
+        stage_record(STAGE_TRANSFER, (uint64_t)(total - first_byte) * 1000);
+    }
+    if(endpoint >= 0)
+        stage_record(endpoint, (uint64_t)total * 1000);
+}
+
+// key=value line of a stage, percentiles at the top of their bucket; 0 if nothing was recorded
+int latency_line(int stage, char *line, size_t size){
+    const HISTOGRAM *h = &latency[stage];
+    const double quantiles[] = { .5, .9, .99, .999 };
+    uint64_t at[4], count = atomic_load_explicit(&h->count, memory_order_relaxed), seen = 0;
+    int q = 0;
+    
+    if(count == 0)
+        return 0;
+    for(int b = 0; b < HIST_BUCKETS && q < 4; b++){
+        seen += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+        while(q < 4 && seen >= (uint64_t)ceil(quantiles[q] * (double)count))
+            at[q++] = hist_bucket_top(b);
+    }
+    while(q < 4)    /* counts moved on while they were read */
+        at[q++] = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    snprintf(line, size, "stage=%s count=%llu mean_ns=%llu p50_ns=%llu p90_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu",
+             stage_names[stage], (unsigned long long)count,
+             (unsigned long long)(atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / count),
+             (unsigned long long)at[0], (unsigned long long)at[1], (unsigned long long)at[2], (unsigned long long)at[3],
+             (unsigned long long)atomic_load_explicit(&h->max_ns, memory_order_relaxed));
+    return 1;
+}
+
+// counts recorded while this runs may be lost, the histograms are for looking at
+void latency_reset(void){
+    for(int s = 0; s < STAGES; s++){
+        for(int b = 0; b < HIST_BUCKETS; b++)
+            atomic_store_explicit(&latency[s].counts[b], 0, memory_order_relaxed);
+        atomic_store_explicit(&latency[s].count, 0, memory_order_relaxed);
+        atomic_store_explicit(&latency[s].sum_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&latency[s].max_ns, 0, memory_order_relaxed);
+    }
+}
+
+static void latency_signal(int sig){
+    latency_requested = 1;
+}
+
+// after a SIGUSR1, appends every stage to LATENCYFILE under a time line
+void latency_dump(void){
+    char line[256];
+    time_t now = time(NULL);
+    FILE *fp;
+    
+    if(!latency_requested)
+        return;
+    latency_requested = 0;
+    if((fp = fopen(DEFAULT_HOMEDIR LATENCYFILE, "a")) == NULL)
+        return;
+    fprintf(fp, "time=%lld\n", (long long)now);
+    for(int s = 0; s < STAGES; s++){
+        if(latency_line(s, line, sizeof(line)))
+            fprintf(fp, "%s\n", line);
+    }
+    fclose(fp);
+}
+/*------------------------------- end latency ---------------------------------*/
+
+
+/*------------------------------- fixed point  ------------------------------------*/
+// Decimal text goes straight to integers, no double in between, so "6512.37" is always
+// 651237 and two prices that print the same compare equal. Digits past the market's
+// precision are rounded half away from zero.
+
+static const int64_t fixed_pow10[FIXED_MAX_DECIMALS + 1] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL,
+    1000000000LL, 10000000000LL, 100000000000LL, 1000000000000LL, 10000000000000LL,
+    100000000000000LL, 1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL
+};
+
+fixed_t fixed_parse(const char *value, size_t len, int decimals){
+    int64_t units = 0;
+    int seen = 0, dot = 0, negative = 0, round_up = 0;
+    size_t i = 0;
+    
+    if(len && (value[0] == '-' || value[0] == '+')){
+        negative = (value[0] == '-');
+        i++;
+    }
+    for(; i < len; i++){
+        if(value[i] >= '0' && value[i] <= '9'){
+            if(dot && seen == decimals){
+                // first digit past the precision decides the rounding, the rest are dropped
+                round_up = (value[i] >= '5');
+                while(i + 1 < len && value[i+1] >= '0' && value[i+1] <= '9')
+                    i++;
+                continue;
+            }
+            units = units * 10 + (value[i] - '0');
+            if(dot)
+                seen++;
+        }else if(value[i] == '.' && !dot){
+            dot = 1;
+        }else{
+            break;
+        }
+    }
+    if(i < len && (value[i] == 'e' || value[i] == 'E')){
+        // exponent notation, rare enough to go through libc
+        char buffer[64];
+        if(len >= sizeof(buffer))
+            len = sizeof(buffer) - 1;
+        memcpy(buffer, value, len);
+        buffer[len] = 0;
+        return fixed_from_double(strtod(buffer, NULL), decimals);
+    }
+    units = units * fixed_pow10[decimals - seen] + round_up;
+    return negative ? -units : units;
+}
+
+fixed_t fixed_from_double(double value, int decimals){
+    return (fixed_t)llround(value * (double)fixed_pow10[decimals]);
+}
+
+double fixed_to_double(fixed_t value, int decimals){
+    return (double)value / (double)fixed_pow10[decimals];
+}
+
+fixed_t fixed_rescale(fixed_t value, int from_decimals, int to_decimals){
+    if(to_decimals >= from_decimals)
+        return value * fixed_pow10[to_decimals - from_decimals];
+    int64_t divisor = fixed_pow10[from_decimals - to_decimals];
+    return (value + (value < 0 ? -divisor : divisor) / 2) / divisor;
+}
+
+// a * b where b has b_decimals, the result keeps the precision of a (rounded)
+fixed_t fixed_mul(fixed_t a, fixed_t b, int b_decimals){
+    __int128 product = (__int128)a * b;
+    int64_t divisor = fixed_pow10[b_decimals];
+    return (fixed_t)((product + (product < 0 ? -divisor : divisor) / 2) / divisor);
+}
+
+// a / b with result_decimals, truncated so an amount bought with a cost never exceeds it
+fixed_t fixed_div(fixed_t a, fixed_t b, int result_decimals){
+    if(b == 0)
+        return 0;
+    return (fixed_t)(((__int128)a * fixed_pow10[result_decimals]) / b);
+}
+
+// exact decimal text for request bodies. Rotates over a few static buffers so that a
+// price and an amount can be formatted in the same sprintf call.
+const char *fixed_str(fixed_t value, int decimals){
+    static _Thread_local char buffers[4][32];  /* per thread, they all format prices */
+    static _Thread_local int next = 0;
+    char *s = buffers[next];
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    
+    next = (next + 1) % 4;
+    if(decimals == 0)
+        snprintf(s, 32, "%s%llu", value < 0 ? "-" : "", (unsigned long long)magnitude);
+    else
+        snprintf(s, 32, "%s%llu.%0*llu", value < 0 ? "-" : "",
+                 (unsigned long long)(magnitude / fixed_pow10[decimals]), decimals,
+                 (unsigned long long)(magnitude % fixed_pow10[decimals]));
+    return s;
+}
+
+// shorthands in the precision of the market being traded
+fixed_t price_parse(const char *value, size_t len){
+    return fixed_parse(value, len, market->price_decimals);
+}
+
+fixed_t amount_parse(const char *value, size_t len){
+    return fixed_parse(value, len, market->amount_decimals);
+}
+
+fixed_t to_price(double value){
+    return fixed_from_double(value, market->price_decimals);
+}
+
+fixed_t to_amount(double value){
+    return fixed_from_double(value, market->amount_decimals);
+}
+
+double price_double(fixed_t price){
+    return fixed_to_double(price, market->price_decimals);
+}
+
+double amount_double(fixed_t amount){
+    return fixed_to_double(amount, market->amount_decimals);
+}
+
+const char *price_str(fixed_t price){
+    return fixed_str(price, market->price_decimals);
+}
+
+const char *amount_str(fixed_t amount){
+    return fixed_str(amount, market->amount_decimals);
+}
+
+// whole quote units (dollars) the repricing steps in
+fixed_t price_floor(fixed_t price){
+    int64_t scale = fixed_pow10[market->price_decimals];
+    return price - ((price % scale) + scale) % scale;
+}
+
+fixed_t price_units(long units){
+    return (fixed_t)units * fixed_pow10[market->price_decimals];
+}
+
+fixed_t cost_of(fixed_t price, fixed_t amount){
+    return fixed_mul(price, amount, market->amount_decimals);
+}
+
+fixed_t amount_for(fixed_t cost, fixed_t price){
+    return fixed_div(cost, price, market->amount_decimals);
+}
+
+fixed_t fee_of(fixed_t cost){
+    return fixed_rescale(cost * market->fee_ppm, 6, 0);
+}
+
+// bring a record read from trades.db to the current market precision, converting the
+// double based layout of older databases on the way
+void trade_load(TRADE *trade, u_int32_t size){
+    if(size == sizeof(struct trade_v1)){
+        struct trade_v1 old;
+        memcpy(&old, trade, sizeof(old));
+        trade->price = to_price(old.price);
+        trade->amount = to_amount(old.amount);
+        trade->fee = to_price(old.fee);
+        trade->cost = to_price(old.cost);
+    }else if(size == sizeof(TRADE) && (trade->price_decimals != market->price_decimals || trade->amount_decimals != market->amount_decimals)){
+        trade->price = fixed_rescale(trade->price, trade->price_decimals, market->price_decimals);
+        trade->amount = fixed_rescale(trade->amount, trade->amount_decimals, market->amount_decimals);
+        trade->fee = fixed_rescale(trade->fee, trade->price_decimals, market->price_decimals);
+        trade->cost = fixed_rescale(trade->cost, trade->price_decimals, market->price_decimals);
+    }
+    trade->price_decimals = market->price_decimals;
+    trade->amount_decimals = market->amount_decimals;
+}
+/*------------------------------- end fixed point ---------------------------------*/
+
+
+/*------------------------------- scheduler  ------------------------------------*/
+// Wall-clock cadence per data source instead of loop counters. Each timer also carries a
+// request budget per minute; a timer that fires with its budget spent is pushed to the
+// start of the next window, so the sum of the budgets bounds what we send the exchange.
+
+uint64_t mono_ms(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sched_arm(SCHEDULER *sched, SCHED_TIMER *timer, uint64_t due_ms){
+    SCHED_TIMER **slot = &sched->wheel[(due_ms / WHEEL_TICK_MS) % WHEEL_SLOTS];
+    timer->due_ms = due_ms;
+    timer->next = *slot;
+    *slot = timer;
+    timer->armed = 1;
+}
+
+void sched_init(SCHEDULER *sched){
+    memset(sched, 0, sizeof(SCHEDULER));
+    sched->cursor_ms = mono_ms() / WHEEL_TICK_MS * WHEEL_TICK_MS;
+}
+
+// first fires delay_ms from now, then every interval_ms
+void sched_add(SCHEDULER *sched, int source, long interval_ms, int budget, long delay_ms){
+    SCHED_TIMER *timer = &sched->timers[source];
+    timer->source = source;
+    timer->interval_ms = interval_ms;
+    timer->budget = budget;
+    timer->spent = 0;
+    timer->window_start_ms = mono_ms();
+    sched_arm(sched, timer, timer->window_start_ms + delay_ms);
+}
+
+// ms until the earliest timer, for the poll in sched_wait
+long sched_timeout(SCHEDULER *sched){
+    uint64_t now = mono_ms(), next = UINT64_MAX;
+    for(int i = 0; i < SRC_COUNT; i++){
+        if(sched->timers[i].armed && sched->timers[i].due_ms < next)
+            next = sched->timers[i].due_ms;
+    }
+    if(next == UINT64_MAX)
+        return 1000;
+    return next > now ? (long)(next - now) : 0;
+}
+
+// flag the sources whose timer expired, returns how many did
+int sched_expire(SCHEDULER *sched, int due[SRC_COUNT]){
+    
+    uint64_t now = mono_ms();
+    SCHED_TIMER *fired[SRC_COUNT];
+    int nfired = 0, count = 0;
+    
+    memset(due, 0, sizeof(int) * SRC_COUNT);
+    
+    // visit every slot from the last cursor up to now, a full turn at most
+    for(int turn = 0; turn < WHEEL_SLOTS && sched->cursor_ms <= now; turn++){
+        SCHED_TIMER **link = &sched->wheel[(sched->cursor_ms / WHEEL_TICK_MS) % WHEEL_SLOTS];
+        while(*link){
+            SCHED_TIMER *timer = *link;
+            if(timer->due_ms <= now){
+                *link = timer->next;
+                timer->armed = 0;
+                fired[nfired++] = timer;
+            }else{
+                link = &timer->next;
+            }
+        }
+        sched->cursor_ms += WHEEL_TICK_MS;
+    }
+    if(sched->cursor_ms <= now)   /* idle for more than a turn, every slot was visited */
+        sched->cursor_ms = now / WHEEL_TICK_MS * WHEEL_TICK_MS;
+    
+    for(int i = 0; i < nfired; i++){
+        SCHED_TIMER *timer = fired[i];
+        uint64_t next = timer->due_ms + timer->interval_ms;
+        
+        if(now - timer->window_start_ms >= BUDGET_WINDOW_MS){
+            timer->window_start_ms = now;
+            timer->spent = 0;
+        }
+        if(timer->budget && timer->spent >= timer->budget){
+            sched_arm(sched, timer, timer->window_start_ms + BUDGET_WINDOW_MS);
+            continue;
+        }
+        timer->spent++;
+        due[timer->source] = 1;
+        count++;
+        if(next <= now)     /* fell behind, do not fire a burst to catch up */
+            next = now + timer->interval_ms;
+        sched_arm(sched, timer, next);
+    }
+    return count;
+}
+
+// sleep until the next timer, until fd is readable (-1: no fd) or a curl_multi_wakeup,
+// returns 1 when fd has input
+int sched_wait(SCHEDULER *sched, int fd){
+    struct curl_waitfd input = { fd, CURL_WAIT_POLLIN, 0 };
+    curl_multi_poll(engine.multi, &input, fd >= 0 ? 1 : 0, (int)sched_timeout(sched), NULL);
+    return fd >= 0 && (input.revents & CURL_WAIT_POLLIN) != 0;
+}
+/*------------------------------- end scheduler ---------------------------------*/
+
+
+/*------------------------------- order book  ------------------------------------*/
+// Price levels of one side live in contiguous arrays ordered best first, so the top of
+// book is index 0, a price is found by binary search and its index is also its rank.
+// Filled once per update and shared by the renderer, the repricing and the tally.
+// Next to the levels each side keeps its distinct whole-unit prices with the number of
+// levels in each, updated with the levels, so the lock level is a lookup, not a scan.
+
+static void book_side_init(struct book_side *side, int descending){
+    memset(side, 0, sizeof(struct book_side));
+    side->descending = descending;
+}
+
+static void book_side_reserve(struct book_side *side, size_t capacity){
+    if(capacity <= side->capacity)
+        return;
+    if(capacity < BOOK_INITIAL_LEVELS)
+        capacity = BOOK_INITIAL_LEVELS;
+    while(side->capacity < capacity)
+        side->capacity = side->capacity ? side->capacity * 2 : capacity;
+    side->price = realloc(side->price, sizeof(fixed_t) * side->capacity);
+    side->amount = realloc(side->amount, sizeof(fixed_t) * side->capacity);
+    side->depth = realloc(side->depth, sizeof(fixed_t) * side->capacity);
+}
+
+static void book_level_reserve(struct book_side *side, size_t capacity){
+    if(capacity <= side->level_capacity)
+        return;
+    if(capacity < BOOK_INITIAL_LEVELS)
+        capacity = BOOK_INITIAL_LEVELS;
+    while(side->level_capacity < capacity)
+        side->level_capacity = side->level_capacity ? side->level_capacity * 2 : capacity;
+    side->level = realloc(side->level, sizeof(fixed_t) * side->level_capacity);
+    side->level_count = realloc(side->level_count, sizeof(size_t) * side->level_capacity);
+}
+
+// number of distinct levels better than the whole-unit price
+static size_t book_level_rank(struct book_side *side, fixed_t price){
+    size_t lo = 0, hi = side->levels;
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(side->descending ? side->level[mid] > price : side->level[mid] < price)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// a price level came in (1) or went away (-1)
+static void book_level_update(struct book_side *side, fixed_t price, int change){
+    fixed_t level = price_floor(price);
+    size_t i = book_level_rank(side, level);
+    if(i < side->levels && side->level[i] == level){
+        side->level_count[i] += change;
+        if(side->level_count[i] == 0){
+            memmove(&side->level[i], &side->level[i+1], sizeof(fixed_t) * (side->levels - i - 1));
+            memmove(&side->level_count[i], &side->level_count[i+1], sizeof(size_t) * (side->levels - i - 1));
+            side->levels--;
+        }
+    }else if(change > 0){
+        book_level_reserve(side, side->levels + 1);
+        memmove(&side->level[i+1], &side->level[i], sizeof(fixed_t) * (side->levels - i));
+        memmove(&side->level_count[i+1], &side->level_count[i], sizeof(size_t) * (side->levels - i));
+        side->level[i] = level;
+        side->level_count[i] = 1;
+        side->levels++;
+    }
+}
+
+void book_init(ORDER_BOOK *book){
+    book_side_init(&book->bids, 1);
+    book_side_init(&book->asks, 0);
+}
+
+void book_free(ORDER_BOOK *book){
+    free(book->bids.price);
+    free(book->bids.amount);
+    free(book->bids.depth);
+    free(book->bids.level);
+    free(book->bids.level_count);
+    free(book->asks.price);
+    free(book->asks.amount);
+    free(book->asks.depth);
+    free(book->asks.level);
+    free(book->asks.level_count);
+    book_init(book);
+}
+
+void book_clear(ORDER_BOOK *book){
+    book->bids.count = book->asks.count = 0;
+    book->bids.levels = book->asks.levels = 0;
+    book->bids.depth_dirty = book->asks.depth_dirty = 0;
+}
+
+// number of levels better than price, i.e. the index price has or would have
+size_t book_rank(struct book_side *side, fixed_t price){
+    size_t lo = 0, hi = side->count;
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(side->descending ? side->price[mid] > price : side->price[mid] < price)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// index of the level at exactly price, -1 if there is none
+long book_find(struct book_side *side, fixed_t price){
+    size_t i = book_rank(side, price);
+    return (i < side->count && side->price[i] == price) ? (long)i : -1;
+}
+
+// set the amount at a price level, amount 0 removes the level
+void book_set(struct book_side *side, fixed_t price, fixed_t amount){
+    size_t i = book_rank(side, price);
+    if(i < side->count && side->price[i] == price){
+        if(amount == 0){
+            memmove(&side->price[i], &side->price[i+1], sizeof(fixed_t) * (side->count - i - 1));
+            memmove(&side->amount[i], &side->amount[i+1], sizeof(fixed_t) * (side->count - i - 1));
+            side->count--;
+            book_level_update(side, price, -1);
+        }else{
+            side->amount[i] = amount;
+        }
+    }else if(amount != 0){
+        book_side_reserve(side, side->count + 1);
+        memmove(&side->price[i+1], &side->price[i], sizeof(fixed_t) * (side->count - i));
+        memmove(&side->amount[i+1], &side->amount[i], sizeof(fixed_t) * (side->count - i));
+        side->price[i] = price;
+        side->amount[i] = amount;
+        side->count++;
+        book_level_update(side, price, 1);
+    }
+    side->depth_dirty = 1;
+}
+
+// add a level behind the current worst one, for responses that come sorted already
+void book_append(struct book_side *side, fixed_t price, fixed_t amount){
+    book_side_reserve(side, side->count + 1);
+    side->price[side->count] = price;
+    side->amount[side->count] = amount;
+    side->count++;
+    if(side->levels && side->level[side->levels-1] == price_floor(price)){
+        side->level_count[side->levels-1]++;
+    }else{
+        book_level_reserve(side, side->levels + 1);
+        side->level[side->levels] = price_floor(price);
+        side->level_count[side->levels] = 1;
+        side->levels++;
+    }
+    side->depth_dirty = 1;
+}
+
+// out of range levels read as 0, the same as a missing json array element did
+fixed_t book_price(struct book_side *side, long i){
+    return (i >= 0 && i < (long)side->count) ? side->price[i] : 0;
+}
+
+fixed_t book_amount(struct book_side *side, long i){
+    return (i >= 0 && i < (long)side->count) ? side->amount[i] : 0;
+}
+
+// cumulative amount of the best `levels` levels
+fixed_t book_depth(struct book_side *side, size_t levels){
+    if(side->count == 0 || levels == 0)
+        return 0;
+    if(side->depth_dirty){
+        fixed_t total = 0;
+        for(size_t i = 0; i < side->count; i++){
+            total += side->amount[i];
+            side->depth[i] = total;
+        }
+        side->depth_dirty = 0;
+    }
+    return side->depth[(levels < side->count ? levels : side->count) - 1];
+}
+
+// n-th (1 based) distinct whole-dollar price from the top, 0 if the book is not that deep
+fixed_t book_distinct_price(struct book_side *side, int n){
+    return (n >= 1 && (size_t)n <= side->levels) ? side->level[n-1] : 0;
+}
+
+// distinct level (1 based) price falls in, or would if it was in the book
+int book_distinct_rank(struct book_side *side, fixed_t price){
+    return (int)book_level_rank(side, price_floor(price)) + 1;
+}
+
+// several lock positions out of the same book, 0 for those deeper than it
+void book_distinct_prices(struct book_side *side, const int *n, fixed_t *prices, int count){
+    for(int i = 0; i < count; i++)
+        prices[i] = book_distinct_price(side, n[i]);
+}
+/*------------------------------- end order book ---------------------------------*/
+
+
+/*------------------------------- strategy  ------------------------------------*/
+// The decisions of the order thread without its I/O, so the backtest runs the same code.
+
+void tally_init(struct tally *t, fixed_t low, fixed_t high){
+    memset(t, 0, sizeof(struct tally));
+    t->midpoint = price_floor((high + low) / 2);
+    t->step = price_units(1) / 10;
+    t->step = t->step > 0 ? t->step : 1;     /* whole-unit prices, a slot per unit */
+    t->ask_size = (int)((price_floor(high) - t->midpoint) / t->step);
+    t->bid_size = (int)((t->midpoint - price_floor(low)) / t->step);
+    t->ask_size = t->ask_size > 0 ? t->ask_size : 0;
+    t->bid_size = t->bid_size > 0 ? t->bid_size : 0;
+    t->ask = calloc(t->ask_size + 1, sizeof(int));
+    t->bid = calloc(t->bid_size + 1, sizeof(int));
+}
+
+void tally_free(struct tally *t){
+    free(t->ask);
+    free(t->bid);
+    t->ask = t->bid = NULL;
+}
+
+// once samples counts are in, the most seen slot (the last of equals) is the target
+static fixed_t tally_pick(struct tally *t, const int *slots, int size, int direction){
+    fixed_t target = 0;
+    for(int i = 0; i < size; i++){
+        if(slots[i]){ //SKIP ELEMENTS == 0
+            fixed_t order_price = t->midpoint + direction * i * t->step;
+            if(slots[i] >= t->best){
+                t->best = slots[i];
+                target = order_price;
+            }
+            if(t->verbose)
+                notify(0, "%.02f - %d\n", price_double(order_price), slots[i]);
+        }
+    }
+    return target;
+}
+
+void tally_ask(struct tally *t, const LOCK_PARAMS *p, fixed_t lowest_ask){
+    // index = (p - m) * 10
+    int i = (int)((lowest_ask - t->midpoint) / t->step);
+    if(i < 0 || i >= t->ask_size)
+        return;     /* outside the range the tally was set up for */
+    t->ask[i]++;
+    if(++t->counter == p->ask_samples)
+        t->target_sell = tally_pick(t, t->ask, t->ask_size, 1);
+}
+
+void tally_bid(struct tally *t, const LOCK_PARAMS *p, fixed_t highest_bid){
+    int i = (int)((t->midpoint - highest_bid) / t->step);
+    if(i < 0 || i >= t->bid_size)
+        return;
+    t->bid[i]++;
+    if(++t->counter == p->bid_samples)
+        t->target_buy = tally_pick(t, t->bid, t->bid_size, -1);
+}
+
+// an order the book has moved past the lock level goes back behind it, 1 if it has to be
+// replaced. Every p->kick_count kicks the lock moves a level out, up to p->kick_max_index.
+int lock_reprice(struct lock_state *ls, const LOCK_PARAMS *p, const struct prices *adj_price, struct order *order){
+    int buy = strcmp(order->type, "buy") == 0;
+    fixed_t cost = cost_of(order->price, order->amount); //current bid cost
+    
+    if(!ls->lock_index || adj_price->lock_bid_ask == 0 || !(buy || strcmp(order->type, "sell") == 0))
+        return 0;
+    if(buy ? order->price < adj_price->lock_bid_ask : order->price > adj_price->lock_bid_ask)
+        return 0;
+    ls->kickcount++;
+    if(ls->kickcount == p->kick_count && ls->lock_index <= p->kick_max_index){
+        ls->lock_index++;
+        ls->kickcount = 0;
+    }
+    if(buy){
+        order->price = adj_price->lock_bid_ask - price_units(p->offset_units);
+        order->amount = amount_for(cost, order->price);
+    }else{
+        order->price = adj_price->lock_bid_ask + price_units(p->offset_units);
+    }
+    return 1;
+}
+/*------------------------------- end strategy ---------------------------------*/
+
+
+/*------------------------------- response parsing  ------------------------------------*/
+// Streaming decoders for the CEX.io REST responses. json_stream_feed tokenizes whatever
+// curl hands over and the parse_* handlers pick the fields they need straight into
+// typed structs, no DOM is built and no response buffer is kept.
+
+static const struct {
+    const char *name;
+    int field;
+} json_fields[] = {
+    {"bids", F_BIDS}, {"asks", F_ASKS}, {"low", F_LOW}, {"high", F_HIGH}, {"data", F_DATA},
+    {"lprice", F_LPRICE}, {"id", F_ID}, {"type", F_TYPE}, {"price", F_PRICE}, {"amount", F_AMOUNT},
+    {"available", F_AVAILABLE}, {"orderId", F_ORDERID}, {"lastTxTime", F_LASTTXTIME},
+};
+
+// keys that go "<name>:<quote currency>", e.g. "tfa:USD"
+static const struct {
+    const char *name;
+    int field;
+} json_quote_fields[] = {
+    {"tfa", F_TFA}, {"fa", F_FA}, {"tta", F_TTA}, {"ta", F_TA},
+};
+
+static int json_key_is(const char *value, size_t len, const char *name){
+    return strlen(name) == len && memcmp(name, value, len) == 0;
+}
+
+static int json_field_id(const char *value, size_t len){
+    const char *colon;
+    
+    for(size_t i = 0; i < sizeof(json_fields) / sizeof(json_fields[0]); i++){
+        if(json_key_is(value, len, json_fields[i].name))
+            return json_fields[i].field;
+    }
+    // balances and fees are keyed by the currencies of the thread's market
+    if(json_key_is(value, len, market->symbol1))
+        return F_SYMBOL1;
+    if(json_key_is(value, len, market->symbol2))
+        return F_SYMBOL2;
+    colon = memchr(value, ':', len);
+    if(colon && json_key_is(colon + 1, len - (colon + 1 - value), market->symbol2)){
+        for(size_t i = 0; i < sizeof(json_quote_fields) / sizeof(json_quote_fields[0]); i++){
+            if(json_key_is(value, colon - value, json_quote_fields[i].name))
+                return json_quote_fields[i].field;
+        }
+    }
+    return F_NONE;
+}
+
+void json_stream_init(JSON_STREAM *js, json_event handler, void *target){
+    memset(js, 0, sizeof(JSON_STREAM));
+    js->handler = handler;
+    js->target = target;
+    js->record = -1;
+}
+
+// hold on to the start of a token that continues in the next chunk
+static void json_stream_keep(JSON_STREAM *js, const char *value, size_t len){
+    if(js->token_len + len >= JSON_MAX_TOKEN){
+        js->error = 1;
+        return;
+    }
+    memcpy(js->token + js->token_len, value, len);
+    js->token_len += len;
+}
+
+static void json_stream_emit(JSON_STREAM *js, int event, const char *value, size_t len){
+    if(js->token_len){
+        json_stream_keep(js, value, len);
+        value = js->token;
+        len = js->token_len;
+    }
+    if(event == JS_STRING && js->depth && js->container[js->depth] == '{' && js->expect_key){
+        js->field[js->depth] = json_field_id(value, len);
+        event = JS_KEY;
+    }
+    if(!js->error)
+        js->handler(js, event, value, len);
+    js->token_len = 0;
+}
+
+static int json_bare_char(char c){
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.';
+}
+
+void json_stream_feed(JSON_STREAM *js, const char *data, size_t len){
+    
+    size_t i = 0, start;
+    
+    while(i < len && !js->error){
+        
+        if(js->in_string){
+            for(start = i; i < len; i++){
+                if(js->escaped)
+                    js->escaped = 0;
+                else if(data[i] == '\\')
+                    js->escaped = 1;
+                else if(data[i] == '"')
+                    break;
+            }
+            if(i == len){
+                json_stream_keep(js, data + start, len - start);
+                break;
+            }
+            js->in_string = 0;
+            json_stream_emit(js, JS_STRING, data + start, i - start);
+            i++;
+            continue;
+        }
+        
+        if(js->in_bare){
+            for(start = i; i < len && json_bare_char(data[i]); i++)
+                ;
+            if(i == len){
+                json_stream_keep(js, data + start, len - start);
+                break;
+            }
+            js->in_bare = 0;
+            if(js->token_len)
+                json_stream_emit(js, (js->token[0] == '-' || (js->token[0] >= '0' && js->token[0] <= '9')) ? JS_NUMBER : JS_LITERAL, data + start, i - start);
+            else
+                json_stream_emit(js, (data[start] == '-' || (data[start] >= '0' && data[start] <= '9')) ? JS_NUMBER : JS_LITERAL, data + start, i - start);
+            continue;
+        }
+        
+        switch(data[i]){
+            case '{':
+            case '[':
+                if(js->depth == JSON_MAX_DEPTH - 1){
+                    js->error = 1;
+                    break;
+                }
+                js->depth++;
+                js->container[js->depth] = data[i];
+                js->index[js->depth] = 0;
+                js->field[js->depth] = F_NONE;
+                js->expect_key = (data[i] == '{');
+                js->handler(js, data[i] == '{' ? JS_OBJECT_START : JS_ARRAY_START, data + i, 1);
+                break;
+            case '}':
+            case ']':
+                if(js->depth == 0){
+                    js->error = 1;
+                    break;
+                }
+                js->handler(js, data[i] == '}' ? JS_OBJECT_END : JS_ARRAY_END, data + i, 1);
+                js->depth--;
+                js->expect_key = 0;
+                break;
+            case ':':
+                js->expect_key = 0;
+                break;
+            case ',':
+                if(js->container[js->depth] == '{')
+                    js->expect_key = 1;
+                else
+                    js->index[js->depth]++;
+                break;
+            case '"':
+                js->in_string = 1;
+                break;
+            case ' ': case '\t': case '\r': case '\n':
+                break;
+            default:
+                // a byte no token starts with, e.g. the html of a proxy error page
+                if(!json_bare_char(data[i])){
+                    js->error = 1;
+                    break;
+                }
+                js->in_bare = 1;
+                continue;
+        }
+        i++;
+    }
+}
+
+void json_stream_copy(char *dst, size_t size, const char *value, size_t len){
+    if(len >= size)
+        len = size - 1;
+    memcpy(dst, value, len);
+    dst[len] = 0;
+}
+
+// {"timestamp":..,"bids":[[price,amount],..],"asks":[[price,amount],..],..} -> ORDER_BOOK
+void parse_order_book(JSON_STREAM *js, int event, const char *value, size_t len){
+    ORDER_BOOK *book = (ORDER_BOOK *)js->target;
+    
+    if(event == JS_OBJECT_START && js->depth == 1){
+        book_clear(book);
+    }else if((event == JS_NUMBER || event == JS_STRING) && js->depth == 3 && js->index[3] < 2){
+        js->level[js->index[3]] = js->index[3] == 0 ? price_parse(value, len) : amount_parse(value, len);
+    }else if(event == JS_ARRAY_START && js->depth == 3){
+        js->level[0] = js->level[1] = 0;
+    }else if(event == JS_ARRAY_END && js->depth == 3){
+        if(js->field[1] == F_BIDS)
+            book_append(&book->bids, js->level[0], js->level[1]);
+        else if(js->field[1] == F_ASKS)
+            book_append(&book->asks, js->level[0], js->level[1]);
+    }
+}
+
+// {"low":"..","high":"..",..} -> struct ticker
+void parse_ticker(JSON_STREAM *js, int event, const char *value, size_t len){
+    struct ticker *ticker = (struct ticker *)js->target;
+    
+    if((event != JS_STRING && event != JS_NUMBER) || js->depth != 1)
+        return;
+    if(js->field[1] == F_LOW){
+        ticker->low = price_parse(value, len);
+        ticker->received = 1;
+    }else if(js->field[1] == F_HIGH){
+        ticker->high = price_parse(value, len);
+        ticker->received = 1;
+    }
+}
+
+// {"e":"last_prices","data":[{"lprice":"..",..}]} -> first lprice
+void parse_last_price(JSON_STREAM *js, int event, const char *value, size_t len){
+    struct last_price *last = (struct last_price *)js->target;
+    
+    if((event == JS_STRING || event == JS_NUMBER) && js->depth == 3 && js->field[1] == F_DATA && js->index[2] == 0 && js->field[3] == F_LPRICE){
+        last->price = price_parse(value, len);
+        last->received = 1;
+    }
+}
+
+// [{"id":"..","type":"buy","price":"..","amount":"..",..},..] -> first order
+void parse_open_order(JSON_STREAM *js, int event, const char *value, size_t len){
+    struct order *order = (struct order *)js->target;
+    
+    if((event != JS_STRING && event != JS_NUMBER) || js->depth != 2 || js->container[1] != '[' || js->index[1] != 0)
+        return;
+    switch(js->field[2]){
+        case F_ID:
+            json_stream_copy(order->order_id, sizeof(order->order_id), value, len);
+            break;
+        case F_TYPE:
+            json_stream_copy(order->type, sizeof(order->type), value, len);
+            break;
+        case F_PRICE:
+            order->price = price_parse(value, len);
+            break;
+        case F_AMOUNT:
+            order->amount = amount_parse(value, len);
+            break;
+    }
+}
+
+// {"BTC":{"available":"..",..},"USD":{"available":"..",..},..} -> struct balance, for the market's currencies
+void parse_balance(JSON_STREAM *js, int event, const char *value, size_t len){
+    struct balance *balance = (struct balance *)js->target;
+    
+    if((event != JS_STRING && event != JS_NUMBER) || js->depth != 2 || js->field[2] != F_AVAILABLE)
+        return;
+    if(js->field[1] == F_SYMBOL1){
+        balance->btc_available = amount_parse(value, len);
+        balance->btc_found = 1;
+    }else if(js->field[1] == F_SYMBOL2){
+        balance->usd_available = price_parse(value, len);
+        balance->usd_found = 1;
+    }
+}
+
+// [{"orderId":"..","lastTxTime":"..","type":"..","amount":"..","price":"..","ta:USD":"..",..},..]
+void parse_archived_orders(JSON_STREAM *js, int event, const char *value, size_t len){
+    struct archive_page *page = (struct archive_page *)js->target;
+    TRADE *trade;
+    
+    if(js->container[1] != '[')
+        return;
+    if(event == JS_OBJECT_START && js->depth == 2){
+        trade = archive_page_add(page);
+        memset(trade, 0, sizeof(TRADE));
+        trade->price_decimals = market->price_decimals;
+        trade->amount_decimals = market->amount_decimals;
+        page->total_fee = page->total_cost = 0;
+        return;
+    }
+    if((event != JS_STRING && event != JS_NUMBER) || js->depth != 2 || page->count == 0)
+        return;
+    
+    trade = &page->trades[page->count - 1];
+    switch(js->field[2]){
+        case F_ORDERID:
+            json_stream_copy(trade->order_id, sizeof(trade->order_id), value, len);
+            break;
+        case F_LASTTXTIME:
+            json_stream_copy(trade->time, sizeof(trade->time), value, len);
+            break;
+        case F_TYPE:
+            json_stream_copy(trade->type, sizeof(trade->type), value, len);
+            break;
+        case F_AMOUNT:
+            trade->amount = amount_parse(value, len);
+            break;
+        case F_PRICE:
+            trade->price = price_parse(value, len);
+            break;
+        case F_TFA:
+            trade->fee = price_parse(value, len);
+            page->total_fee = 1;
+            break;
+        case F_FA:
+            if(!page->total_fee)
+                trade->fee = price_parse(value, len);
+            break;
+        case F_TTA:
+            trade->cost = price_parse(value, len);
+            page->total_cost = 1;
+            break;
+        case F_TA:
+            if(!page->total_cost)
+                trade->cost = price_parse(value, len);
+            break;
+    }
+}
+/*------------------------------- end response parsing ---------------------------------*/
+
+
+/*------------------------------- market data feed  ------------------------------------*/
+// Streaming order book and ticker over the CEX.io websocket API. A snapshot from
+// order-book-subscribe is loaded into feed->book and md_update deltas are applied on top.
+// md_update ids are consecutive, any gap drops the book and asks for a fresh snapshot.
+
+int mdfeed_open(MD_FEED *feed, const char *url){
+    
+    CURLcode res;
+    
+    if(feed->url != url)
+        snprintf(feed->url, sizeof(feed->url), "%s", url);
+    feed->last_attempt = time(NULL);
+    feed->connected = feed->subscribed = 0;
+    feed->book_id = 0;
+    feed->frame.size = 0;
+    
+    feed->curl_handle = curl_easy_init();
+    curl_easy_setopt(feed->curl_handle, CURLOPT_URL, feed->url);
+    curl_easy_setopt(feed->curl_handle, CURLOPT_CONNECT_ONLY, 2L); /* websocket upgrade, then hand over */
+    curl_easy_setopt(feed->curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(feed->curl_handle, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(feed->curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(feed->curl_handle, CURLOPT_CONNECTTIMEOUT, 5L);
+    res = curl_easy_perform(feed->curl_handle);
+    if(res != CURLE_OK){
+        mdfeed_close(feed);
+        return -1;
+    }
+    feed->connected = 1;
+    return 0;
+}
+
+void mdfeed_close(MD_FEED *feed){
+    if(feed->curl_handle)
+        curl_easy_cleanup(feed->curl_handle);
+    feed->curl_handle = NULL;
+    feed->connected = feed->subscribed = 0;
+    book_clear(&feed->book);
+}
+
+void mdfeed_send(MD_FEED *feed, const char *message){
+    size_t sent;
+    if(!feed->connected)
+        return;
+    if(curl_ws_send(feed->curl_handle, message, strlen(message), &sent, 0, CURLWS_TEXT) != CURLE_OK)
+        mdfeed_close(feed);
+}
+
+void mdfeed_subscribe(MD_FEED *feed){
+    char message[200];
+    book_clear(&feed->book);
+    feed->subscribed = 0;
+    if(feed->book_id){  /* resync, drop the old subscription first */
+        snprintf(message, sizeof(message), "{\"e\":\"order-book-unsubscribe\",\"data\":{\"pair\":[\"%s\",\"%s\"]},\"oid\":\"ctrader_unsubscribe\"}", market->symbol1, market->symbol2);
+        mdfeed_send(feed, message);
+    }
+    snprintf(message, sizeof(message), "{\"e\":\"order-book-subscribe\",\"data\":{\"pair\":[\"%s\",\"%s\"],\"subscribe\":true,\"depth\":0},\"oid\":\"ctrader_book\"}", market->symbol1, market->symbol2);
+    mdfeed_send(feed, message);
+}
+
+// drain whatever arrived since the last tick, never blocks
+void mdfeed_poll(MD_FEED *feed){
+    
+    char buffer[16384];
+    size_t rlen;
+    const struct curl_ws_frame *meta;
+    json_error_t error;
+    CURLcode res;
+    
+    if(!feed->connected){
+        if(time(NULL) - feed->last_attempt >= MDFEED_RETRY_SECS)
+            mdfeed_open(feed, feed->url);
+        return;
+    }
+    
+    for(;;){
+        res = curl_ws_recv(feed->curl_handle, buffer, sizeof(buffer), &rlen, &meta);
+        if(res == CURLE_AGAIN)
+            break;
+        if(res != CURLE_OK){
+            mdfeed_close(feed);
+            break;
+        }
+        if(meta->flags & CURLWS_CLOSE){
+            mdfeed_close(feed);
+            break;
+        }
+        if(meta->flags & CURLWS_PING){
+            size_t sent;
+            curl_ws_send(feed->curl_handle, buffer, rlen, &sent, 0, CURLWS_PONG);
+            continue;
+        }
+        if(!(meta->flags & (CURLWS_TEXT | CURLWS_CONT)))
+            continue;
+        
+        SaveRes(buffer, 1, rlen, &feed->frame);
+        if(meta->bytesleft || (meta->flags & CURLWS_CONT))
+            continue;   /* rest of the message is still on its way */
+        
+        record(RECORD_WS, 0, RECORD_END, feed->frame.memory, feed->frame.size);
+        uint64_t start = feed->recv_ns = stage_now();
+        json_t *msg = json_loadb(feed->frame.memory, feed->frame.size, 0, &error);
+        feed->frame.size = 0;
+        if(msg){
+            mdfeed_message(feed, msg);
+            json_decref(msg);
+        }
+        stage_end(STAGE_WS_PARSE, start);
+        if(!feed->connected)
+            break;
+    }
+}
+
+void mdfeed_message(MD_FEED *feed, json_t *msg){
+    
+    const char *e = json_string_value(json_object_get(msg, "e"));
+    json_t *data = json_object_get(msg, "data");
+    if(e == NULL)
+        return;
+    
+    if(strcmp(e, "connected") == 0){
+        char nonce[11], message[200], signature[SHA256_DIGEST_LENGTH * 2 + 1], auth[400];
+        int len;
+        itoa((unsigned long)time(NULL), nonce);
+        len = snprintf(message, sizeof(message), "%s%s", nonce, signer.apikey);
+        signer_sign(&signer, message, (size_t)len, signature);
+        snprintf(auth, sizeof(auth), "{\"e\":\"auth\",\"auth\":{\"key\":\"%s\",\"signature\":\"%s\",\"timestamp\":%s}}", signer.apikey, signature, nonce);
+        mdfeed_send(feed, auth);
+    }else if(strcmp(e, "auth") == 0){
+        mdfeed_send(feed, "{\"e\":\"subscribe\",\"rooms\":[\"tickers\"]}");
+        mdfeed_subscribe(feed);
+    }else if(strcmp(e, "ping") == 0){
+        mdfeed_send(feed, "{\"e\":\"pong\"}");
+    }else if(strcmp(e, "disconnecting") == 0){
+        mdfeed_close(feed);
+    }else if(strcmp(e, "tick") == 0){
+        const char *symbol1 = json_string_value(json_object_get(data, "symbol1"));
+        const char *symbol2 = json_string_value(json_object_get(data, "symbol2"));
+        const char *price = json_string_value(json_object_get(data, "price"));
+        if(symbol1 && symbol2 && price && strcmp(symbol1, market->symbol1) == 0 && strcmp(symbol2, market->symbol2) == 0)
+            feed->lastprice = price_parse(price, strlen(price));
+    }else if(strcmp(e, "order-book-subscribe") == 0){
+        if(data == NULL || !json_is_array(json_object_get(data, "bids")))
+            return;
+        book_clear(&feed->book);
+        mdfeed_apply(&feed->book.bids, json_object_get(data, "bids"));
+        mdfeed_apply(&feed->book.asks, json_object_get(data, "asks"));
+        feed->book_id = (long)json_integer_value(json_object_get(data, "id"));
+        feed->book_ns = feed->recv_ns;
+        feed->subscribed = 1;
+    }else if(strcmp(e, "md_update") == 0){
+        long id = (long)json_integer_value(json_object_get(data, "id"));
+        if(!feed->subscribed)
+            return;
+        if(id != feed->book_id + 1){
+            // missed an update, the book can no longer be trusted
+            mdfeed_subscribe(feed);
+            return;
+        }
+        mdfeed_apply(&feed->book.bids, json_object_get(data, "bids"));
+        mdfeed_apply(&feed->book.asks, json_object_get(data, "asks"));
+        feed->book_id = id;
+        feed->book_ns = feed->recv_ns;
+    }
+}
+
+// websocket fd for the poll in sched_wait, -1 while disconnected
+int mdfeed_socket(MD_FEED *feed){
+    curl_socket_t sock = CURL_SOCKET_BAD;
+    if(!feed->connected || curl_easy_getinfo(feed->curl_handle, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK)
+        return -1;
+    return sock == CURL_SOCKET_BAD ? -1 : (int)sock;
+}
+
+// merge [price, amount] levels into a side of the book, amount 0 removes the level
+void mdfeed_apply(struct book_side *side, json_t *levels){
+    for(size_t l = 0; l < json_array_size(levels); l++){
+        json_t *level = json_array_get(levels, l);
+        book_set(side, to_price(json_number_value(json_array_get(level, 0))), to_amount(json_number_value(json_array_get(level, 1))));
+    }
+}
+/*------------------------------- end market data feed ---------------------------------*/
+
+
+/*------------------------------- Getjson  ------------------------------------*/
+
+// the transfer's result, *status gets the HTTP status, 0 if there was no response
+static CURLcode http_perform(const char *url, char *post_params, size_t (*write_function)(void *, size_t, size_t, void *), void *destination, long *status){
+    
+    CURLcode res;
+    HTTP_POOL *pool = transport_pool(url);
+    *status = 0;
+    if(pool == NULL)
+        return CURLE_FAILED_INIT;
+    CURL *curl_handle = transport_handle(pool);
+    
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_function);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, destination);
+    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+    
+    /*
+     curl_easy_setopt(curl_handle, CURLOPT_PROXY, "127.0.0.1:8888");
+     curl_easy_setopt(curl_handle, CURLOPT_PROXYAUTH, CURLAUTH_ANY);
+     curl_easy_setopt(curl_handle, CURLOPT_PROXYUSERPWD, "");*/
+    
+    // the handle is reused, so every call has to say whether it is a GET or a POST
+    if(post_params != NULL){
+        curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, post_params);
+        curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, pool->json_headers);
+    }else{
+        curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, NULL);
+        curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1L);
+    }
+    
+    
+    curl_off_t sent = 0;
+    last_transfer.start_ns = stage_now();
+    res = curl_easy_perform(curl_handle);
+    last_transfer.done_ns = stage_now();
+    curl_easy_getinfo(curl_handle, CURLINFO_PRETRANSFER_TIME_T, &sent);
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, status);
+    last_transfer.sent_ns = last_transfer.start_ns + (uint64_t)sent * 1000;
+    stage_request(curl_handle, stage_endpoint(url));
+    //printw(chunk->memory, "\n");
+    //return(chunk.memory);
+    return res;
+}
+
+// -1 if the request failed or the server answered with an error status
+int Getjson(struct RespData *chunk, const char *url, char *post_params){
+    long status;
+    CURLcode res = http_perform(url, post_params, SaveRes, chunk, &status);
+    return (res != CURLE_OK || status >= 400) ? -1 : 0;
+}
+
+// same as Getjson but the body is decoded by js as it arrives
+int Getstream(const char *url, char *post_params, JSON_STREAM *js){
+    long status;
+    CURLcode res = http_perform(url, post_params, StreamRes, js, &status);
+    return (res != CURLE_OK || status >= 400) ? -1 : 0;
+}
+/*------------------------------- end Getjson ---------------------------------*/
+
+
+
+
+/*------------------------------- Misc ---------------------------------*/
+
+char *reverse(char s[])
+{
+    long c, i, j;
+    for (i = 0, j = strlen(s)-1; i < j; i++, j--) {
+        c = s[i];
+        s[i] = s[j];
+        s[j] = c; }
+    return(s);
+}
+char *itoa(long n, char s[])
+{
+    int i;
+    i = 0;
+    do {
+        s[i++]=n%10+'0';
+    } while ((n /= 10) > 0);
+    s[i] = '\0';
+    
+    return(reverse(s));
+}
+
+int kbhit(void)
+{
+    int ch = wgetch(screen.log);
+    
+    if (ch != ERR) {
+        ungetch(ch);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+// read a price typed at the prompt, as text so it is not rounded through a float
+fixed_t scan_price(void)
+{
+    char input[32] = "";
+    wscanw(screen.log, "%31s", input);
+    return price_parse(input, strlen(input));
+}
+
+// order_post from a key, says so in the log when the order thread's queue is full
+int ui_post(int type, const char *order_type, fixed_t price, fixed_t amount, int index)
+{
+    if (order_post(type, order_type, price, amount, index))
+        return 1;
+    wprintw(screen.log, "\norder thread busy, command not sent\n");
+    wrefresh(screen.log);
+    return 0;
+}
+/*------------------------------- end Misc ---------------------------------*/
+
+
+/*--------------------------- get_trades ---------------------------------*/
+
+// archived_orders sync: pages of ARCHIVE_PAGE_SIZE orders are fetched newest first, from
+// now back to the sync mark, then stored oldest first in one transaction that also moves
+// the mark. A crash before the commit leaves the mark where it was and the next sync
+// fetches the same delta again; nothing older than the mark is ever asked for. A page
+// that fails fails the whole sync, the mark only moves over orders that were all read.
+
+TRADE *archive_page_add(struct archive_page *page){
+    if(page->count == page->capacity){
+        page->capacity = page->capacity ? page->capacity * 2 : 64;
+        page->trades = realloc(page->trades, sizeof(TRADE) * page->capacity);
+    }
+    return &page->trades[page->count++];
+}
+
+static int sync_mark_get(ARCHIVE_DBS *dbs, const char *trade_status, struct sync_mark *mark){
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    memset(mark, 0, sizeof(struct sync_mark));
+    key.data = (void *)trade_status;
+    key.size = (u_int32_t)strlen(trade_status);
+    data.data = mark;
+    data.ulen = sizeof(struct sync_mark);
+    data.flags = DB_DBT_USERMEM;
+    return dbs->sync_dbp ? dbs->sync_dbp->get(dbs->sync_dbp, NULL, &key, &data, 0) : DB_NOTFOUND;
+}
+
+static int sync_mark_put(ARCHIVE_DBS *dbs, DB_TXN *txn, const char *trade_status, const struct sync_mark *mark){
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = (void *)trade_status;
+    key.size = (u_int32_t)strlen(trade_status);
+    data.data = (void *)mark;
+    data.size = sizeof(struct sync_mark);
+    return dbs->sync_dbp ? dbs->sync_dbp->put(dbs->sync_dbp, txn, &key, &data, 0) : 0;
+}
+
+// one page of up to limit orders with lastTxTime in [from, to], "" leaves that end open.
+// -1 unless the answer is a list, an {"error":..} object is a failed page, not an empty one
+static int archive_fetch_page(const char *trade_status, const char *from, const char *to, int limit, struct archive_page *page){
+    char nonce[24], range[128] = "", request_params[3000];
+    struct authdata auth;
+    JSON_STREAM js;
+    
+    if(from[0])
+        snprintf(range, sizeof(range), ",\"lastTxDateFrom\":\"%s\"", from);
+    if(to[0])
+        snprintf(range + strlen(range), sizeof(range) - strlen(range), ",\"lastTxDateTo\":\"%s\"", to);
+    if(nonce_string(&nonces, nonce) == NULL)
+        return -1;
+    create_authdata(&auth, nonce);
+    snprintf(request_params, sizeof(request_params), api->archived_orders_json, auth.apikey, auth.signature, nonce, limit, range, trade_status);
+    page->count = 0;
+    json_stream_init(&js, api->decode_archived_orders, page);
+    if(Getstream(api->archived_orders_url, request_params, &js) != 0 || js.error || js.container[1] != '[' || js.depth != 0)
+        return -1;
+    return 0;
+}
+
+// new trades stored, -1 if the sync failed and the mark did not move
+int archive_sync(ARCHIVE_DBS *dbs, const char *trade_status){
+    
+    struct sync_mark mark;
+    struct archive_page page, delta;
+    TRADE previous;
+    TRADE_QUERY newest = { NULL, 0, NULL, NULL, 1 };
+    char to[sizeof(mark.time)] = "";
+    int limit = ARCHIVE_PAGE_SIZE;
+    int ret = 0;
+    
+    memset(&page, 0, sizeof(page));
+    memset(&delta, 0, sizeof(delta));
+    memset(&previous, 0, sizeof(previous));
+    trades_query(dbs, &newest, &previous, 1);
+    if(sync_mark_get(dbs, trade_status, &mark) != 0 && previous.order_id[0]){
+        // a database from before the marks, it is complete up to its newest trade
+        memcpy(mark.time, previous.time, sizeof(mark.time));
+        memcpy(mark.order_id, previous.order_id, sizeof(mark.order_id));
+    }
+    
+    for(;;){
+        size_t before = delta.count;
+        if(archive_fetch_page(trade_status, mark.time, to, limit, &page) < 0){
+            ret = -1;
+            break;
+        }
+        for(size_t i = 0; i < page.count; i++){
+            TRADE *t = &page.trades[i];
+            int seen = 0;
+            if(strncmp(t->order_id, mark.order_id, sizeof(mark.order_id)) == 0 || strncmp(t->time, mark.time, sizeof(mark.time)) < 0)
+                continue;
+            // pages overlap on the orders at the boundary time
+            for(size_t d = before; d > 0 && strncmp(delta.trades[d-1].time, t->time, sizeof(t->time)) == 0 && !seen; d--)
+                seen = strncmp(delta.trades[d-1].order_id, t->order_id, sizeof(t->order_id)) == 0;
+            if(!seen)
+                *archive_page_add(&delta) = *t;
+        }
+        if(page.count < (size_t)limit)
+            break;      /* reached the mark */
+        if(delta.count == before){
+            // one instant fills the page, ask for it again in a bigger one
+            if(limit >= ARCHIVE_PAGE_MAX){
+                ret = -1;
+                break;
+            }
+            limit *= 2;
+            continue;
+        }
+        limit = ARCHIVE_PAGE_SIZE;
+        memcpy(to, page.trades[page.count - 1].time, sizeof(to));
+        to[sizeof(to) - 1] = 0;
+    }
+    free(page.trades);
+    if(ret == 0 && delta.count)
+        ret = archive_store(dbs, trade_status, &delta, &previous);
+    free(delta.trades);
+    return ret;
+}
+
+// the delta of a sync, newest first, stored oldest first in one transaction with the
+// mark of trade_status and the row count; previous is the newest trade before it. New
+// trades stored, -1 if the transaction failed
+int archive_store(ARCHIVE_DBS *dbs, const char *trade_status, const struct archive_page *delta, TRADE *previous){
+    
+    struct sync_mark mark;
+    DB_ENV *envp = dbs->db_envp;
+    DB_TXN *txn = NULL;
+    DBT key, data;
+    TRADE *fresh;               /* stored by this sync, oldest first, for the columns */
+    uint64_t rows = 0;
+    size_t stored = 0;
+    int ret = 0;
+    
+    if(envp && envp->txn_begin(envp, NULL, &txn, 0) != 0)
+        txn = NULL;
+    fresh = malloc(sizeof(TRADE) * delta->count);
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    for(long i = (long)delta->count - 1; i >= 0; i--){
+        TRADE trade = delta->trades[i];
+        // profitable: a sell for more than the previous trade cost, a buy of more than it had
+        if ((trade.cost > previous->cost && strcmp(trade.type, "sell")==0)||(trade.amount > previous->amount && strcmp(trade.type, "buy")==0)){
+            strcpy(trade.profit, "y");
+        }else{
+            strcpy(trade.profit, "n");
+        }
+        key.data = trade.order_id;
+        key.size = sizeof(trade.order_id);
+        data.data = &trade;
+        data.size = sizeof(TRADE);
+        ret = dbs->trades_dbp->put(dbs->trades_dbp, txn, &key, &data, DB_NOOVERWRITE);
+        if(ret != 0 && ret != DB_KEYEXIST)
+            break;
+        if(ret == 0)
+            fresh[stored++] = trade;
+        ret = 0;
+        *previous = trade;
+    }
+    memcpy(mark.time, delta->trades[0].time, sizeof(mark.time));
+    memcpy(mark.order_id, delta->trades[0].order_id, sizeof(mark.order_id));
+    if(ret == 0)
+        ret = sync_mark_put(dbs, txn, trade_status, &mark);
+    if(ret == 0 && archive_rows_get(dbs, txn, &rows) == 0)
+        ret = archive_rows_put(dbs, txn, rows + stored);
+    
+    if(txn && ret != 0)
+        txn->abort(txn);    /* the mark did not move, the next sync fetches the delta again */
+    else if(txn)
+        ret = txn->commit(txn, 0);
+    env_check(ret);
+    if(ret == 0 && rows == dbs->columns.rows)
+        columns_append(&dbs->columns, fresh, stored);
+    ret = ret == 0 ? (int)stored : -1;
+    free(fresh);
+    return ret;
+}
+
+////////////////////////////////////////// RETRIEVE LAST ARCHIVED TRADE DATE FROM DATABASE ///////////////////////////////////////////
+////////////////////////////////////////// DOWNLOAD ALL TRADES SINCE LAST TRADE DATE ////////////////////////////////////////////////
+
+TRADE get_trades(ARCHIVE_DBS *archivedbs, char *nonce, char *request_params, char *timestamp, struct authdata* a, const char *mode, const char *trade_status, int last){
+    
+    TRADE trade;
+    
+    TRADE_QUERY newest = { NULL, 0, NULL, NULL, 1 };
+    uint64_t start = stage_now();
+    
+    if (strcmp(mode, "update") == 0){
+        // DOWNLOAD WHAT IS NEWER THAN THE SYNC MARK, RETURN THE NEWEST TRADE
+        archive_sync(archivedbs, trade_status);
+        memset(&trade, 0, sizeof(TRADE));
+        trades_query(archivedbs, &newest, &trade, 1);
+        stage_end(STAGE_SYNC, start);
+    }else{
+        TRADE recent[40];
+        TRADE_STATS stats;
+        size_t count;
+        memset(&trade, 0, sizeof(TRADE));
+        
+        if(last){
+            trades_query(archivedbs, &newest, &trade, 1);
+            stage_end(STAGE_HISTORY, start);
+            return(trade);
+        }
+        
+        // the newest trades by lastTxTime, only they are read
+        count = trades_query(archivedbs, &newest, recent, 40);
+        // the whole history from the columns
+        trade_stats(&archivedbs->columns, INT64_MIN, INT64_MAX, &stats);
+        stage_end(STAGE_HISTORY, start);
+        printw("\n\n\n\n\n\n\n\n\tTrades %zu   Win rate %.1f%%   Fees %.2f   Avg entry %.2f   P&L %.2f\n\n", stats.count, stats.win_rate * 100, price_double(stats.fees), price_double(stats.avg_entry), price_double(stats.pnl));
+        printw("\tDate\t\tFee\tAmount\t    Price\tCost\t  Type\n");
+        for(size_t i = 0; i < count; i++){
+            
+            trade = recent[i];
+            struct tm tm = {0};
+            //2018-04-14T12:32:44.047Z
+            strptime(trade.time, "%Y-%m-%dT%H:%M:%S", &tm);
+            char wordtime[21];
+            strftime (wordtime,80,"%b %d, %Y %I:%M%p",&tm);
+            if (strcmp(trade.profit, "y") == 0){
+                attron(COLOR_PAIR(2));
+            }else{
+                attron(COLOR_PAIR(3));
+            }
+            printw("%s\t%.2f\t%f    %4.2f\t%4.2f\t  %-4s\n", wordtime, price_double(trade.fee), amount_double(trade.amount), price_double(trade.price), price_double(trade.cost), trade.type, trade.profit);
+            
+            
+            refresh();
+        }
+    }
+    
+    
+    
+    
+    return(trade);
+    
+}
+
+// every market's databases closed and opened again in a new environment handle, which
+// runs the recovery. Under archive_lock, after the environment failed
+static void archive_recover(void){
+    SHARD *current = shard;
+    
+    for(int i = 0; i < nshards; i++)
+        databases_close(&shards[i].archive);
+    if(archive_env)
+        archive_env->close(archive_env, 0);
+    archive_env = NULL;
+    atomic_store(&env_failed, 0);
+    if(env_setup(&archive_env, DEFAULT_HOMEDIR, "ctrader", stderr) != 0)
+        notify(1, "trades environment did not recover, databases are opened without it\n");
+    for(int i = 0; i < nshards; i++){
+        shard_enter(&shards[i]);
+        initialize_archivedbs(&shard->archive);
+        set_db_filenames(&shard->archive);
+        databases_setup(&shard->archive, "ctrader", NULL);
+    }
+    shard_enter(current);
+    notify(0, "trades databases recovered\n");
+}
+
+// download new trades into the market's database, serialized with every other user of the handle
+void archive_update(const char *trade_status){
+    char nonce[24] = "", request_params[3000] = "", timestamp[30] = "";
+    
+    pthread_mutex_lock(&archive_lock);
+    if(env_check(0))
+        archive_recover();
+    get_trades(&shard->archive, nonce, request_params, timestamp, NULL, "update", trade_status, 0);
+    if(env_check(0))
+        archive_recover();
+    pthread_mutex_unlock(&archive_lock);
+}
+
+// after the threads are gone: every market's database, then the environment
+void archive_close(void){
+    for(int i = 0; i < nshards; i++)
+        databases_close(&shards[i].archive);
+    env_close(archive_env);
+    archive_env = NULL;
+}
+/*--------------------------- end get_trades ---------------------------------*/
+
+
+/*--------------------------- threads ---------------------------------*/
+// The market data thread keeps the book and ticker, the order thread owns the open order,
+// its repricing and the order requests, the archive thread syncs the trades database and
+// the UI thread (main) only draws and reads keys. State goes out through seqlocked snapshots and the rings, never through locks,
+// so a blocking prompt in the UI does not hold up the repricing.
+
+int ring_init(RING *ring, unsigned capacity, size_t slot_size){
+    memset(ring, 0, sizeof(RING));
+    ring->slots = malloc(capacity * slot_size);
+    ring->slot_size = slot_size;
+    ring->capacity = capacity;
+    return ring->slots ? 0 : -1;
+}
+
+// 0 when the ring is full
+int ring_push(RING *ring, const void *item){
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == ring->capacity)
+        return 0;
+    memcpy(ring->slots + (head & (ring->capacity - 1)) * ring->slot_size, item, ring->slot_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// 0 when the ring is empty
+int ring_pop(RING *ring, void *item){
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if(tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+        return 0;
+    memcpy(item, ring->slots + (tail & (ring->capacity - 1)) * ring->slot_size, ring->slot_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+void snapshot_publish(_Atomic unsigned *seq, void *dst, const void *src, size_t size){
+    unsigned start = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, start + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(dst, src, size);
+    atomic_store_explicit(seq, start + 2, memory_order_release);
+}
+
+void snapshot_read(_Atomic unsigned *seq, void *dst, const void *src, size_t size){
+    for(;;){
+        unsigned before = atomic_load_explicit(seq, memory_order_acquire);
+        if(before & 1)
+            continue;
+        memcpy(dst, src, size);
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(seq, memory_order_relaxed) == before)
+            return;
+    }
+}
+
+static void snapshot_side_fill(struct snapshot_side *dst, struct book_side *src){
+    dst->count = src->count < SNAPSHOT_LEVELS ? src->count : SNAPSHOT_LEVELS;
+    book_depth(src, 1);     /* brings depth[] up to date */
+    memcpy(dst->price, src->price, sizeof(fixed_t) * dst->count);
+    memcpy(dst->amount, src->amount, sizeof(fixed_t) * dst->count);
+    memcpy(dst->depth, src->depth, sizeof(fixed_t) * dst->count);
+    // distinct levels up to the last level kept, the deepest of them may be cut short
+    dst->levels = src->count <= SNAPSHOT_LEVELS ? src->levels : (size_t)book_distinct_rank(src, src->price[SNAPSHOT_LEVELS-1]);
+    memcpy(dst->level, src->level, sizeof(fixed_t) * dst->levels);
+}
+
+static void snapshot_side_view(struct snapshot_side *src, struct book_side *view, int descending){
+    view->price = src->price;
+    view->amount = src->amount;
+    view->depth = src->depth;
+    view->count = src->count;
+    view->capacity = SNAPSHOT_LEVELS;
+    view->descending = descending;
+    view->depth_dirty = 0;
+    view->level = src->level;
+    view->level_count = NULL;
+    view->levels = src->levels;
+    view->level_capacity = SNAPSHOT_LEVELS;
+}
+
+void md_state_fill(struct md_state *state, ORDER_BOOK *book){
+    snapshot_side_fill(&state->bids, &book->bids);
+    snapshot_side_fill(&state->asks, &book->asks);
+}
+
+// read-only ORDER_BOOK over a snapshot copy, for book_price/book_depth/show_order_book
+void md_state_book(struct md_state *state, ORDER_BOOK *view){
+    snapshot_side_view(&state->bids, &view->bids, 1);
+    snapshot_side_view(&state->asks, &view->asks, 0);
+}
+
+// a line for the UI, dropped if it is that far behind
+void notify(int beeps, const char *format, ...){
+    struct notice notice;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(notice.text, sizeof(notice.text), format, args);
+    va_end(args);
+    notice.beeps = beeps;
+    ring_push(notice_ring ? notice_ring : &shard->notices, &notice);
+}
+
+// the next notice of a market, from its order thread or its archive thread
+int notice_pop(SHARD *s, struct notice *notice){
+    return ring_pop(&s->notices, notice) || ring_pop(&s->archive_notices, notice);
+}
+
+void order_wakeup(void){
+    CURLM *multi = atomic_load(&shard->order_multi);
+    if(multi)
+        curl_multi_wakeup(multi);
+}
+
+// queue a command for the order thread, 0 if the queue is full
+int order_post(int type, const char *order_type, fixed_t price, fixed_t amount, int index){
+    COMMAND cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = type;
+    if(order_type)
+        snprintf(cmd.order_type, sizeof(cmd.order_type), "%s", order_type);
+    cmd.price = price;
+    cmd.amount = amount;
+    cmd.index = index;
+    if(!ring_push(&shard->commands, &cmd))
+        return 0;
+    order_wakeup();
+    return 1;
+}
+
+
+static void md_received(HTTP_REQUEST *req, void *userdata){
+    *(uint64_t *)userdata = stage_now();
+}
+
+// a market data poll, its body teed to the recorder; *received is when it came in
+static void md_submit(int source, const char *url, json_event parse, void *target, uint64_t *received){
+    HTTP_REQUEST *req = engine_submit(url, NULL, parse, target, md_received, received);
+    if(req && shard->recorded.capacity){
+        req->stream.record = source;
+        req->stream.record_stream = (int)(req - engine.requests);
+    }
+}
+
+void *md_thread(void *arg){
+    
+    shard_enter((SHARD *)arg);
+    const char *ws_url = shard->ws_url;         /* NULL: poll the REST order book */
+    SCHEDULER sched;
+    int due[SRC_COUNT];
+    uint64_t received[SRC_COUNT] = { 0 };
+    MD_FEED feed;
+    ORDER_BOOK book;
+    struct ticker ticker;
+    struct last_price last;
+    struct md_state *state = calloc(1, sizeof(struct md_state));
+    
+    engine_init();
+    arena_init(&tick_arena, TICK_ARENA_SIZE);
+    memset(&feed, 0, sizeof(MD_FEED));
+    book_init(&feed.book);
+    book_init(&book);
+    if(ws_url)
+        mdfeed_open(&feed, ws_url);
+    
+    // intervals in ms and request budgets per minute
+    sched_init(&sched);
+    sched_add(&sched, SRC_TICKER, 3000, 20, 0);
+    sched_add(&sched, SRC_LASTPRICE, 1000, 60, 0);
+    sched_add(&sched, SRC_BOOK, 500, 120, 0);
+    
+    while(atomic_load(&running)){
+        // a timer, a websocket message or shutdown
+        sched_wait(&sched, ws_url ? mdfeed_socket(&feed) : -1);
+        sched_expire(&sched, due);
+        
+        // a live websocket book replaces the order_book and last_prices polls
+        if(ws_url)
+            mdfeed_poll(&feed);
+        int streaming = ws_url && feed.subscribed;
+        
+        memset(&ticker, 0, sizeof(ticker));
+        memset(&last, 0, sizeof(last));
+        if(due[SRC_TICKER])
+            md_submit(SRC_TICKER, api->ticker_url, api->decode_ticker, &ticker, &received[SRC_TICKER]);
+        if(due[SRC_LASTPRICE] && !(streaming && feed.lastprice))
+            md_submit(SRC_LASTPRICE, api->lastprice_url, api->decode_last_price, &last, &received[SRC_LASTPRICE]);
+        if(due[SRC_BOOK] && !streaming){
+            book_clear(&book);
+            md_submit(SRC_BOOK, api->order_book_url, api->decode_order_book, &book, &received[SRC_BOOK]);
+        }
+        engine_wait();
+        
+        if(ticker.received){
+            if((state->low != state->high) && (ticker.low < state->low || ticker.high > state->high))
+                state->range_breaks++;
+            state->low = ticker.low;
+            state->high = ticker.high;
+        }
+        if(streaming && feed.lastprice)
+            state->lastprice = feed.lastprice;
+        if(last.received)
+            state->lastprice = last.price;
+        
+        uint64_t start = stage_now();
+        md_state_fill(state, streaming ? &feed.book : &book);
+        state->recv_ns = streaming ? feed.book_ns : received[SRC_BOOK];
+        state->publish_ns = start;
+        state->version++;
+        snapshot_publish(&shard->md.seq, &shard->md.state, state, sizeof(struct md_state));
+        stage_end(STAGE_PUBLISH, start);
+        order_wakeup();     /* the repricing looks at every new book */
+        arena_reset(&tick_arena);
+    }
+    
+    mdfeed_close(&feed);
+    book_free(&feed.book);
+    book_free(&book);
+    free(state);
+    free(tick_arena.base);
+    engine_cleanup();
+    transport_thread_cleanup();
+    return NULL;
+}
+
+
+// trace, if there is one, gets the signing, the send and the answer
+static void order_replace(struct order *openorders, struct trace_record *trace){
+    char nonce[24], request_params[3000];
+    struct authdata auth;
+    struct RespData response;
+    if(nonce_string(&nonces, nonce) == NULL)
+        return;
+    create_authdata(&auth, nonce);
+    sprintf(request_params, api->replace_json, auth.apikey, auth.signature, nonce, openorders->type, amount_str(openorders->amount), price_str(openorders->price), openorders->order_id);
+    resp_init(&response, &tick_arena);
+    if(trace)
+        trace->signed_ns = stage_now();
+    Getjson(&response, api->replace_url, request_params);
+    if(trace)
+        trace_answer(trace, &response);
+}
+
+static void order_cancel(struct order *openorders){
+    char nonce[24], request_params[3000];
+    struct authdata auth;
+    struct RespData response;
+    if(nonce_string(&nonces, nonce) == NULL)
+        return;
+    create_authdata(&auth, nonce);
+    sprintf(request_params, api->cancel_json, auth.apikey, auth.signature, nonce, openorders->order_id);
+    resp_init(&response, &tick_arena);
+    Getjson(&response, api->cancel_url, request_params);
+}
+
+static void order_place(const char *type, fixed_t amount, fixed_t price){
+    char nonce[24], request_params[3000];
+    struct authdata auth;
+    struct RespData response;
+    if(nonce_string(&nonces, nonce) == NULL)
+        return;
+    create_authdata(&auth, nonce);
+    sprintf(request_params, api->place_order_json, auth.apikey, auth.signature, nonce, type, amount_str(amount), price_str(price));
+    resp_init(&response, &tick_arena);
+    Getjson(&response, api->place_order_url, request_params);
+}
+
+void *order_thread(void *arg){
+    
+    SCHEDULER sched;
+    int due[SRC_COUNT];
+    struct order open_order, openorders;
+    struct balance balance;
+    struct authdata tick_auth[2];   /* open_orders, chained balance */
+    struct md_state *md = malloc(sizeof(struct md_state));
+    struct order_state state, next;
+    struct prices adj_price;
+    struct ticker ticker;
+    JSON_STREAM js;
+    ORDER_BOOK book;
+    COMMAND cmd;
+    char nonce[24], request_params[3000];
+    char oldtype[6] = "";
+    const char *order_type = NULL;
+    fixed_t btc_available = 0, usd_available = 0;
+    LOCK_PARAMS lock = LOCK_PARAMS_DEFAULT;
+    struct lock_state ls = { lock.lock_index, 0 };
+    struct tally tally;
+    
+    shard_enter((SHARD *)arg);
+    engine_init();
+    arena_init(&tick_arena, TICK_ARENA_SIZE);
+    atomic_store(&shard->order_multi, engine.multi);
+    memset(&openorders, 0, sizeof(openorders));
+    memset(&adj_price, 0, sizeof(adj_price));
+    memset(&state, 0, sizeof(state));
+    
+    //////////////////////// SET UP TALLY BOARD ASK / BID TARGET PRICE FOR AUTO TRADE MODE ////////////////////////////
+    memset(&ticker, 0, sizeof(ticker));
+    json_stream_init(&js, api->decode_ticker, &ticker);
+    Getstream(api->ticker_url, NULL, &js);
+    
+    tally_init(&tally, ticker.low, ticker.high);
+    tally.verbose = 1;
+    //////////////////////// END SET UP TALLY BOARD ASK / BID TARGET PRICE FOR AUTO TRADE MODE ////////////////////////
+    
+    // intervals in ms and request budgets per minute
+    sched_init(&sched);
+    sched_add(&sched, SRC_OPEN_ORDERS, 1000, 60, 0);
+    sched_add(&sched, SRC_BALANCE, 2000, 30, 0);
+    sched_add(&sched, SRC_TRADES, 15 * 60 * 1000, 2, 15 * 60 * 1000);
+    
+    while(atomic_load(&running)){
+        // a timer, a command from the UI or a new book
+        sched_wait(&sched, -1);
+        sched_expire(&sched, due);
+        
+        snapshot_read(&shard->md.seq, md, &shard->md.state, sizeof(struct md_state));
+        md_state_book(md, &book);
+        
+        /////////////// COMMANDS FROM THE UI /////////////////////////////////////////////////
+        while(ring_pop(&shard->commands, &cmd)){
+            switch(cmd.type){
+                case CMD_REPLACE:
+                    if(!openorders.type[0])     /* filled or cancelled meanwhile */
+                        break;
+                    openorders.price = cmd.price;
+                    openorders.amount = cmd.amount;
+                    order_replace(&openorders, NULL);
+                    break;
+                case CMD_CANCEL:
+                    if(openorders.type[0])      /* nothing open to cancel */
+                        order_cancel(&openorders);
+                    ls.lock_index = 0;
+                    break;
+                case CMD_PLACE:
+                    order_place(cmd.order_type, cmd.amount, cmd.price);
+                    break;
+                case CMD_SET_LOCK:
+                    ls.lock_index = cmd.index;
+                    break;
+                case CMD_MOVE_LOCK:
+                    ls.lock_index += cmd.index;
+                    break;
+            }
+        }
+        /////////////// END COMMANDS FROM THE UI /////////////////////////////////////////////////
+        
+        if(due[SRC_TRADES])
+            archive_request(ARCHIVE_DONE);
+        
+        /////////////// GET OPEN ORDERS /////////////////////////////////////////////////
+        // between polls openorders keeps what the last open_orders response said
+        if(due[SRC_OPEN_ORDERS] && !(nonce_string(&nonces, nonce) && nonce_string(&nonces, tick_auth[1].nonce)))
+            due[SRC_OPEN_ORDERS] = 0;   /* nothing to sign with, as if the poll was not due */
+        if(due[SRC_OPEN_ORDERS]){
+            struct balance_chain balance_chain = { api->balance_url, api->balance_json, &tick_auth[1], due[SRC_BALANCE], &open_order, &balance };
+            memset(&open_order, 0, sizeof(open_order));
+            memset(&balance, 0, sizeof(balance));
+            strcpy(tick_auth[0].nonce, nonce);
+            create_authdata_batch(tick_auth, due[SRC_BALANCE] ? 2 : 1);
+            sprintf(request_params, api->open_order_json, tick_auth[0].apikey, tick_auth[0].signature, nonce);
+            engine_submit(api->open_order_url, request_params, api->decode_open_order, &open_order, on_open_orders, &balance_chain);
+            engine_wait();
+            book_adjust(&book, openorders.type, openorders.price, &adj_price, 0, ls.lock_index);
+        }
+        
+        if (due[SRC_OPEN_ORDERS] && open_order.type[0]){
+            openorders.placed = 1;
+            strcpy(openorders.type, open_order.type);
+            strcpy(oldtype,openorders.type);
+            openorders.amount = open_order.amount;
+            openorders.price = open_order.price;
+            strcpy(openorders.order_id, open_order.order_id);
+        }else if (due[SRC_OPEN_ORDERS]){
+            
+            /////////////// GET CURRENT BALANCE /////////////////////////////////////////////////
+            // fetched by on_open_orders together with the open orders
+            if(balance.btc_found){
+                btc_available = balance.btc_available;
+            }
+            if(balance.usd_found){
+                usd_available = balance.usd_available;
+            }
+            /////////////// END GET CURRENT BALANCE /////////////////////////////////////////////////
+            
+            if(openorders.placed){ /// SEND NOTIFICATION IF ORDER WAS FULFILLED.
+                if((btc_available  < openorders.amount && strcmp(oldtype,"sell")==0) || (usd_available < cost_of(openorders.price, openorders.amount) && strcmp(oldtype,"buy")==0)){
+                    notify(3, "%s order completed!", oldtype);
+                    
+                    // UPDATE TRADE HISTORY DATABASE, ALL DONE AND PARTIAL DONE TRADES
+                    archive_request(ARCHIVE_DONE | ARCHIVE_PARTIAL);
+                    /////////////////
+                }else{
+                    notify(0, "%s order cancelled.", oldtype);
+                }
+                
+                
+                openorders.placed = 0;
+            }else{
+                ///////////////////////////// AUTO-PLACE ORDER /////////////////////////////////////////
+                if(btc_available > to_amount(.01) && usd_available <= price_units(100)){
+                    order_type = "sell";
+                    if(adj_price.lowest_ask && ((md->high - adj_price.lowest_ask) < (adj_price.lowest_ask - md->low))){ //SELL AT PAST MID
+                        if(tally.target_sell){
+                            notify(0, "WE ARE PLACING ORDER AT %.02f\n", price_double(tally.target_sell));
+                            //order_place(order_type, btc_available, tally.target_sell);
+                            
+                        }else{
+                            tally_ask(&tally, &lock, adj_price.lowest_ask);
+                        }
+                    }
+                }else if(btc_available < to_amount(.01) && usd_available >= price_units(100)){
+                    order_type = "buy";
+                    if(adj_price.highest_bid && ((adj_price.highest_bid - md->low) < (md->high - adj_price.highest_bid))){  //BUY BELOW MID
+                        if(tally.target_buy){
+                            //order_place(order_type, btc_available, tally.target_sell);
+                            
+                        }else{
+                            tally_bid(&tally, &lock, adj_price.highest_bid);
+                        }
+                    }
+                    
+                }
+                
+                ///////////////////////////// END AUTO-PLACE ORDER /////////////////////////////////////
+                
+            }
+            memset(openorders.type, 0, sizeof(openorders.type));
+        }
+        /////////////// END GET OPEN ORDERS /////////////////////////////////////////////////
+        
+        
+        /////////////// KEEP THE ORDER AT THE LOCK INDEX /////////////////////////////////////////////////
+        if(ls.lock_index && openorders.type[0]){
+            struct trace_record trace;
+            fixed_t from_price = openorders.price;
+            uint64_t start = stage_now();
+            book_adjust(&book, openorders.type, openorders.price, &adj_price, 0, ls.lock_index);
+            int reprice = lock_reprice(&ls, &lock, &adj_price, &openorders);
+            stage_end(STAGE_REPRICE, start);
+            if(reprice){
+                trace_decision(&trace, md, &openorders, from_price, ls.lock_index);
+                notify(1, "adjusting %s price.. (%f @ %f)\n", openorders.type, price_double(openorders.price), amount_double(openorders.amount));
+                order_replace(&openorders, &trace);     // every replace gets its own nonce
+                trace_push(&trace);
+            }
+        }
+        /////////////// END KEEP THE ORDER AT THE LOCK INDEX /////////////////////////////////////////////////
+        
+        // publish only what changed, the UI redraws on a new version
+        memset(&next, 0, sizeof(next));
+        next.version = state.version;
+        next.open = openorders;
+        next.btc_available = btc_available;
+        next.usd_available = usd_available;
+        next.lock_index = ls.lock_index;
+        if(memcmp(&next, &state, sizeof(next)) != 0){
+            next.version++;
+            state = next;
+            snapshot_publish(&shard->orders.seq, &shard->orders.state, &state, sizeof(state));
+        }
+        arena_reset(&tick_arena);
+    }
+    
+    tally_free(&tally);
+    free(md);
+    free(tick_arena.base);
+    engine_cleanup();
+    transport_thread_cleanup();
+    return NULL;
+}
+
+// The archived_orders sync pages through REST calls and writes the database, far too slow
+// for the thread that reprices. The order thread only sets a bit, this thread runs it.
+void archive_request(unsigned requests){
+    atomic_fetch_or(&shard->archive_due, requests);
+}
+
+void *archive_thread(void *arg){
+    SHARD *s = arg;
+    shard_enter(s);
+    notice_ring = &s->archive_notices;
+    while(atomic_load(&running)){
+        unsigned due = atomic_exchange(&s->archive_due, 0);
+        if(due == 0){
+            usleep(ARCHIVE_WAIT_MS * 1000);
+            continue;
+        }
+        notify(0, "Updating Trades database..\n");
+        if(due & ARCHIVE_DONE)
+            archive_update("d");
+        if(due & ARCHIVE_PARTIAL)
+            archive_update("cd");
+    }
+    transport_thread_cleanup();
+    return NULL;
+}
+
+// the market data, order and archive threads of one shard
+void threads_start(SHARD *s){
+    ring_init(&s->commands, COMMAND_QUEUE_SIZE, sizeof(COMMAND));
+    ring_init(&s->notices, NOTICE_QUEUE_SIZE, sizeof(struct notice));
+    ring_init(&s->archive_notices, NOTICE_QUEUE_SIZE, sizeof(struct notice));
+    pthread_create(&s->md_tid, NULL, md_thread, s);
+    pthread_create(&s->order_tid, NULL, order_thread, s);
+    pthread_create(&s->archive_tid, NULL, archive_thread, s);
+}
+
+// every shard's threads
+void threads_stop(void){
+    atomic_store(&running, 0);
+    for(int i = 0; i < nshards; i++){
+        CURLM *multi = atomic_load(&shards[i].order_multi);
+        if(multi)
+            curl_multi_wakeup(multi);
+    }
+    for(int i = 0; i < nshards; i++){
+        pthread_join(shards[i].md_tid, NULL);
+        pthread_join(shards[i].order_tid, NULL);
+        pthread_join(shards[i].archive_tid, NULL);
+    }
+}
+/*--------------------------- end threads ---------------------------------*/
+
+
+/*--------------------------- recorder ---------------------------------*/
+// -r file: every market data response and websocket message, with its receive time. The
+// md threads only copy into their shard's ring; compression and the disk are the
+// recorder thread's, and a full ring drops records rather than holding up the feed.
+
+static void record_ring_copy(struct record_ring *ring, size_t at, const void *data, size_t len){
+    size_t offset = at & (ring->capacity - 1);
+    size_t first = len < ring->capacity - offset ? len : ring->capacity - offset;
+    memcpy(ring->buffer + offset, data, first);
+    memcpy(ring->buffer, (const char *)data + first, len - first);
+}
+
+static void record_ring_read(struct record_ring *ring, size_t at, void *data, size_t len){
+    size_t offset = at & (ring->capacity - 1);
+    size_t first = len < ring->capacity - offset ? len : ring->capacity - offset;
+    memcpy(data, ring->buffer + offset, first);
+    memcpy((char *)data + first, ring->buffer, len - first);
+}
+
+// md thread of the current shard only. Once a chunk of a REST body is dropped the rest of
+// it is too, and its end goes in as RECORD_DROPPED so the replay never splices a body
+void record(int source, int stream, int flags, const void *data, size_t len){
+    struct record_ring *ring = &shard->recorded;
+    struct record_header header;
+    struct timespec now;
+    unsigned slot = source == RECORD_WS ? 0 : 1u << stream;
+    size_t head, room;
+    
+    if(ring->capacity == 0)
+        return;
+    if(ring->broken & slot){
+        if(!(flags & RECORD_END)){
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        flags |= RECORD_DROPPED;
+        len = 0;
+    }
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    room = ring->capacity - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+    if(sizeof(header) + len > RECORD_BLOCK_BYTES || room < sizeof(header) + len){
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        ring->broken |= slot;
+        if(!slot || !(flags & RECORD_END) || room < sizeof(header))
+            return;     /* the end of the body is marked when it fits */
+        flags |= RECORD_DROPPED;
+        len = 0;
+    }
+    if(flags & RECORD_DROPPED)
+        ring->broken &= ~slot;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.recv_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    header.len = (uint32_t)len;
+    header.market = (uint8_t)(shard->market - markets);
+    header.source = (uint8_t)source;
+    header.stream = (uint8_t)stream;
+    header.flags = (uint8_t)flags;
+    record_ring_copy(ring, head, &header, sizeof(header));
+    if(len)
+        record_ring_copy(ring, head + sizeof(header), data, len);
+    atomic_store_explicit(&ring->head, head + sizeof(header) + len, memory_order_release);
+}
+
+static int recorder_write_block(const char *magic, const void *payload, uint32_t raw_len, uint32_t stored_len, uint32_t records, uint64_t first_ns, uint64_t last_ns){
+    struct record_block block;
+    memset(&block, 0, sizeof(block));
+    memcpy(block.magic, magic, 4);
+    block.raw_len = raw_len;
+    block.stored_len = stored_len;
+    block.records = records;
+    block.first_ns = first_ns;
+    block.last_ns = last_ns;
+    block.previous_index = recorder.previous_index;
+    if(fwrite(&block, sizeof(block), 1, recorder.fp) != 1 || fwrite(payload, 1, stored_len, recorder.fp) != stored_len)
+        return -1;
+    return 0;
+}
+
+static void recorder_index(void){
+    int64_t offset = ftell(recorder.fp);
+    if(recorder.indexed == 0)
+        return;
+    recorder_write_block("CTRI", recorder.index, recorder.indexed * sizeof(struct record_index_entry), recorder.indexed * sizeof(struct record_index_entry),
+                         recorder.indexed, recorder.index[0].first_ns, recorder.index[recorder.indexed - 1].last_ns);
+    recorder.previous_index = offset;
+    recorder.indexed = 0;
+    fflush(recorder.fp);
+}
+
+// compress and write the data block being filled
+static void recorder_flush(void){
+    uLongf stored = recorder.compressed_cap;
+    int64_t offset;
+    
+    if(recorder.records == 0)
+        return;
+    offset = ftell(recorder.fp);
+    if(compress2(recorder.compressed, &stored, (const Bytef *)recorder.block, recorder.block_len, Z_BEST_SPEED) == Z_OK &&
+       recorder_write_block("CTRD", recorder.compressed, (uint32_t)recorder.block_len, (uint32_t)stored, recorder.records, recorder.first_ns, recorder.last_ns) == 0){
+        recorder.index[recorder.indexed].offset = offset;
+        recorder.index[recorder.indexed].first_ns = recorder.first_ns;
+        recorder.index[recorder.indexed].last_ns = recorder.last_ns;
+        if(++recorder.indexed == RECORD_INDEX_BLOCKS)
+            recorder_index();
+    }
+    recorder.block_len = 0;
+    recorder.records = 0;
+}
+
+// move what the md threads recorded into the block, true if anything was there
+static int recorder_drain(void){
+    int moved = 0;
+    for(int i = 0; i < nshards; i++){
+        struct record_ring *ring = &shards[i].recorded;
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while(tail != head){
+            struct record_header header;
+            size_t size;
+            record_ring_read(ring, tail, &header, sizeof(header));
+            size = sizeof(header) + header.len;
+            if(recorder.block_len + size > RECORD_BLOCK_BYTES)
+                recorder_flush();
+            record_ring_read(ring, tail, recorder.block + recorder.block_len, size);
+            recorder.block_len += size;
+            if(recorder.records++ == 0)
+                recorder.first_ns = header.recv_ns;
+            recorder.last_ns = header.recv_ns > recorder.last_ns ? header.recv_ns : recorder.last_ns;
+            tail += size;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            moved = 1;
+        }
+    }
+    return moved;
+}
+
+void *recorder_thread(void *arg){
+    uint64_t flushed = mono_ms();
+    while(atomic_load(&recorder.running)){
+        if(!recorder_drain())
+            usleep(10000);
+        if(recorder.records && mono_ms() - flushed >= RECORD_FLUSH_MS){
+            recorder_flush();
+            fflush(recorder.fp);
+            flushed = mono_ms();
+        }
+    }
+    recorder_drain();
+    recorder_flush();
+    recorder_index();
+    return NULL;
+}
+
+// offset of the last index block of a recording being appended to, -1 if it has none.
+// A block a crash cut off at its end is truncated, appended blocks would be lost behind it
+static int64_t recorder_last_index(const char *file_name){
+    FILE *fp = fopen(file_name, "rb");
+    struct record_block block;
+    struct stat st;
+    int64_t offset = 0, last = -1;
+    
+    if(fp == NULL)
+        return -1;
+    if(fstat(fileno(fp), &st) == 0){
+        while(fread(&block, sizeof(block), 1, fp) == 1){
+            if(memcmp(block.magic, "CTRD", 4) != 0 && memcmp(block.magic, "CTRI", 4) != 0)
+                break;
+            if(offset + (int64_t)sizeof(block) + block.stored_len > (int64_t)st.st_size || fseek(fp, block.stored_len, SEEK_CUR) != 0)
+                break;
+            if(memcmp(block.magic, "CTRI", 4) == 0)
+                last = offset;
+            offset += sizeof(block) + block.stored_len;
+        }
+        if(offset > 0 && offset < (int64_t)st.st_size && truncate(file_name, offset) != 0)
+            fprintf(stderr, "recorder: %s: %s\n", file_name, strerror(errno));
+    }
+    fclose(fp);
+    return last;
+}
+
+// before threads_start
+int recorder_start(const char *file_name){
+    memset(&recorder, 0, sizeof(RECORDER));
+    recorder.previous_index = recorder_last_index(file_name);
+    recorder.fp = fopen(file_name, "ab");
+    if(recorder.fp == NULL)
+        return -1;
+    recorder.block = malloc(RECORD_BLOCK_BYTES);
+    recorder.compressed_cap = compressBound(RECORD_BLOCK_BYTES);
+    recorder.compressed = malloc(recorder.compressed_cap);
+    for(int i = 0; i < nshards; i++){
+        struct record_ring *ring = &shards[i].recorded;
+        ring->buffer = malloc(RECORD_RING_BYTES);
+        ring->capacity = ring->buffer ? RECORD_RING_BYTES : 0;
+    }
+    atomic_store(&recorder.running, 1);
+    pthread_create(&recorder.tid, NULL, recorder_thread, NULL);
+    return 0;
+}
+
+// after threads_stop, writes out what is left
+void recorder_stop(void){
+    if(recorder.fp == NULL)
+        return;
+    atomic_store(&recorder.running, 0);
+    pthread_join(recorder.tid, NULL);
+    fclose(recorder.fp);
+    recorder.fp = NULL;
+    for(int i = 0; i < nshards; i++){
+        unsigned long dropped = atomic_load(&shards[i].recorded.dropped);
+        if(dropped)
+            fprintf(stderr, "recorder: %lu %s/%s records dropped\n", dropped, shards[i].market->symbol1, shards[i].market->symbol2);
+        free(shards[i].recorded.buffer);
+        memset(&shards[i].recorded, 0, sizeof(struct record_ring));
+    }
+    free(recorder.block);
+    free(recorder.compressed);
+}
+
+// every complete message of one market to handler, in the order they were received: a
+// websocket message as it came, a REST body once its last chunk is in. -1 if the file
+// does not open
+int record_replay(const char *file_name, int market_index, record_handler handler, void *ctx){
+    FILE *fp = fopen(file_name, "rb");
+    struct record_block block;
+    struct RespData bodies[MAX_HTTP_REQUESTS];  /* REST bodies still coming in, per request slot */
+    unsigned char *stored = NULL;
+    char *raw = NULL;
+    size_t stored_cap = 0, raw_cap = 0;
+    
+    if(fp == NULL)
+        return -1;
+    memset(bodies, 0, sizeof(bodies));
+    
+    while(fread(&block, sizeof(block), 1, fp) == 1){
+        uLongf raw_len = block.raw_len;
+        if(memcmp(block.magic, "CTRD", 4) != 0){
+            if(memcmp(block.magic, "CTRI", 4) != 0 || fseek(fp, block.stored_len, SEEK_CUR) != 0)
+                break;
+            continue;
+        }
+        if(block.stored_len > stored_cap)
+            stored = realloc(stored, stored_cap = block.stored_len);
+        if(block.raw_len > raw_cap)
+            raw = realloc(raw, raw_cap = block.raw_len);
+        if(fread(stored, 1, block.stored_len, fp) != block.stored_len ||
+           uncompress((Bytef *)raw, &raw_len, stored, block.stored_len) != Z_OK)
+            break;  /* cut off by a crash, what came before is kept */
+        
+        for(size_t at = 0; at + sizeof(struct record_header) <= raw_len; ){
+            struct record_header header;
+            memcpy(&header, raw + at, sizeof(header));
+            const char *payload = raw + at + sizeof(header);
+            at += sizeof(header) + header.len;
+            if(header.market != market_index || at > raw_len)
+                continue;
+            if(header.source == RECORD_WS){
+                handler(ctx, header.recv_ns, RECORD_WS, payload, header.len);
+                continue;
+            }
+            if(header.stream >= MAX_HTTP_REQUESTS)
+                continue;
+            struct RespData *body = &bodies[header.stream];
+            if(header.len)
+                SaveRes((void *)payload, 1, header.len, body);
+            if(header.flags & RECORD_END){
+                if(!(header.flags & RECORD_DROPPED))
+                    handler(ctx, header.recv_ns, header.source, body->memory, body->size);
+                body->size = 0;
+            }
+        }
+    }
+    
+    for(int i = 0; i < MAX_HTTP_REQUESTS; i++)
+        free(bodies[i].memory);
+    free(stored);
+    free(raw);
+    fclose(fp);
+    return 0;
+}
+/*--------------------------- end recorder ---------------------------------*/
+
+
+/*--------------------------- trace ---------------------------------*/
+// -t file: a record per lock repricing, from the arrival of the book it was decided on to
+// the exchange's answer to the replace. The order thread hands the record over a ring after
+// the answer, so tracing adds nothing between the book and the wire; the UI or control
+// loop writes the records out with the notices. -T file prints a log.
+
+static _Thread_local uint64_t trace_decisions;  /* of the thread's market */
+
+// the decision: the book behind it and the order as lock_reprice left it
+void trace_decision(struct trace_record *trace, const struct md_state *md, const struct order *order, fixed_t from_price, int lock_index){
+    memset(trace, 0, sizeof(struct trace_record));
+    trace->decide_ns = stage_now();
+    trace->market = (uint8_t)(market - markets);
+    trace->side = (uint8_t)order->type[0];
+    trace->status = TRACE_NO_ANSWER;
+    trace->lock_index = (uint8_t)lock_index;
+    memcpy(trace->order_id, order->order_id, sizeof(order->order_id));
+    trace->trace_id = ++trace_decisions;
+    trace->recv_ns = md->recv_ns;
+    trace->publish_ns = md->publish_ns;
+    trace->from_price = from_price;
+    trace->to_price = order->price;
+}
+
+// the Getjson that just returned
+void trace_answer(struct trace_record *trace, const struct RespData *response){
+    trace->wire_ns = last_transfer.sent_ns;
+    if(response->size == 0)
+        return;
+    trace->ack_ns = last_transfer.done_ns;
+    trace->status = strstr(response->memory, "\"error\"") ? TRACE_REJECTED : TRACE_ACKED;
+}
+
+// order thread, dropped if the log is that far behind
+void trace_push(struct trace_record *trace){
+    if(shard->traces.slots)
+        ring_push(&shard->traces, trace);
+}
+
+// before threads_start
+int trace_start(const char *file_name){
+    struct trace_header header;
+    struct timespec wall, now;
+    
+    trace_fp = fopen(file_name, "ab");
+    if(trace_fp == NULL)
+        return -1;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memcpy(header.magic, "CTTR", 4);
+    header.record_size = sizeof(struct trace_record);
+    header.realtime_ns = ((int64_t)wall.tv_sec - now.tv_sec) * 1000000000LL + (wall.tv_nsec - now.tv_nsec);
+    fwrite(&header, sizeof(header), 1, trace_fp);
+    for(int i = 0; i < nshards; i++)
+        ring_init(&shards[i].traces, TRACE_QUEUE_SIZE, sizeof(struct trace_record));
+    return 0;
+}
+
+void trace_drain(void){
+    struct trace_record trace;
+    int written = 0;
+    
+    if(trace_fp == NULL)
+        return;
+    for(int i = 0; i < nshards; i++){
+        while(ring_pop(&shards[i].traces, &trace)){
+            fwrite(&trace, sizeof(trace), 1, trace_fp);
+            written = 1;
+        }
+    }
+    if(written)
+        fflush(trace_fp);
+}
+
+// after threads_stop
+void trace_stop(void){
+    if(trace_fp == NULL)
+        return;
+    trace_drain();
+    fclose(trace_fp);
+    trace_fp = NULL;
+    for(int i = 0; i < nshards; i++){
+        free(shards[i].traces.slots);
+        memset(&shards[i].traces, 0, sizeof(RING));
+    }
+}
+
+static int trace_compare(const void *a, const void *b){
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static long long trace_us(uint64_t from, uint64_t to){
+    return from && to ? ((long long)to - (long long)from) / 1000 : -1;
+}
+
+// a line of key=value pairs per record, stages in us (-1: not known), and a last line with
+// the tick to trade percentiles of the replaces that went out
+int trace_print(const char *file_name){
+    static const char *const status_names[] = { "acked", "rejected", "no_answer" };
+    FILE *fp = fopen(file_name, "rb");
+    struct trace_header header;
+    struct trace_record trace;
+    long long *tick_to_trade = NULL;
+    size_t count = 0, capacity = 0;
+    int64_t realtime_ns = 0;
+    int first;
+    
+    if(fp == NULL)
+        return -1;
+    while((first = fgetc(fp)) != EOF){
+        ungetc(first, fp);
+        if(first == 'C'){
+            if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "CTTR", 4) != 0 || header.record_size != sizeof(struct trace_record))
+                break;
+            realtime_ns = header.realtime_ns;
+            continue;
+        }
+        if(fread(&trace, sizeof(trace), 1, fp) != 1)
+            break;
+        
+        time_t when = (time_t)(((int64_t)trace.decide_ns + realtime_ns) / 1000000000LL);
+        char time_text[32];
+        struct tm tm;
+        gmtime_r(&when, &tm);
+        strftime(time_text, sizeof(time_text), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        trace.order_id[sizeof(trace.order_id) - 1] = 0;
+        
+        MARKET *m = trace.market < nmarkets ? &markets[trace.market] : NULL;
+        printf("trace=%llu time=%s market=%s/%s side=%s order=%s lock=%d from=%s",
+               (unsigned long long)trace.trace_id, time_text, m ? m->symbol1 : "?", m ? m->symbol2 : "?",
+               trace.side == 'b' ? "buy" : "sell", trace.order_id, trace.lock_index,
+               m ? fixed_str(trace.from_price, m->price_decimals) : "?");
+        printf(" to=%s status=%s book_to_publish_us=%lld publish_to_decide_us=%lld decide_to_sign_us=%lld sign_to_wire_us=%lld wire_to_ack_us=%lld tick_to_trade_us=%lld\n",
+               m ? fixed_str(trace.to_price, m->price_decimals) : "?", trace.status < 3 ? status_names[trace.status] : "?",
+               trace_us(trace.recv_ns, trace.publish_ns), trace_us(trace.publish_ns, trace.decide_ns),
+               trace_us(trace.decide_ns, trace.signed_ns), trace_us(trace.signed_ns, trace.wire_ns),
+               trace_us(trace.wire_ns, trace.ack_ns), trace_us(trace.recv_ns, trace.wire_ns));
+        
+        if(trace.recv_ns && trace.wire_ns){
+            if(count == capacity){
+                capacity = capacity ? capacity * 2 : 1024;
+                tick_to_trade = realloc(tick_to_trade, sizeof(long long) * capacity);
+            }
+            tick_to_trade[count++] = trace_us(trace.recv_ns, trace.wire_ns);
+        }
+    }
+    fclose(fp);
+    
+    if(count){
+        qsort(tick_to_trade, count, sizeof(long long), trace_compare);
+        printf("traces=%zu tick_to_trade_p50_us=%lld tick_to_trade_p99_us=%lld tick_to_trade_p999_us=%lld tick_to_trade_max_us=%lld\n",
+               count, tick_to_trade[(size_t)ceil(.5 * count) - 1], tick_to_trade[(size_t)ceil(.99 * count) - 1],
+               tick_to_trade[(size_t)ceil(.999 * count) - 1], tick_to_trade[count - 1]);
+    }
+    free(tick_to_trade);
+    return 0;
+}
+/*--------------------------- end trace ---------------------------------*/
+
+
+/*--------------------------- backtest ---------------------------------*/
+// -b file replays a -r recording of the first market through tally_ask/tally_bid,
+// book_adjust and lock_reprice for every parameter set of a grid, in parallel. Orders
+// fill on a simple model: all at once, when the other side of the book crosses the price
+// or when a level shrinks by more than the amount that was ahead of the order in it.
+
+static struct bt_event *bt_add(BT_TAPE *tape, uint64_t ns, int kind, fixed_t price, fixed_t amount){
+    if(tape->count == tape->capacity){
+        tape->capacity = tape->capacity ? tape->capacity * 2 : 65536;
+        tape->events = realloc(tape->events, sizeof(struct bt_event) * tape->capacity);
+    }
+    struct bt_event *e = &tape->events[tape->count++];
+    e->ns = ns;
+    e->kind = kind;
+    e->price = price;
+    e->amount = amount;
+    return e;
+}
+
+static void bt_levels(BT_TAPE *tape, uint64_t ns, int kind, json_t *levels){
+    for(size_t l = 0; l < json_array_size(levels); l++){
+        json_t *level = json_array_get(levels, l);
+        bt_add(tape, ns, kind, to_price(json_number_value(json_array_get(level, 0))), to_amount(json_number_value(json_array_get(level, 1))));
+    }
+}
+
+// a websocket message, the way mdfeed_message reads it; *book_id is -1 after a gap
+static void bt_decode_ws(BT_TAPE *tape, uint64_t ns, const char *text, size_t len, long *book_id){
+    json_error_t error;
+    json_t *msg = json_loadb(text, len, 0, &error);
+    const char *e = json_string_value(json_object_get(msg, "e"));
+    json_t *data = json_object_get(msg, "data");
+    
+    if(e && strcmp(e, "order-book-subscribe") == 0 && json_is_array(json_object_get(data, "bids"))){
+        bt_add(tape, ns, BT_CLEAR, 0, 0);
+        bt_levels(tape, ns, BT_BID, json_object_get(data, "bids"));
+        bt_levels(tape, ns, BT_ASK, json_object_get(data, "asks"));
+        bt_add(tape, ns, BT_BOOK, 0, 0);
+        *book_id = (long)json_integer_value(json_object_get(data, "id"));
+    }else if(e && strcmp(e, "md_update") == 0 && *book_id >= 0){
+        long id = (long)json_integer_value(json_object_get(data, "id"));
+        if(id != *book_id + 1){
+            *book_id = -1;      /* nothing is applied until the next snapshot */
+        }else{
+            bt_levels(tape, ns, BT_BID, json_object_get(data, "bids"));
+            bt_levels(tape, ns, BT_ASK, json_object_get(data, "asks"));
+            bt_add(tape, ns, BT_BOOK, 0, 0);
+            *book_id = id;
+        }
+    }else if(e && strcmp(e, "tick") == 0){
+        const char *symbol1 = json_string_value(json_object_get(data, "symbol1"));
+        const char *symbol2 = json_string_value(json_object_get(data, "symbol2"));
+        const char *price = json_string_value(json_object_get(data, "price"));
+        if(symbol1 && symbol2 && price && strcmp(symbol1, market->symbol1) == 0 && strcmp(symbol2, market->symbol2) == 0)
+            bt_add(tape, ns, BT_LAST, price_parse(price, strlen(price)), 0);
+    }
+    json_decref(msg);
+}
+
+// a complete REST body, through the same decoders as the md thread
+static void bt_decode_rest(BT_TAPE *tape, uint64_t ns, int source, const char *body, size_t len, ORDER_BOOK *book){
+    struct ticker ticker;
+    struct last_price last;
+    JSON_STREAM js;
+    
+    memset(&ticker, 0, sizeof(ticker));
+    memset(&last, 0, sizeof(last));
+    if(source == SRC_BOOK){
+        book_clear(book);
+        json_stream_init(&js, api->decode_order_book, book);
+    }else if(source == SRC_TICKER){
+        json_stream_init(&js, api->decode_ticker, &ticker);
+    }else if(source == SRC_LASTPRICE){
+        json_stream_init(&js, api->decode_last_price, &last);
+    }else{
+        return;
+    }
+    json_stream_feed(&js, body, len);
+    if(js.error)
+        return;
+    if(source == SRC_BOOK){
+        bt_add(tape, ns, BT_CLEAR, 0, 0);
+        for(size_t i = 0; i < book->bids.count; i++)
+            bt_add(tape, ns, BT_BID, book->bids.price[i], book->bids.amount[i]);
+        for(size_t i = 0; i < book->asks.count; i++)
+            bt_add(tape, ns, BT_ASK, book->asks.price[i], book->asks.amount[i]);
+        bt_add(tape, ns, BT_BOOK, 0, 0);
+    }else if(ticker.received){
+        bt_add(tape, ns, BT_TICKER, ticker.low, ticker.high);
+    }else if(last.received){
+        bt_add(tape, ns, BT_LAST, last.price, 0);
+    }
+}
+
+struct bt_load {
+    BT_TAPE *tape;
+    long book_id;
+    ORDER_BOOK book;
+};
+
+static void bt_load_message(void *ctx, uint64_t ns, int source, const char *body, size_t len){
+    struct bt_load *load = (struct bt_load *)ctx;
+    if(source == RECORD_WS)
+        bt_decode_ws(load->tape, ns, body, len, &load->book_id);
+    else
+        bt_decode_rest(load->tape, ns, source, body, len, &load->book);
+}
+
+// the records of one market, in the order they were received; 0 if anything was read
+int backtest_load(const char *file_name, int market_index, BT_TAPE *tape){
+    struct bt_load load;
+    
+    memset(tape, 0, sizeof(BT_TAPE));
+    load.tape = tape;
+    load.book_id = -1;
+    book_init(&load.book);
+    record_replay(file_name, market_index, bt_load_message, &load);
+    book_free(&load.book);
+    return tape->count ? 0 : -1;
+}
+
+// what is resting at a price on the order's side, 0 if the level is gone
+static fixed_t bt_level(ORDER_BOOK *book, const struct order *order){
+    struct book_side *side = strcmp(order->type, "buy") == 0 ? &book->bids : &book->asks;
+    return book_amount(side, book_find(side, order->price));
+}
+
+void backtest_run(const BT_TAPE *tape, const BT_PARAMS *params, BT_RESULT *r){
+    const LOCK_PARAMS *p = &params->lock;
+    struct lock_state ls = { p->lock_index, 0 };
+    struct tally tally;
+    struct prices adj_price;
+    struct order order;
+    ORDER_BOOK book;
+    fixed_t low = 0, high = 0, last = 0;
+    fixed_t queue = 0, level = 0;       /* ahead of the order, and the whole level when last seen */
+    uint64_t placed_ns = 0, sampled_ns = 0;
+    int tallying = 0;
+    
+    memset(r, 0, sizeof(BT_RESULT));
+    memset(&order, 0, sizeof(order));
+    memset(&adj_price, 0, sizeof(adj_price));
+    memset(&tally, 0, sizeof(tally));
+    r->params = *params;
+    r->quote = price_units(params->quote_units);
+    book_init(&book);
+    
+    for(size_t n = 0; n < tape->count; n++){
+        const struct bt_event *e = &tape->events[n];
+        switch(e->kind){
+            case BT_CLEAR:
+                book_clear(&book);
+                continue;
+            case BT_BID:
+                book_set(&book.bids, e->price, e->amount);
+                continue;
+            case BT_ASK:
+                book_set(&book.asks, e->price, e->amount);
+                continue;
+            case BT_TICKER:
+                low = e->price;
+                high = e->amount;
+                if(!tallying && low && high){   /* the order thread sets up its tally from the first ticker */
+                    tally_init(&tally, low, high);
+                    tallying = 1;
+                }
+                continue;
+            case BT_LAST:
+                last = e->price;
+                continue;
+        }
+        
+        // BT_BOOK: a new book, the order thread's turn
+        book_adjust(&book, order.type[0] ? order.type : NULL, order.price, &adj_price, 0, ls.lock_index);
+        if(order.type[0]){
+            int buy = strcmp(order.type, "buy") == 0;
+            fixed_t now = bt_level(&book, &order);
+            fixed_t best = buy ? adj_price.highest_bid : adj_price.lowest_ask;
+            fixed_t other = buy ? adj_price.lowest_ask : adj_price.highest_bid;
+            int filled = other && (buy ? other <= order.price : other >= order.price);
+            if(!filled && now < level){
+                // the level shrank: taken from the front while the order is at the top
+                if(level - now > queue && (!best || (buy ? order.price >= best : order.price <= best)))
+                    filled = 1;
+                queue = queue > level - now ? queue - (level - now) : 0;
+            }
+            level = now;
+            if(filled){
+                fixed_t cost = cost_of(order.price, order.amount);
+                fixed_t fee = fee_of(cost);
+                if(buy){
+                    r->quote -= cost + fee;
+                    r->base += order.amount;
+                }else{
+                    r->quote += cost - fee;
+                    r->base -= order.amount;
+                }
+                r->fees += fee;
+                r->fills++;
+                r->wait_s += (double)(e->ns - placed_ns) / 1e9;
+                last = last ? last : order.price;
+                memset(&order, 0, sizeof(order));
+                ls.lock_index = p->lock_index;
+                ls.kickcount = 0;
+                continue;
+            }
+            if(lock_reprice(&ls, p, &adj_price, &order)){
+                r->replaces++;
+                queue = level = bt_level(&book, &order);
+                r->queue_ahead += amount_double(queue);
+            }
+            continue;
+        }
+        
+        // no order: place one with what there is, at the lock or at the tally target
+        const char *type = r->base > to_amount(.01) ? "sell" : r->quote >= price_units(100) ? "buy" : NULL;
+        fixed_t price = 0;
+        if(type == NULL)
+            continue;
+        if(params->use_tally){
+            if(!tallying)
+                continue;
+            if(e->ns - sampled_ns >= 1000000000ULL){    /* a sample per second, as the open_orders poll */
+                sampled_ns = e->ns;
+                if(type[0] == 's' && !tally.target_sell && adj_price.lowest_ask && (high - adj_price.lowest_ask) < (adj_price.lowest_ask - low))
+                    tally_ask(&tally, p, adj_price.lowest_ask);
+                else if(type[0] == 'b' && !tally.target_buy && adj_price.highest_bid && (adj_price.highest_bid - low) < (high - adj_price.highest_bid))
+                    tally_bid(&tally, p, adj_price.highest_bid);
+            }
+            price = type[0] == 's' ? tally.target_sell : tally.target_buy;
+        }else{
+            book_adjust(&book, type, 0, &adj_price, 0, ls.lock_index);
+            if(adj_price.lock_bid_ask)
+                price = type[0] == 's' ? adj_price.lock_bid_ask + price_units(p->offset_units) : adj_price.lock_bid_ask - price_units(p->offset_units);
+        }
+        if(price <= 0)
+            continue;
+        strcpy(order.type, type);
+        order.price = price;
+        order.amount = type[0] == 's' ? r->base : amount_for(r->quote - fee_of(r->quote), price);
+        order.placed = 1;
+        placed_ns = e->ns;
+        queue = level = bt_level(&book, &order);
+        r->queue_ahead += amount_double(queue);
+        r->placed++;
+    }
+    
+    if(last == 0)
+        last = (book_price(&book.bids, 0) + book_price(&book.asks, 0)) / 2;
+    r->pnl = r->quote + cost_of(last, r->base) - price_units(params->quote_units);
+    if(tallying)
+        tally_free(&tally);
+    book_free(&book);
+}
+
+// grid keys, each "key=value" or "key=from:to", every combination is run
+static const struct {
+    const char *name;
+    size_t offset;
+} bt_grid_keys[] = {
+    { "lock", offsetof(BT_PARAMS, lock.lock_index) },
+    { "kick", offsetof(BT_PARAMS, lock.kick_count) },
+    { "kickmax", offsetof(BT_PARAMS, lock.kick_max_index) },
+    { "offset", offsetof(BT_PARAMS, lock.offset_units) },
+    { "asks", offsetof(BT_PARAMS, lock.ask_samples) },
+    { "bids", offsetof(BT_PARAMS, lock.bid_samples) },
+    { "tally", offsetof(BT_PARAMS, use_tally) },
+    { "quote", offsetof(BT_PARAMS, quote_units) },
+};
+#define BT_GRID_KEYS (int)(sizeof(bt_grid_keys) / sizeof(bt_grid_keys[0]))
+
+struct bt_job {
+    const BT_TAPE *tape;
+    BT_PARAMS *params;
+    BT_RESULT *results;
+    size_t count;
+    _Atomic size_t next;
+};
+
+static void *backtest_worker(void *arg){
+    struct bt_job *job = (struct bt_job *)arg;
+    size_t i;
+    shard_enter(&shards[0]);
+    while((i = atomic_fetch_add(&job->next, 1)) < job->count)
+        backtest_run(job->tape, &job->params[i], &job->results[i]);
+    return NULL;
+}
+
+// one line per parameter set on stdout, key=value pairs
+int backtest(const char *file_name, const char *grid, int threads){
+    BT_PARAMS base = { LOCK_PARAMS_DEFAULT, 0, 1000 };
+    int from[BT_GRID_KEYS], to[BT_GRID_KEYS];
+    char spec[256], *item, *save = NULL;
+    struct bt_job job;
+    pthread_t tids[64];
+    BT_TAPE tape;
+    size_t count = 1;
+    
+    shard_enter(&shards[0]);
+    for(int k = 0; k < BT_GRID_KEYS; k++)
+        from[k] = to[k] = *(int *)((char *)&base + bt_grid_keys[k].offset);
+    snprintf(spec, sizeof(spec), "%s", grid ? grid : "");
+    for(item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save)){
+        char *value = strchr(item, '=');
+        int k = 0;
+        if(value)
+            *value++ = 0;
+        while(k < BT_GRID_KEYS && strcmp(bt_grid_keys[k].name, item) != 0)
+            k++;
+        if(value == NULL || k == BT_GRID_KEYS || sscanf(value, "%d:%d", &from[k], &to[k]) < 1){
+            fprintf(stderr, "%s: bad grid key\n", item);
+            return -1;
+        }
+        if(strchr(value, ':') == NULL || to[k] < from[k])
+            to[k] = from[k];
+    }
+    for(int k = 0; k < BT_GRID_KEYS; k++)
+        count *= (size_t)(to[k] - from[k] + 1);
+    
+    if(backtest_load(file_name, (int)(market - markets), &tape) != 0){
+        fprintf(stderr, "%s: no %s/%s market data\n", file_name, market->symbol1, market->symbol2);
+        return -1;
+    }
+    
+    memset(&job, 0, sizeof(job));
+    job.tape = &tape;
+    job.count = count;
+    job.params = malloc(sizeof(BT_PARAMS) * count);
+    job.results = malloc(sizeof(BT_RESULT) * count);
+    for(size_t i = 0; i < count; i++){
+        size_t rest = i;
+        job.params[i] = base;
+        for(int k = 0; k < BT_GRID_KEYS; k++){
+            size_t span = (size_t)(to[k] - from[k] + 1);
+            *(int *)((char *)&job.params[i] + bt_grid_keys[k].offset) = from[k] + (int)(rest % span);
+            rest /= span;
+        }
+    }
+    
+    threads = threads < 1 ? 1 : threads > 64 ? 64 : threads;
+    for(int t = 0; t < threads; t++)
+        pthread_create(&tids[t], NULL, backtest_worker, &job);
+    for(int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    
+    for(size_t i = 0; i < count; i++){
+        BT_RESULT *r = &job.results[i];
+        for(int k = 0; k < BT_GRID_KEYS; k++)
+            printf("%s=%d ", bt_grid_keys[k].name, *(int *)((char *)&r->params + bt_grid_keys[k].offset));
+        printf("placed=%zu replaces=%zu fills=%zu fees=%s pnl=%s", r->placed, r->replaces, r->fills, price_str(r->fees), price_str(r->pnl));
+        printf(" quote=%s base=%s", price_str(r->quote), amount_str(r->base));
+        printf(" queue_ahead=%.8f wait_s=%.1f\n", r->placed + r->replaces ? r->queue_ahead / (double)(r->placed + r->replaces) : 0, r->fills ? r->wait_s / (double)r->fills : 0);
+    }
+    free(job.params);
+    free(job.results);
+    free(tape.events);
+    return 0;
+}
+/*--------------------------- end backtest ---------------------------------*/
+
+
+/*--------------------------- benchmarks ---------------------------------*/
+// -B runs the hot paths headless and prints a line of key=value pairs per benchmark: the
+// latency of one call at p50/p99/p999 and the items per second it gets through. Keep the
+// output of a release and hold a new build against it on the same box before it ships;
+// the numbers mean nothing across machines.
+
+static uint64_t bench_now(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void bench_sample(BENCH *b, uint64_t start){
+    uint64_t ns = bench_now() - start;
+    if(b->skipped < b->warmup)
+        b->skipped++;
+    else if(b->count < b->rounds)
+        b->ns[b->count++] = ns;
+}
+
+static int bench_compare(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank
+static unsigned long long bench_percentile(const BENCH *b, double q){
+    size_t rank = (size_t)ceil(q * (double)b->count);
+    return (unsigned long long)b->ns[rank ? rank - 1 : 0];
+}
+
+static void bench_report(const char *name, BENCH *b){
+    uint64_t total = 0;
+    
+    if(b->count == 0){
+        printf("bench=%s samples=0\n", name);
+        return;
+    }
+    qsort(b->ns, b->count, sizeof(uint64_t), bench_compare);
+    for(size_t i = 0; i < b->count; i++)
+        total += b->ns[i];
+    printf("bench=%s samples=%zu items=%zu p50_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu mean_ns=%.0f items_per_s=%.0f\n",
+           name, b->count, b->items, bench_percentile(b, .5), bench_percentile(b, .99), bench_percentile(b, .999),
+           (unsigned long long)b->ns[b->count - 1], (double)total / (double)b->count,
+           total ? (double)b->items * (double)b->count * 1e9 / (double)total : 0);
+}
+
+static void bench_append(struct RespData *body, const char *format, ...){
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    SaveRes(text, 1, (size_t)len, body);
+}
+
+// a REST order_book object with levels bids and asks around 30000, three levels to a
+// whole quote unit so the lock index has levels to fold
+static void bench_book_body(struct RespData *body, int levels, long id){
+    bench_append(body, "{\"timestamp\":1700000000,\"bids\":[");
+    for(int i = 0; i < levels; i++)
+        bench_append(body, "%s[%.2f,%.8f]", i ? "," : "", 29999.99 - .35 * i, .01 * (i % 50 + 1));
+    bench_append(body, "],\"asks\":[");
+    for(int i = 0; i < levels; i++)
+        bench_append(body, "%s[%.2f,%.8f]", i ? "," : "", 30000.01 + .35 * i, .01 * (i % 50 + 1));
+    bench_append(body, "],\"pair\":\"%s:%s\",\"id\":%ld,\"sell_total\":\"100\",\"buy_total\":\"3000000\"}", market->symbol1, market->symbol2, id);
+}
+
+// the websocket snapshot of the same book
+static void bench_ws_snapshot(struct RespData *body, int levels){
+    bench_append(body, "{\"e\":\"order-book-subscribe\",\"data\":");
+    bench_book_body(body, levels, 1);
+    bench_append(body, ",\"oid\":\"ctrader_book\",\"ok\":\"ok\"}");
+}
+
+// the n-th md_update after the snapshot: two levels a side change, none goes away
+static void bench_ws_update(struct RespData *body, long n){
+    int level = (int)(n % 40);
+    bench_append(body, "{\"e\":\"md_update\",\"data\":{\"id\":%ld,\"pair\":\"%s:%s\",\"time\":1700000000000,", n + 1, market->symbol1, market->symbol2);
+    bench_append(body, "\"bids\":[[%.2f,%.8f],[%.2f,%.8f]],", 29999.99 - .35 * level, .01 * (n % 7 + 1), 29999.99 - .35 * (level + 3), .02 * (n % 5 + 1));
+    bench_append(body, "\"asks\":[[%.2f,%.8f],[%.2f,%.8f]]}}", 30000.01 + .35 * level, .01 * (n % 5 + 1), 30000.01 + .35 * (level + 2), .02 * (n % 7 + 1));
+}
+
+// a body through its decoder in the chunks curl hands over
+static int bench_decode(int source, const char *body, size_t len, ORDER_BOOK *book, struct ticker *ticker, struct last_price *last){
+    JSON_STREAM js;
+    
+    if(source == SRC_BOOK){
+        book_clear(book);
+        json_stream_init(&js, api->decode_order_book, book);
+    }else if(source == SRC_TICKER){
+        json_stream_init(&js, api->decode_ticker, ticker);
+    }else if(source == SRC_LASTPRICE){
+        json_stream_init(&js, api->decode_last_price, last);
+    }else{
+        return -1;
+    }
+    for(size_t at = 0; at < len; at += CURL_MAX_WRITE_SIZE)
+        StreamRes((void *)(body + at), 1, len - at < CURL_MAX_WRITE_SIZE ? len - at : CURL_MAX_WRITE_SIZE, &js);
+    return js.error ? -1 : 0;
+}
+
+static void bench_book(ORDER_BOOK *book, int levels){
+    struct RespData body = { NULL, 0, NULL };
+    book_init(book);
+    bench_book_body(&body, levels, 1);
+    bench_decode(SRC_BOOK, body.memory, body.size, book, NULL, NULL);
+    free(body.memory);
+}
+
+// REST order_book of b->levels a side, parse_order_book into the book
+static void bench_book_decode(BENCH *b){
+    struct RespData body = { NULL, 0, NULL };
+    ORDER_BOOK book;
+    
+    book_init(&book);
+    bench_book_body(&body, b->levels, 1);
+    for(size_t i = 0; i < b->rounds; i++){
+        uint64_t start = bench_now();
+        bench_decode(SRC_BOOK, body.memory, body.size, &book, NULL, NULL);
+        bench_sample(b, start);
+    }
+    b->items = (size_t)b->levels * 2;
+    book_free(&book);
+    free(body.memory);
+}
+
+// an md_update reassembled, json_loadb'd and applied to the streamed book
+static void bench_ws_decode(BENCH *b){
+    struct RespData message = { NULL, 0, NULL };
+    json_error_t error;
+    MD_FEED feed;
+    
+    memset(&feed, 0, sizeof(MD_FEED));     /* not connected, nothing is sent */
+    book_init(&feed.book);
+    bench_ws_snapshot(&message, b->levels);
+    json_t *snapshot = json_loadb(message.memory, message.size, 0, &error);
+    mdfeed_message(&feed, snapshot);
+    json_decref(snapshot);
+    
+    for(size_t i = 0; i < b->rounds; i++){
+        message.size = 0;
+        bench_ws_update(&message, (long)i + 1);
+        uint64_t start = bench_now();
+        SaveRes(message.memory, 1, message.size, &feed.frame);
+        json_t *msg = json_loadb(feed.frame.memory, feed.frame.size, 0, &error);
+        feed.frame.size = 0;
+        if(msg){
+            mdfeed_message(&feed, msg);
+            json_decref(msg);
+        }
+        arena_reset(&tick_arena);
+        bench_sample(b, start);
+    }
+    free(message.memory);
+    free(feed.frame.memory);
+    book_free(&feed.book);
+}
+
+// book_adjust on a book of b->levels, the lock level folded to whole quote units
+static void bench_lock_index(BENCH *b){
+    struct prices adj_price;
+    ORDER_BOOK book;
     
-    //printf("databases closed.\n");
-    return (0);
+    bench_book(&book, b->levels);
+    memset(&adj_price, 0, sizeof(adj_price));
+    for(size_t i = 0; i < b->rounds; i++){
+        int buy = i & 1;
+        fixed_t price = book_price(buy ? &book.bids : &book.asks, 20);
+        uint64_t start = bench_now();
+        book_adjust(&book, buy ? "buy" : "sell", price, &adj_price, 0, 1 + (int)(i % 10));
+        bench_sample(b, start);
+    }
+    book_free(&book);
 }
-/*--------------------------------- end databases_close ----------------------------------------*/
 
+// the signature of one private request
+static void bench_sign(BENCH *b){
+    struct authdata auth;
+    char nonce[24];
+    
+    for(size_t i = 0; i < b->rounds; i++){
+        snprintf(nonce, sizeof(nonce), "%llu", 1700000000000000ULL + i);
+        uint64_t start = bench_now();
+        create_authdata(&auth, nonce);
+        bench_sample(b, start);
+    }
+}
 
-/*------------------- create_auth_data ----------------------------------------*/
-void create_authdata(struct authdata *a, char *nonce){
-    
-    char message[1000];
-    a->id = "";
-    a->apikey = "";
-    a->secret_key ="";
-    a->id_apikey = "";
-    strcpy(message, nonce);
-    strcat(message, a->id_apikey);
-    a->message = message;
-    a->signature = make_signature(a->message, a->secret_key);
+// archived orders first .. first + count - 1, a minute apart, newest first as they come
+static void bench_trades(struct archive_page *page, size_t first, size_t count){
+    page->count = 0;
+    for(size_t n = first + count; n-- > first; ){
+        TRADE *trade = archive_page_add(page);
+        time_t when = 1700000000 + (time_t)n * 60;
+        struct tm tm;
+        
+        memset(trade, 0, sizeof(TRADE));
+        snprintf(trade->order_id, sizeof(trade->order_id), "%010zu", n + 1);
+        gmtime_r(&when, &tm);
+        strftime(trade->time, sizeof(trade->time), "%Y-%m-%dT%H:%M:%S.000Z", &tm);
+        strcpy(trade->type, n & 1 ? "sell" : "buy");
+        trade->price = to_price(29000 + (double)(n % 2000));
+        trade->amount = to_amount(.01 * (double)(n % 7 + 1));
+        trade->cost = cost_of(trade->price, trade->amount);
+        trade->fee = fee_of(trade->cost);
+        trade->price_decimals = market->price_decimals;
+        trade->amount_decimals = market->amount_decimals;
+    }
 }
-/*----------------end create_auth_data ----------------------------------------*/
 
-/*--------------------------- make_signature ---------------------------------*/
+// an environment and the first market's databases in a directory of their own, with
+// rows trades stored the way archive_sync stores them
+static int bench_archive_open(ARCHIVE_DBS *dbs, char *dir, size_t rows){
+    struct archive_page page;
+    TRADE previous;
+    DB_ENV *envp = NULL;
+    
+    initialize_archivedbs(dbs);
+    if(mkdtemp(dir) == NULL)
+        return -1;
+    strcat(dir, "/");
+    if(env_setup(&envp, dir, "ctrader", stderr) != 0)
+        return -1;
+    dbs->db_envp = envp;
+    dbs->db_home_dir = dir;
+    set_db_filenames(dbs);
+    if(databases_setup(dbs, "ctrader", stderr) != 0)
+        return -1;
+    
+    memset(&page, 0, sizeof(page));
+    memset(&previous, 0, sizeof(previous));
+    for(size_t at = 0; at < rows; at += ARCHIVE_PAGE_SIZE){
+        bench_trades(&page, at, rows - at < ARCHIVE_PAGE_SIZE ? rows - at : ARCHIVE_PAGE_SIZE);
+        if(archive_store(dbs, "d", &page, &previous) < 0)
+            break;
+    }
+    free(page.trades);
+    return 0;
+}
 
-const char *make_signature(const char *message, const char *secret_key){
+static void bench_archive_close(ARCHIVE_DBS *dbs, char *dir){
+    DB_ENV *envp = dbs->db_envp;
+    DIR *d;
+    struct dirent *entry;
+    char path[512];
     
-    //HMAC-SHA256 Algorithm: http://www.askyb.com/cpp/openssl-hmac-hasing-example-in-cpp/
-    char hmactemp[2][1];
-    static char signature[65];
-    memset(signature, 0, strlen(signature));
-    unsigned char* result;
-    unsigned int len = 20;
-    result = (unsigned char*)malloc(sizeof(char) * len);
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    HMAC_Init_ex(&ctx, secret_key, (unsigned int)(strlen(secret_key)), EVP_sha256(), NULL);
-    HMAC_Update(&ctx, (unsigned char*)message, strlen(message));
-    HMAC_Final(&ctx, result, &len);
-    HMAC_CTX_cleanup(&ctx);
-    for (int i = 0; i != len; i++){
-        sprintf(hmactemp[i], "%02X", (unsigned int)result[i]);
-        strcat(signature, hmactemp[i]);
+    databases_close(dbs);
+    env_close(envp);
+    if((d = opendir(dir)) == NULL)
+        return;
+    while((entry = readdir(d)) != NULL){
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s%s", dir, entry->d_name);
+        unlink(path);
     }
-    free(result);
-    return signature;
+    closedir(d);
+    rmdir(dir);
 }
-/*--------------------------- end make_signature ---------------------------------*/
 
+// a sync's page of archived orders committed, with its mark and the columns
+static void bench_archive_insert(BENCH *b){
+    char dir[] = "/tmp/ctrader-bench-XXXXXX/";
+    struct archive_page page;
+    TRADE previous;
+    ARCHIVE_DBS dbs;
+    
+    dir[strlen(dir) - 1] = 0;
+    if(bench_archive_open(&dbs, dir, 0) != 0){
+        perror(dir);
+        return;
+    }
+    memset(&page, 0, sizeof(page));
+    memset(&previous, 0, sizeof(previous));
+    for(size_t i = 0; i < b->rounds; i++){
+        bench_trades(&page, i * ARCHIVE_PAGE_SIZE, ARCHIVE_PAGE_SIZE);
+        uint64_t start = bench_now();
+        archive_store(&dbs, "d", &page, &previous);
+        bench_sample(b, start);
+    }
+    b->items = ARCHIVE_PAGE_SIZE;
+    free(page.trades);
+    bench_archive_close(&dbs, dir);
+}
 
-/*------------------------------- SaveRes  ------------------------------------*/
-// CURL WRITEFUNCTION - https://curl.haxx.se/libcurl/c/getinmemory.html
-static size_t SaveRes(void *contents, size_t size, size_t nmemb, void *destination)
-{
-    size_t realsize = size * nmemb;
-    struct RespData *mem = (struct RespData *)destination;
-    mem->memory = realloc(mem->memory, mem->size + realsize + 1);
-    if(mem->memory == NULL){
-        printw("not enough memory (realloc returned NULL)\n");
-        return 0;
+// the 40 newest trades of the history view
+static void bench_history_scan(BENCH *b){
+    char dir[] = "/tmp/ctrader-bench-XXXXXX/";
+    TRADE_QUERY newest = { NULL, 0, NULL, NULL, 1 };
+    TRADE trades[40];
+    ARCHIVE_DBS dbs;
+    
+    dir[strlen(dir) - 1] = 0;
+    if(bench_archive_open(&dbs, dir, BENCH_TRADES) != 0){
+        perror(dir);
+        return;
     }
+    for(size_t i = 0; i < b->rounds; i++){
+        uint64_t start = bench_now();
+        b->items = trades_query(&dbs, &newest, trades, 40);
+        bench_sample(b, start);
+    }
+    bench_archive_close(&dbs, dir);
+}
+
+// the stats line over the whole history
+static void bench_trade_stats(BENCH *b){
+    char dir[] = "/tmp/ctrader-bench-XXXXXX/";
+    TRADE_STATS stats;
+    ARCHIVE_DBS dbs;
     
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size]=0;
-    return realsize;
+    dir[strlen(dir) - 1] = 0;
+    if(bench_archive_open(&dbs, dir, BENCH_TRADES) != 0){
+        perror(dir);
+        return;
+    }
+    for(size_t i = 0; i < b->rounds; i++){
+        uint64_t start = bench_now();
+        trade_stats(&dbs.columns, 0, INT64_MAX, &stats);
+        bench_sample(b, start);
+    }
+    b->items = dbs.columns.rows;
+    bench_archive_close(&dbs, dir);
 }
-/*------------------------------- end SaveRes ---------------------------------*/
 
+// the UI's frame: book_adjust and show_order_book on a snapshot view, drawn to /dev/null
+// on $TERM; a level changes every frame. No samples if the terminal is unknown
+static void bench_render(BENCH *b){
+    FILE *out = fopen("/dev/null", "w"), *in = fopen("/dev/null", "r");
+    const char *term = getenv("TERM");
+    SCREEN *terminal = out && in ? newterm(term && term[0] ? term : "xterm", out, in) : NULL;
+    struct md_state *md = calloc(1, sizeof(struct md_state));
+    struct prices adj_price;
+    ORDER_BOOK book, view;
+    TRADE last_trade;
+    
+    if(terminal){
+        resizeterm(HEADER_ROWS + BOOK_ROWS + LOG_MIN_ROWS, 100);
+        render_init(&screen);
+        bench_book(&book, b->levels);
+        memset(&adj_price, 0, sizeof(adj_price));
+        memset(&last_trade, 0, sizeof(last_trade));
+        for(size_t i = 0; i < b->rounds; i++){
+            book_set(&book.bids, book_price(&book.bids, (int)(i % BOOK_ROWS)), to_amount(.01 * (double)(i % 9 + 1)));
+            md_state_fill(md, &book);
+            uint64_t start = bench_now();
+            md_state_book(md, &view);
+            book_adjust(&view, "buy", book_price(&view.bids, 5), &adj_price, 0, 5);
+            show_order_book(&view, "buy", to_amount(.01), book_price(&view.bids, 5), &adj_price, 5, price_units(29500), price_units(30500), price_units(30000), last_trade);
+            bench_sample(b, start);
+        }
+        book_free(&book);
+        delwin(screen.header.win);
+        delwin(screen.book.win);
+        delwin(screen.log);
+        free(screen.header.cells);
+        free(screen.book.cells);
+        memset(&screen, 0, sizeof(RENDERER));
+        endwin();
+        delscreen(terminal);
+    }
+    free(md);
+    if(out)
+        fclose(out);
+    if(in)
+        fclose(in);
+}
 
-/*------------------------------- Getjson  ------------------------------------*/
+static void bench_tape_add(void *ctx, uint64_t ns, int source, const char *body, size_t len){
+    struct bench_tape *tape = (struct bench_tape *)ctx;
+    struct bench_message *m;
+    
+    if(tape->count == tape->capacity){
+        tape->capacity = tape->capacity ? tape->capacity * 2 : 4096;
+        tape->messages = realloc(tape->messages, sizeof(struct bench_message) * tape->capacity);
+    }
+    m = &tape->messages[tape->count++];
+    m->source = source;
+    m->len = len;
+    m->body = malloc(len + 1);
+    memcpy(m->body, body, len);
+    m->body[len] = 0;
+}
 
-void Getjson(struct RespData *chunk, const char *url, char *post_params){
+// a websocket session: the snapshot, then md_updates with a tick and a REST ticker now and then
+static void bench_tape_synthetic(struct bench_tape *tape, int levels){
+    struct RespData body = { NULL, 0, NULL };
     
-    CURL *curl_handle;
-    CURLcode res;
-    struct curl_slist *list = NULL;
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl_handle = curl_easy_init();
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, SaveRes);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)chunk);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-    //curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
+    bench_ws_snapshot(&body, levels);
+    bench_tape_add(tape, 0, RECORD_WS, body.memory, body.size);
+    for(long n = 1, updates = 0; n < 1000; n++){
+        body.size = 0;
+        if(n % 50 == 0){
+            bench_append(&body, "{\"timestamp\":\"1700000000\",\"low\":\"29500\",\"high\":\"30500\",\"last\":\"30000\",\"volume\":\"1000\",\"bid\":29999.99,\"ask\":30000.01}");
+            bench_tape_add(tape, 0, SRC_TICKER, body.memory, body.size);
+        }else if(n % 10 == 0){
+            bench_append(&body, "{\"e\":\"tick\",\"data\":{\"symbol1\":\"%s\",\"symbol2\":\"%s\",\"price\":\"%.2f\",\"open24\":\"29900\",\"volume\":\"1000\"}}", market->symbol1, market->symbol2, 30000 + .01 * (double)(n % 100));
+            bench_tape_add(tape, 0, RECORD_WS, body.memory, body.size);
+        }else{
+            bench_ws_update(&body, ++updates);
+            bench_tape_add(tape, 0, RECORD_WS, body.memory, body.size);
+        }
+    }
+    free(body.memory);
+}
+
+// A tick of the md thread and the order thread's look at it, I/O left out: a message
+// decoded, the book published through the seqlock and read back, book_adjust and the
+// lock repricing of a resting buy. Replays b->record_file, or a made up session.
+static void bench_tick(BENCH *b){
+    struct bench_tape tape;
+    struct md_state *state = calloc(1, sizeof(struct md_state)), *md = calloc(1, sizeof(struct md_state));
+    MD_SNAPSHOT *published = calloc(1, sizeof(MD_SNAPSHOT));
+    LOCK_PARAMS lock = LOCK_PARAMS_DEFAULT;
+    struct lock_state ls = { lock.lock_index, 0 };
+    struct prices adj_price;
+    struct order order;
+    struct ticker ticker;
+    struct last_price last;
+    json_error_t error;
+    ORDER_BOOK book, view;
+    MD_FEED feed;
     
-    /*
-     curl_easy_setopt(curl_handle, CURLOPT_PROXY, "127.0.0.1:8888");
-     curl_easy_setopt(curl_handle, CURLOPT_PROXYAUTH, CURLAUTH_ANY);
-     curl_easy_setopt(curl_handle, CURLOPT_PROXYUSERPWD, "");*/
+    memset(&tape, 0, sizeof(tape));
+    if(b->record_file && record_replay(b->record_file, (int)(market - markets), bench_tape_add, &tape) != 0)
+        perror(b->record_file);
+    if(tape.count == 0)
+        bench_tape_synthetic(&tape, b->levels);
+    memset(&feed, 0, sizeof(MD_FEED));
+    memset(&adj_price, 0, sizeof(adj_price));
+    memset(&order, 0, sizeof(order));
+    book_init(&feed.book);
+    book_init(&book);
     
-    if(post_params != NULL){
-        list = curl_slist_append(list, "Content-Type: application/json");
-        curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, post_params);
-        curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, list);
+    for(size_t i = 0; i < b->rounds; i++){
+        const struct bench_message *m = &tape.messages[i % tape.count];
+        uint64_t start = bench_now();
+        
+        memset(&ticker, 0, sizeof(ticker));
+        memset(&last, 0, sizeof(last));
+        if(m->source == RECORD_WS){
+            SaveRes(m->body, 1, m->len, &feed.frame);
+            json_t *msg = json_loadb(feed.frame.memory, feed.frame.size, 0, &error);
+            feed.frame.size = 0;
+            if(msg){
+                mdfeed_message(&feed, msg);
+                json_decref(msg);
+            }
+        }else{
+            bench_decode(m->source, m->body, m->len, &book, &ticker, &last);
+        }
+        if(ticker.received){
+            state->low = ticker.low;
+            state->high = ticker.high;
+        }
+        if(feed.subscribed && feed.lastprice)
+            state->lastprice = feed.lastprice;
+        if(last.received)
+            state->lastprice = last.price;
+        md_state_fill(state, feed.subscribed ? &feed.book : &book);
+        state->version++;
+        snapshot_publish(&published->seq, &published->state, state, sizeof(struct md_state));
+        
+        snapshot_read(&published->seq, md, &published->state, sizeof(struct md_state));
+        md_state_book(md, &view);
+        book_adjust(&view, order.type[0] ? order.type : NULL, order.price, &adj_price, 0, ls.lock_index);
+        if(order.type[0]){
+            lock_reprice(&ls, &lock, &adj_price, &order);
+        }else if(adj_price.highest_bid){
+            strcpy(order.type, "buy");
+            order.price = adj_price.highest_bid;
+            order.amount = to_amount(.01);
+        }
+        arena_reset(&tick_arena);
+        bench_sample(b, start);
     }
     
-    
-    res = curl_easy_perform(curl_handle);
-    curl_easy_cleanup(curl_handle);
-    //printw(chunk->memory, "\n");
-    //return(chunk.memory);
+    for(size_t i = 0; i < tape.count; i++)
+        free(tape.messages[i].body);
+    free(tape.messages);
+    free(feed.frame.memory);
+    book_free(&feed.book);
+    book_free(&book);
+    free(published);
+    free(state);
+    free(md);
 }
-/*------------------------------- end Getjson ---------------------------------*/
 
+static const struct {
+    const char *name;
+    void (*run)(BENCH *b);
+    size_t rounds;
+} benchmarks[] = {
+    { "book_decode", bench_book_decode, 2000 },
+    { "ws_decode", bench_ws_decode, 100000 },
+    { "lock_index", bench_lock_index, 100000 },
+    { "sign", bench_sign, 100000 },
+    { "archive_insert", bench_archive_insert, 200 },
+    { "history_scan", bench_history_scan, 20000 },
+    { "trade_stats", bench_trade_stats, 2000 },
+    { "render", bench_render, 10000 },
+    { "tick", bench_tick, 100000 },
+};
+#define BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
 
+// spec: "all" or benchmark names, each "name" or "name=calls", and "levels=n" for the
+// synthetic books. The first market's parsers and signer are used
+int bench(const char *spec, const char *record_file){
+    size_t rounds[BENCHMARKS] = { 0 };
+    char list[256], *item, *save = NULL;
+    int levels = BENCH_LEVELS;
+    
+    shard_enter(&shards[0]);
+    snprintf(list, sizeof(list), "%s", spec);
+    for(item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)){
+        char *value = strchr(item, '=');
+        int k = 0;
+        if(value)
+            *value++ = 0;
+        if(strcmp(item, "levels") == 0 && value && atoi(value) > 0){
+            levels = atoi(value);
+            continue;
+        }
+        if(strcmp(item, "all") == 0){
+            for(k = 0; k < BENCHMARKS; k++)
+                rounds[k] = benchmarks[k].rounds;
+            continue;
+        }
+        while(k < BENCHMARKS && strcmp(benchmarks[k].name, item) != 0)
+            k++;
+        if(k == BENCHMARKS || (value && atol(value) <= 0)){
+            fprintf(stderr, "%s: unknown benchmark\n", item);
+            return -1;
+        }
+        rounds[k] = value ? (size_t)atol(value) : benchmarks[k].rounds;
+    }
+    
+    arena_init(&tick_arena, TICK_ARENA_SIZE);
+    for(int k = 0; k < BENCHMARKS; k++){
+        BENCH b;
+        if(rounds[k] == 0)
+            continue;
+        memset(&b, 0, sizeof(BENCH));
+        b.warmup = rounds[k] / 10;
+        b.rounds = rounds[k] + b.warmup;
+        b.ns = malloc(sizeof(uint64_t) * b.rounds);
+        b.items = 1;
+        b.levels = levels;
+        b.record_file = record_file;
+        benchmarks[k].run(&b);
+        bench_report(benchmarks[k].name, &b);
+        fflush(stdout);
+        free(b.ns);
+    }
+    free(tick_arena.base);
+    return 0;
+}
+/*--------------------------- end benchmarks ---------------------------------*/
 
 
-/*------------------------------- Misc ---------------------------------*/
+/*--------------------------- control socket ---------------------------------*/
+// Headless mode (-d path): the market data and order threads run as usual and this loop
+// takes the place of the console, so no terminal is needed. One command per line; the
+// answer is zero or more data lines and a last line starting with OK or ERR.
+//
+//     PLACE buy|sell <amount> <price>    REPLACE <amount> <price>    CANCEL
+//     LOCK <index>    BOOK [levels]    POSITION    PING    MARKET [SYMBOL1/SYMBOL2]
+//     TRADES [count] [buy|sell] [profit|loss] [from=<time>] [to=<time>]
+//     STATS [from=<time>] [to=<time>]    LATENCY [reset]
+//
+// Commands work on the market the connection selected with MARKET, the first one until
+// then. Order commands go to the order thread's queue, OK means queued, not filled.
+// Notices the console would print are written to stdout instead.
 
-char *reverse(char s[])
-{
-    long c, i, j;
-    for (i = 0, j = strlen(s)-1; i < j; i++, j--) {
-        c = s[i];
-        s[i] = s[j];
-        s[j] = c; }
-    return(s);
-}
-char *itoa(long n, char s[])
-{
-    int i;
-    i = 0;
-    do {
-        s[i++]=n%10+'0';
-    } while ((n /= 10) > 0);
-    s[i] = '\0';
-    
-    return(reverse(s));
+static volatile sig_atomic_t control_stop = 0;
+
+static void control_signal(int sig){
+    control_stop = 1;
 }
 
-int kbhit(void)
-{
-    int ch = getch();
+int control_listen(const char *path){
+    struct sockaddr_un addr;
+    int fd;
     
-    if (ch != ERR) {
-        ungetch(ch);
-        return 1;
-    } else {
-        return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    unlink(path);   /* left behind by an instance that did not shut down cleanly */
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, MAX_CONTROL_CLIENTS) < 0){
+        close(fd);
+        return -1;
     }
+    return fd;
 }
-/*------------------------------- end Misc ---------------------------------*/
 
+// whole lines only, the last CONTROL_STATUS_MAX bytes stay free for the ERR truncated
+static void reply_add(struct control_reply *reply, const char *format, ...){
+    size_t room = sizeof(reply->text) - CONTROL_STATUS_MAX - reply->len;
+    va_list args;
+    int n;
+    if(reply->truncated)
+        return;
+    va_start(args, format);
+    n = vsnprintf(reply->text + reply->len, room, format, args);
+    va_end(args);
+    if(n < 0 || (size_t)n >= room)
+        reply->truncated = 1;
+    else
+        reply->len += (size_t)n;
+}
 
-/*--------------------------- get_trades ---------------------------------*/
+// the answer to one command, so a long one can not push out the status of the next
+static void reply_send(int fd, struct control_reply *reply){
+    if(reply->truncated)
+        reply->len += snprintf(reply->text + reply->len, sizeof(reply->text) - reply->len, "ERR truncated\n");
+    if(reply->len)
+        send(fd, reply->text, reply->len, MSG_NOSIGNAL);
+    reply->len = 0;
+    reply->truncated = 0;
+}
 
-////////////////////////////////////////// RETRIEVE LAST ARCHIVED TRADE DATE FROM DATABASE ///////////////////////////////////////////
-////////////////////////////////////////// DOWNLOAD ALL TRADES SINCE LAST TRADE DATE ////////////////////////////////////////////////
+// a price or amount argument, 0 unless it is a number through to its end and above 0
+static fixed_t control_value(const char *arg, int decimals){
+    char *end;
+    double value = strtod(arg, &end);
+    fixed_t fixed;
+    if(end == arg || *end || !(value > 0))
+        return 0;
+    fixed = fixed_parse(arg, strlen(arg), decimals);
+    return fixed > 0 ? fixed : 0;
+}
 
-TRADE get_trades(ARCHIVE_DBS *archivedbs, char *nonce, char *request_params, char *timestamp, struct authdata* a, const char *mode, const char *trade_status, int last){
+void control_command(struct control_reply *reply, char *line, SHARD **selected){
     
-    TRADE trade;
+    static struct md_state md;      /* only the control loop calls this */
+    struct order_state orders;
+    ORDER_BOOK book;
+    char *argv[6], *save;
+    int argc = 0;
     
-    json_error_t error;
-    int ret;
+    for(char *tok = strtok_r(line, " \t\r", &save); tok && argc < 6; tok = strtok_r(NULL, " \t\r", &save))
+        argv[argc++] = tok;
+    if(argc == 0){
+        reply_add(reply, "ERR empty command\n");
+        return;
+    }
+    for(char *c = argv[0]; *c; c++)
+        *c = toupper(*c);
+    shard_enter(*selected);
     
-    if (strcmp(mode, "update") == 0){
-        DBC *cursorp;
-        DBT key, data;
-        archivedbs->trades_dbp->cursor(archivedbs->trades_dbp, NULL, &cursorp, 0);
-        memset(&key, 0, sizeof(DBT));
-        memset(&data, 0, sizeof(DBT));
-        memset(&trade, 0, sizeof(TRADE));
-        key.data = &trade.order_id;
-        key.size = sizeof(trade.order_id);
-        data.data = &trade;
-        data.ulen = sizeof(TRADE);
-        data.flags = DB_DBT_USERMEM;
-        ret = cursorp->get(cursorp, &key, &data, DB_PREV);
-        char last_orderid[12];
-        strcpy(last_orderid,trade.order_id);
-        
-        if (cursorp != NULL)
-            cursorp->close(cursorp);
-        
-        
-        
-        // RETRIEVE ALL TRADE ARCHIVES
-        
-        //------------------------------------------------------------------------------------------------------------------
-        struct RespData *traderesp = (void*)malloc(sizeof(struct RespData));
-        char *archived_orders_json = malloc(strlen("{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"dateFrom\":\"%s\",\"lastTxDateFrom\":\"%s\",\"status\":\"%s\"}")+1);
-        strcpy(archived_orders_json, "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"dateFrom\":\"%s\",\"lastTxDateFrom\":\"%s\",\"status\":\"%s\"}");
-        char *archived_orders_url = malloc(strlen("https://cex.io/api/archived_orders/BTC/USD/")+1);
-        strcpy(archived_orders_url,"https://cex.io/api/archived_orders/BTC/USD/");
-        
-        memset(nonce, 0, strlen(nonce));
-        memset(request_params, 0, strlen(request_params));
-        strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-        a =  (void *)malloc(sizeof(struct authdata));
-        create_authdata(a, nonce);
-        sprintf(request_params, archived_orders_json, a->apikey, a->signature, nonce, trade.time, trade.time, trade_status);
-        free(a);
-        traderesp->memory = (void*)malloc(1);
-        traderesp->size = 0;
-        Getjson(traderesp, archived_orders_url, request_params);
-        archived_orders_root = json_loads(traderesp->memory, 0, &error);
-        //------------------------------------------------------------------------------------------------------------------
-        
-        // PREPARE DATABASE FOR WRITING
-        
-        memset(&key, 0, sizeof(DBT));
-        memset(&data, 0, sizeof(DBT));
-        
-        key.data = &(trade.order_id);
-        key.size = sizeof(long);
-        data.data = &trade;
-        data.size = sizeof(TRADE);
-        
-        int updated = 0;
-        json_t *toporder;
-        toporder = json_array_get(archived_orders_root, 0);
-        if(strcmp(last_orderid,json_string_value(json_object_get(toporder, "orderId"))) == 0)
-            updated = 1;
-        
-        for(long i = json_array_size(archived_orders_root) - 1; i >= 0; i--){
-            //for(long i = 0; i < json_array_size(archived_orders_root); i++){
-            
-            json_t *order;
-            order = json_array_get(archived_orders_root, i);
-            double oldcost = trade.cost;
-            double oldamount = trade.amount;
-            
-            if(updated) // STOP IF LAST ORDER IN DB == LAST TRADE
-                break;
-            
-            memset(&trade, 0, sizeof(TRADE));
-            strcpy(trade.order_id,json_string_value(json_object_get(order, "orderId")));
-            strcpy(trade.time, json_string_value(json_object_get(order, "lastTxTime")));
-            strcpy(trade.type, json_string_value(json_object_get(order, "type")));
-            trade.amount = atof(json_string_value(json_object_get(order, "amount")));
-            if(json_string_value(json_object_get(order, "price"))){
-                trade.price = atof(json_string_value(json_object_get(order, "price")));
+    if(strcmp(argv[0], "PING") == 0){
+        reply_add(reply, "OK pong\n");
+    }else if(strcmp(argv[0], "MARKET") == 0){
+        SHARD *found = argc == 1 ? *selected : NULL;
+        for(int i = 0; i < nshards && argc == 2; i++){
+            char pair[20];
+            snprintf(pair, sizeof(pair), "%s/%s", shards[i].market->symbol1, shards[i].market->symbol2);
+            if(strcasecmp(pair, argv[1]) == 0)
+                found = &shards[i];
+        }
+        if(found == NULL){
+            reply_add(reply, "ERR no such market\n");
+            return;
+        }
+        *selected = found;
+        for(int i = 0; i < nshards; i++)
+            reply_add(reply, "MARKET %s %s/%s%s\n", shards[i].market->exchange->name, shards[i].market->symbol1, shards[i].market->symbol2, &shards[i] == found ? " *" : "");
+        reply_add(reply, "OK\n");
+    }else if((strcmp(argv[0], "PLACE") == 0 && argc == 4 && (strcmp(argv[1], "buy") == 0 || strcmp(argv[1], "sell") == 0)) ||
+             (strcmp(argv[0], "REPLACE") == 0 && argc == 3)){
+        int place = argv[0][0] == 'P';
+        fixed_t amount = control_value(argv[argc-2], market->amount_decimals);
+        fixed_t price = control_value(argv[argc-1], market->price_decimals);
+        if(amount == 0)
+            reply_add(reply, "ERR bad amount\n");
+        else if(price == 0)
+            reply_add(reply, "ERR bad price\n");
+        else if(order_post(place ? CMD_PLACE : CMD_REPLACE, place ? argv[1] : NULL, price, amount, 0))
+            reply_add(reply, "OK queued\n");
+        else
+            reply_add(reply, "ERR busy\n");
+    }else if(strcmp(argv[0], "CANCEL") == 0){
+        if(order_post(CMD_CANCEL, NULL, 0, 0, 0))
+            reply_add(reply, "OK queued\n");
+        else
+            reply_add(reply, "ERR busy\n");
+    }else if(strcmp(argv[0], "LOCK") == 0 && argc == 2){
+        char *end;
+        long index = strtol(argv[1], &end, 10);
+        if(end == argv[1] || *end || index < 0 || index > SNAPSHOT_LEVELS)
+            reply_add(reply, "ERR bad lock index\n");
+        else if(order_post(CMD_SET_LOCK, NULL, 0, 0, (int)index))
+            reply_add(reply, "OK queued\n");
+        else
+            reply_add(reply, "ERR busy\n");
+    }else if(strcmp(argv[0], "BOOK") == 0){
+        int levels = argc > 1 ? atoi(argv[1]) : 10;
+        if(levels < 1 || levels > SNAPSHOT_LEVELS)
+            levels = SNAPSHOT_LEVELS;
+        snapshot_read(&shard->md.seq, &md, &shard->md.state, sizeof(md));
+        md_state_book(&md, &book);
+        reply_add(reply, "LAST %s LOW %s HIGH %s\n", price_str(md.lastprice), price_str(md.low), price_str(md.high));
+        for(int i = 0; i < levels && i < (int)book.bids.count; i++)
+            reply_add(reply, "BID %s %s\n", price_str(book_price(&book.bids, i)), amount_str(book_amount(&book.bids, i)));
+        for(int i = 0; i < levels && i < (int)book.asks.count; i++)
+            reply_add(reply, "ASK %s %s\n", price_str(book_price(&book.asks, i)), amount_str(book_amount(&book.asks, i)));
+        reply_add(reply, "OK %lu\n", md.version);
+    }else if(strcmp(argv[0], "LEVELS") == 0 && argc > 1){
+        // the whole-unit prices a lock at each of the given indexes would sit behind
+        int index[5];
+        fixed_t bids[5], asks[5];
+        for(int i = 1; i < argc; i++)
+            index[i-1] = atoi(argv[i]);
+        snapshot_read(&shard->md.seq, &md, &shard->md.state, sizeof(md));
+        md_state_book(&md, &book);
+        book_distinct_prices(&book.bids, index, bids, argc - 1);
+        book_distinct_prices(&book.asks, index, asks, argc - 1);
+        for(int i = 0; i < argc - 1; i++)
+            reply_add(reply, "LEVEL %d BID %s ASK %s\n", index[i], price_str(bids[i]), price_str(asks[i]));
+        reply_add(reply, "OK %lu\n", md.version);
+    }else if(strcmp(argv[0], "TRADES") == 0){
+        // newest first, answered from the trade indexes
+        TRADE_QUERY q = { NULL, 0, NULL, NULL, 1 };
+        TRADE trades[100];
+        size_t limit = 20, count;
+        for(int i = 1; i < argc; i++){
+            if(strcmp(argv[i], "buy") == 0 || strcmp(argv[i], "sell") == 0)
+                q.type = argv[i];
+            else if(strcmp(argv[i], "profit") == 0 || strcmp(argv[i], "loss") == 0)
+                q.profit = argv[i][0] == 'p' ? 'y' : 'n';
+            else if(strncmp(argv[i], "from=", 5) == 0)
+                q.from = argv[i] + 5;
+            else if(strncmp(argv[i], "to=", 3) == 0)
+                q.to = argv[i] + 3;
+            else if(atoi(argv[i]) > 0)
+                limit = (size_t)atoi(argv[i]) < 100 ? (size_t)atoi(argv[i]) : 100;
+        }
+        pthread_mutex_lock(&archive_lock);
+        count = trades_query(&shard->archive, &q, trades, limit);
+        pthread_mutex_unlock(&archive_lock);
+        for(size_t i = 0; i < count; i++)
+            reply_add(reply, "TRADE %s %s %s %s %s %s %s\n", trades[i].time, trades[i].type, price_str(trades[i].price), amount_str(trades[i].amount), price_str(trades[i].fee), price_str(trades[i].cost), strcmp(trades[i].profit, "y") == 0 ? "profit" : "loss");
+        reply_add(reply, "OK %zu\n", count);
+    }else if(strcmp(argv[0], "STATS") == 0){
+        // over the trade columns, the window is [from, to) in lastTxTime
+        int64_t from_ms = INT64_MIN, to_ms = INT64_MAX;
+        TRADE_STATS stats;
+        for(int i = 1; i < argc; i++){
+            if(strncmp(argv[i], "from=", 5) == 0)
+                from_ms = trade_time_ms(argv[i] + 5);
+            else if(strncmp(argv[i], "to=", 3) == 0)
+                to_ms = trade_time_ms(argv[i] + 3);
+        }
+        pthread_mutex_lock(&archive_lock);
+        trade_stats(&shard->archive.columns, from_ms, to_ms, &stats);
+        pthread_mutex_unlock(&archive_lock);
+        reply_add(reply, "STATS trades %zu buys %zu wins %zu win_rate %.4f\n", stats.count, stats.buys, stats.wins, stats.win_rate);
+        reply_add(reply, "BOUGHT %s %s\n", amount_str(stats.bought), price_str(stats.spent));
+        reply_add(reply, "SOLD %s %s\n", amount_str(stats.sold), price_str(stats.received));
+        reply_add(reply, "FEES %s\n", price_str(stats.fees));
+        reply_add(reply, "AVG_ENTRY %s\n", price_str(stats.avg_entry));
+        reply_add(reply, "PNL %s\n", price_str(stats.pnl));
+        reply_add(reply, "OK %zu\n", stats.count);
+    }else if(strcmp(argv[0], "LATENCY") == 0){
+        char text[256];
+        int stages = 0;
+        for(int s = 0; s < STAGES; s++){
+            if(latency_line(s, text, sizeof(text))){
+                reply_add(reply, "%s\n", text);
+                stages++;
             }
-            if(json_string_value(json_object_get(order, "tfa:USD"))){
-                trade.fee = json_real_value(json_object_get(order, "tfa:USD"));
-            }else{
-                trade.fee = atof(json_string_value(json_object_get(order, "fa:USD")));
+        }
+        if(argc == 2 && strcasecmp(argv[1], "reset") == 0)
+            latency_reset();
+        reply_add(reply, "OK %d\n", stages);
+    }else if(strcmp(argv[0], "POSITION") == 0){
+        snapshot_read(&shard->orders.seq, &orders, &shard->orders.state, sizeof(orders));
+        if(orders.open.type[0])
+            reply_add(reply, "ORDER %s %s %s %s\n", orders.open.type, orders.open.order_id, price_str(orders.open.price), amount_str(orders.open.amount));
+        else
+            reply_add(reply, "ORDER none\n");
+        reply_add(reply, "BALANCE %s %s %s %s\n", market->symbol1, amount_str(orders.btc_available), market->symbol2, price_str(orders.usd_available));
+        reply_add(reply, "LOCK %d\n", orders.lock_index);
+        reply_add(reply, "OK %lu\n", orders.version);
+    }else{
+        reply_add(reply, "ERR unknown command or arguments\n");
+    }
+}
+
+// runs until SIGTERM/SIGINT, -1 if the socket can not be set up
+int control_serve(const char *path){
+    
+    CONTROL_CLIENT clients[MAX_CONTROL_CLIENTS];
+    struct pollfd fds[MAX_CONTROL_CLIENTS + 1];
+    int owner[MAX_CONTROL_CLIENTS + 1];         /* client slot of each polled fd */
+    struct control_reply reply;
+    struct notice notice;
+    int listen_fd = control_listen(path);
+    
+    if(listen_fd < 0){
+        perror(path);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, control_signal);
+    signal(SIGINT, control_signal);
+    reply.len = 0;
+    reply.truncated = 0;
+    for(int i = 0; i < MAX_CONTROL_CLIENTS; i++)
+        clients[i].fd = -1;
+    printf("ctrader: listening on %s\n", path);
+    fflush(stdout);
+    
+    while(!control_stop){
+        int nfds = 1;
+        fds[0] = (struct pollfd){ listen_fd, POLLIN, 0 };
+        for(int i = 0; i < MAX_CONTROL_CLIENTS; i++){
+            if(clients[i].fd < 0)
+                continue;
+            fds[nfds] = (struct pollfd){ clients[i].fd, POLLIN, 0 };
+            owner[nfds++] = i;
+        }
+        poll(fds, nfds, UI_FRAME_MS);
+        latency_dump();
+        trace_drain();
+        
+        for(int i = 0; i < nshards; i++){
+            while(notice_pop(&shards[i], &notice)){
+                size_t len = strlen(notice.text);
+                printf("%s/%s: %s", shards[i].market->symbol1, shards[i].market->symbol2, notice.text);
+                if(len == 0 || notice.text[len-1] != '\n')
+                    fputc('\n', stdout);
             }
-            if(json_string_value(json_object_get(order, "tta:USD"))){
-                trade.cost = atof(json_string_value(json_object_get(order, "tta:USD")));
-            }else{
-                trade.cost = atof(json_string_value(json_object_get(order, "ta:USD")));
+        }
+        fflush(stdout);
+        
+        if(fds[0].revents & POLLIN){
+            int fd = accept(listen_fd, NULL, NULL);
+            int slot = -1;
+            for(int i = 0; fd >= 0 && i < MAX_CONTROL_CLIENTS && slot < 0; i++){
+                if(clients[i].fd < 0)
+                    slot = i;
             }
-            //if ((trade.cost < oldcost && strcmp(trade.type, "buy")==0) || (trade.cost > oldcost && strcmp(trade.type, "sell")==0)){
-            if ((trade.cost > oldcost && strcmp(trade.type, "sell")==0)||(trade.amount > oldamount && strcmp(trade.type, "buy")==0)){
-                strcpy(trade.profit, "y");
-            }else{
-                strcpy(trade.profit, "n");
+            if(slot >= 0){
+                clients[slot].fd = fd;
+                clients[slot].len = 0;
+                clients[slot].shard = &shards[0];
+            }else if(fd >= 0){
+                close(fd);
             }
-            archivedbs->trades_dbp->put(archivedbs->trades_dbp, NULL, &key, &data, DB_NOOVERWRITE);
-            
         }
         
-        json_decref(archived_orders_root);
-        free(traderesp->memory);
-        free(traderesp);
-        
-        if(archived_orders_json != NULL)
-            free(archived_orders_json);
-        if(archived_orders_url != NULL)
-            free(archived_orders_url);
-    }else{
-        DBC *cursorp;
-        DBT key, data;
-        int max = 0;
-        archivedbs->trades_dbp->cursor(archivedbs->trades_dbp, NULL, &cursorp, 0);
-        memset(&key, 0, sizeof(DBT));
-        memset(&data, 0, sizeof(DBT));
-        memset(&trade, 0, sizeof(TRADE));
-        
-        key.data = &trade.order_id;
-        key.size = sizeof(trade.order_id);
-        data.data = &trade;
-        data.ulen = sizeof(TRADE);
-        data.flags = DB_DBT_USERMEM;
-        if(!last)
-            printw("\n\n\n\n\n\n\n\n\n\n\tDate\t\tFee\tAmount\t    Price\tCost\t  Type\n");
-        while ((ret = cursorp->get(cursorp, &key, &data, DB_PREV)) == 0){
-            
-            max++;
-            if(max == 1 && last==1){
-                if (cursorp != NULL)
-                    cursorp->close(cursorp);
-                return(trade);
+        for(int f = 1; f < nfds; f++){
+            CONTROL_CLIENT *client = &clients[owner[f]];
+            ssize_t n;
+            if(!fds[f].revents)
+                continue;
+            n = recv(client->fd, client->line + client->len, sizeof(client->line) - 1 - client->len, 0);
+            if(n <= 0){
+                close(client->fd);
+                client->fd = -1;
+                continue;
             }
+            client->len += n;
+            client->line[client->len] = 0;
             
-            if(max == 40){
-                max = 0;
-                break;
+            // answer every complete line, a write per answer
+            char *start = client->line, *end;
+            while((end = strchr(start, '\n'))){
+                *end = 0;
+                control_command(&reply, start, &client->shard);
+                reply_send(client->fd, &reply);
+                start = end + 1;
             }
-            
-            struct tm tm = {0};
-            //2018-04-14T12:32:44.047Z
-            strptime(trade.time, "%Y-%m-%dT%H:%M:%S", &tm);
-            char wordtime[21];
-            strftime (wordtime,80,"%b %d, %Y %I:%M%p",&tm);
-            if (strcmp(trade.profit, "y") == 0){
-                attron(COLOR_PAIR(2));
-            }else{
-                attron(COLOR_PAIR(3));
+            client->len -= start - client->line;
+            memmove(client->line, start, client->len);
+            if(client->len == sizeof(client->line) - 1){
+                reply_add(&reply, "ERR line too long\n");
+                reply_send(client->fd, &reply);
+                client->len = 0;
             }
-            printw("%s\t%.2f\t%f    %4.2f\t%4.2f\t  %-4s\n", wordtime, trade.fee, trade.amount, trade.price, trade.cost, trade.type, trade.profit);
-            
-            
-            refresh();
-            memset(&key, 0, sizeof(DBT));
-            memset(&data, 0, sizeof(DBT));
-            memset(&trade, 0, sizeof(TRADE));
-            key.data = &trade.order_id;
-            key.size = sizeof(trade.order_id);
-            data.data = &trade;
-            data.ulen = sizeof(TRADE);
-            data.flags = DB_DBT_USERMEM;
         }
-        
-        if (cursorp != NULL)
-            cursorp->close(cursorp);
     }
     
+    for(int i = 0; i < MAX_CONTROL_CLIENTS; i++){
+        if(clients[i].fd >= 0)
+            close(clients[i].fd);
+    }
+    close(listen_fd);
+    unlink(path);
+    return 0;
+}
+/*--------------------------- end control socket ---------------------------------*/
+
+
+/*--------------------------- renderer ---------------------------------*/
+// The order book view used to be printw'd top to bottom every tick into a scrolling
+// stdscr. Now it lives in fixed windows: each row is composed into a line of cells and
+// only the runs of cells that differ from the last frame are written, so a tick where
+// three levels changed sends three short updates instead of a full screen.
+
+static RENDER_PANE render_pane(int top, int rows){
+    RENDER_PANE pane;
+    pane.rows = rows;
+    pane.cols = COLS;
+    pane.win = newwin(rows, COLS, top, 0);
+    pane.cells = calloc((size_t)rows * COLS, sizeof(chtype));
+    pane.dirty = 0;
+    return pane;
+}
+
+// header on top, BOOK_ROWS of book under it, whatever is left is the log
+void render_init(RENDERER *screen){
+    int book_rows = LINES - HEADER_ROWS - LOG_MIN_ROWS;
+    if(book_rows > BOOK_ROWS)
+        book_rows = BOOK_ROWS;
+    if(book_rows < 1)
+        book_rows = 1;
     
+    screen->header = render_pane(0, HEADER_ROWS);
+    screen->book = render_pane(HEADER_ROWS, book_rows);
+    screen->log = newwin(LINES - HEADER_ROWS - book_rows > 1 ? LINES - HEADER_ROWS - book_rows : 1, COLS, HEADER_ROWS + book_rows, 0);
+    scrollok(screen->log, TRUE);
+    keypad(screen->log, FALSE);     /* arrows arrive as esc [ A, as the key handling expects */
+    nodelay(screen->log, TRUE);
+}
+
+// forget what is on screen, the next frame draws every cell (after something drew over it)
+void render_invalidate(RENDERER *screen){
+    memset(screen->header.cells, 0, sizeof(chtype) * screen->header.rows * screen->header.cols);
+    memset(screen->book.cells, 0, sizeof(chtype) * screen->book.rows * screen->book.cols);
+    clearok(curscr, TRUE);
+    touchwin(screen->log);
+    wnoutrefresh(screen->log);
+}
+
+// format into line from col on, tabs to the next multiple of 8, the rest of the line is
+// blanked; returns the column after the text
+int render_text(chtype *line, int cols, int col, attr_t attr, const char *format, ...){
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
     
+    for(const char *c = text; *c && col < cols; c++){
+        if(*c == '\t'){
+            do{
+                line[col++] = ' ';
+            }while(col < cols && col % 8);
+        }else{
+            line[col++] = (unsigned char)*c | attr;
+        }
+    }
+    for(int i = col; i < cols; i++)
+        line[i] = ' ';
+    return col;
+}
+
+void render_line(RENDER_PANE *pane, int row, const chtype *line){
+    chtype *cells = pane->cells + (size_t)row * pane->cols;
+    int col = 0;
     
-    return(trade);
-    
+    if(row < 0 || row >= pane->rows)
+        return;
+    while(col < pane->cols){
+        int start, end;
+        if(cells[col] == line[col]){
+            col++;
+            continue;
+        }
+        // a run of changed cells, short unchanged gaps are sent along rather than moved over
+        start = col;
+        end = col + 1;
+        for(col = end; col < pane->cols && col - end < 4; col++){
+            if(cells[col] != line[col])
+                end = col + 1;
+        }
+        mvwaddchnstr(pane->win, row, start, line + start, end - start);
+        memcpy(cells + start, line + start, sizeof(chtype) * (end - start));
+        pane->dirty = 1;
+        col = end;
+    }
 }
-/*--------------------------- end get_trades ---------------------------------*/
+
+// one doupdate for everything that changed
+void render_flush(RENDERER *screen){
+    RENDER_PANE *panes[2] = { &screen->header, &screen->book };
+    for(int i = 0; i < 2; i++){
+        if(panes[i]->dirty)
+            wnoutrefresh(panes[i]->win);
+        panes[i]->dirty = 0;
+    }
+    wnoutrefresh(screen->log);  /* keeps the cursor at the prompt */
+    doupdate();
+}
+/*--------------------------- end renderer ---------------------------------*/
 
 
 /*--------------------------- show_order_book ---------------------------------*/
 
-void show_order_book(json_t *orders, const char *mytype, double myamount, double myprice, struct prices *adj_price, int price_index, int lock_index, double low, double high, double lastprice, TRADE last_trade){
-    json_t *bids, *asks, *ask_pair, *bid_pair, *lock_bid_pair, *lock_ask_pair;
-    double ask_price, bid_price, ask_btc, bid_btc, bid_btc_total, ask_btc_total;
-    int lock_bid_price, lock_ask_price;
-    int maxorder = 10;
-    
-    
-    
+// Prices around my order that the keys and the repricing move it to. Used by the UI on
+// its snapshot copy of the book and by the order thread on its own, adj_price keeps what
+// an earlier book had for an order that is not in the top rows now.
+void book_adjust(ORDER_BOOK *book, const char *mytype, fixed_t myprice, struct prices *adj_price, int price_index, int lock_index){
+    struct book_side *bids = &book->bids, *asks = &book->asks;
     
+    // STORE HIGHEST BID AND LOWEST ASK PRICE
+    adj_price->highest_bid = book_price(bids, 0);
+    adj_price->lowest_ask = book_price(asks, 0);
     
-    printw("\n\n\t    LIVE ORDER BOOK\n\t       --CEX.io--\n\n");
+    // STORE BID AND ASK PRICE AT POS lock_index
+    // (lock_index-th distinct whole-dollar level, the same level can hold many orders)
+    if (lock_index){
+        if(mytype && (strcmp(mytype, "buy") == 0)){ //adj_price->lock_bid_ask contains bid/ask at position lock_index/
+            adj_price->lock_bid_ask = book_distinct_price(bids, lock_index);
+        }else{
+            adj_price->lock_bid_ask = book_distinct_price(asks, lock_index);
+        }
+    }
     
-    if(mytype && strcmp(mytype, "sell") == 0){
-        printw("   last: %c - %f @ %.2f = %.2f\n", toupper(last_trade.type[0]), last_trade.amount, last_trade.price, last_trade.cost);
+    for(int i = 0; i < 40; i++){
+        fixed_t bid_price = book_price(bids, i);
+        fixed_t ask_price = book_price(asks, i);
         
-        printw("pending: %c - %f @ %.2f = %.2f <-\n\n\n", toupper(mytype[0]), myamount, myprice, (myprice * myamount) - (.0026 * (myprice * myamount)));
-    }else if(mytype && strcmp(mytype, "buy") == 0){
-        printw("   last: %c - %f @ %.2f = %.2f\n", toupper(last_trade.type[0]), last_trade.amount, last_trade.price, last_trade.cost);
+        if((mytype && strcmp(mytype, "buy") == 0 && myprice == bid_price)){
+            if(!price_index){
+                adj_price->higher_bid_ask = price_floor(book_price(bids, i-1));    /* higher bid*/
+                adj_price->lower_bid_ask = price_floor(book_price(bids, i+2));    /* lower bid*/
+            }else{
+                adj_price->index_bid_ask = price_floor(book_price(bids, i+price_index));
+            }
+        }
         
-        printw("pending: %c - %f @ %.2f = %.2f <-\n\n\n", toupper(mytype[0]), myamount, myprice, (myamount * myprice) + (.0026 * (myprice * myamount)));
-    }else{
-        printw("\n");
-    }
-    printw("\t\t  (AUTO)\n");
-    printw("\tL:%4.2f ------- %4.2f:H\n\n", low, high);
-    printw("\t      --> %4.2f <--\n\n", lastprice);
-    //printw("\t\t     |\n");
-    
-    bids = json_object_get(orders, "bids");
-    asks = json_object_get(orders, "asks");
-    
-    bid_btc_total = ask_btc_total = 0;
-    //for(int i = 0; i < json_array_size(asks); i++){
-    for(int i = 0; i < maxorder; i++){
+        if(((mytype && strcmp(mytype, "sell") == 0 && myprice == ask_price))){
+            if(!price_index){
+                adj_price->higher_bid_ask = price_floor(book_price(asks, i+2)); /* higher ask */
+                adj_price->lower_bid_ask = price_floor(book_price(asks, i-1)); /* lower ask */
+            }else{
+                adj_price->index_bid_ask = price_floor(book_price(asks, i+price_index));
+            }
+        }
         
-        bid_pair = json_array_get(bids, i);
-        ask_pair = json_array_get(asks, i);
-        ask_btc_total += json_real_value(json_array_get(ask_pair, 1));
-        bid_btc_total += json_real_value(json_array_get(bid_pair, 1));
+        ////////////////////////////// STORE DEFAULT HIGHER BID/ASK FOR ORDERS OUTSIDE TOP LIST ///////////////////////////////
+        if(adj_price->higher_bid_ask == 0 && i == asks->count){
+            if ((mytype && strcmp(mytype, "buy") == 0)){
+                adj_price->higher_bid_ask = bid_price; //last bid_price value in the previous loop
+            }else{
+                adj_price->higher_bid_ask = ask_price; //last ask_price value in the previous loop
+            }
+        }
     }
+}
+
+void show_order_book(ORDER_BOOK *book, const char *mytype, fixed_t myamount, fixed_t myprice, const struct prices *adj_price, int lock_index, fixed_t low, fixed_t high, fixed_t lastprice, TRADE last_trade){
+    struct book_side *bids = &book->bids, *asks = &book->asks;
+    fixed_t ask_price, bid_price, ask_btc, bid_btc, bid_btc_total, ask_btc_total;
+    fixed_t mycost = cost_of(myprice, myamount);
+    int maxorder = 10;
+    RENDER_PANE *header = &screen.header, *rows = &screen.book;
+    chtype line[header->cols > rows->cols ? header->cols : rows->cols];
+    uint64_t start = stage_now();
+    int col;
     
     
-    printw("\t   BIDS              ASKS\nVol/%d: (%f)  %.0f%%  (%f)\n\n", maxorder, bid_btc_total,(ask_btc_total / bid_btc_total)*100, ask_btc_total);
-    
+    render_text(line, header->cols, 0, 0, "\t    LIVE ORDER BOOK");
+    render_line(header, 0, line);
+    render_text(line, header->cols, 0, 0, "\t    --%s %s/%s--", market->exchange->title, market->symbol1, market->symbol2);
+    render_line(header, 1, line);
     
-    // STORE HIGHEST BID AND LOWEST ASK PRICE
-    //if(mytype && (strcmp(mytype, "buy") == 0)){ //adj_price->highest_bid/lowest_ask contains highest bid/lowest ask/
-    adj_price->highest_bid = json_real_value(json_array_get(json_array_get(bids, 0), 0));
-    //}else{
-    adj_price->lowest_ask = json_real_value(json_array_get(json_array_get(asks, 0), 0));
-    //adj_price->lowest_ask += 300;
+    if(mytype && (strcmp(mytype, "sell") == 0 || strcmp(mytype, "buy") == 0)){
+        // sells get the fee taken off, buys pay it on top
+        fixed_t mytotal = strcmp(mytype, "sell") == 0 ? mycost - fee_of(mycost) : mycost + fee_of(mycost);
+        render_text(line, header->cols, 0, 0, "   last: %c - %f @ %.2f = %.2f", toupper(last_trade.type[0]), amount_double(last_trade.amount), price_double(last_trade.price), price_double(last_trade.cost));
+        render_line(header, 2, line);
+        render_text(line, header->cols, 0, 0, "pending: %c - %f @ %.2f = %.2f <-", toupper(mytype[0]), amount_double(myamount), price_double(myprice), price_double(mytotal));
+        render_line(header, 3, line);
+    }else{
+        render_text(line, header->cols, 0, 0, "");
+        render_line(header, 2, line);
+        render_line(header, 3, line);
+    }
+    render_text(line, header->cols, 0, 0, "\t\t  (AUTO)");
+    render_line(header, 4, line);
+    render_text(line, header->cols, 0, 0, "\tL:%4.2f ------- %4.2f:H", price_double(low), price_double(high));
+    render_line(header, 5, line);
+    render_text(line, header->cols, 0, 0, "\t      --> %4.2f <--", price_double(lastprice));
+    render_line(header, 6, line);
     
-    //}
+    ask_btc_total = book_depth(asks, maxorder);
+    bid_btc_total = book_depth(bids, maxorder);
     
-    // STORE BID AND ASK PRICE AT POS lock_index
-    if (lock_index){
-        if(mytype && (strcmp(mytype, "buy") == 0)){ //adj_price->lock_bid_ask contains bid/ask at position lock_index/
-            
-            int compressed_bids[lock_index];
-            memset(&compressed_bids,0x0,sizeof(compressed_bids));
-            for(int i = 0; i < json_array_size(bids); i++){
-                lock_bid_pair = json_array_get(bids, i);
-                lock_bid_price = (int)json_real_value(json_array_get(lock_bid_pair, 0));
-                
-                for(int i = 0; i < lock_index; i++){
-                    if(compressed_bids[i] == 0){
-                        if(compressed_bids[i-1] != lock_bid_price){
-                            compressed_bids[i] = lock_bid_price;
-                        }
-                        break;
-                    }
-                    
-                }
-            }
-            //adj_price->lock_bid_ask = (int)json_real_value(json_array_get(json_array_get(bids, lock_index), 0));
-            adj_price->lock_bid_ask = compressed_bids[lock_index-1];
-            /*for(int i = 0; i < lock_index; i++){
-             printw("%d\n",compressed_bids[i]);
-             }
-             printw("CURRENT LOCK IS %d -> %f\n", lock_index, adj_price->lock_bid_ask);
-             refresh();*/
-            
-            
-            
-            
-        }else{
-            int compressed_asks[lock_index];
-            memset(&compressed_asks,0x0,sizeof(compressed_asks));
-            for(int i = 0; i < json_array_size(asks); i++){
-                lock_ask_pair = json_array_get(asks, i);
-                lock_ask_price = (int)json_real_value(json_array_get(lock_ask_pair, 0));
-                
-                for(int i = 0; i < lock_index; i++){
-                    if(compressed_asks[i] == 0){
-                        if(compressed_asks[i-1] != lock_ask_price){
-                            compressed_asks[i] = lock_ask_price;
-                        }
-                        break;
-                    }
-                    
-                    
-                    
-                }
-            }
-            
-            
-            
-            //adj_price->lock_bid_ask = (int)json_real_value(json_array_get(json_array_get(asks, lock_index), 0));
-            adj_price->lock_bid_ask = compressed_asks[lock_index-1];
-            
-        }
-    }
+    render_text(line, header->cols, 0, 0, "\t   BIDS              ASKS");
+    render_line(header, 7, line);
+    render_text(line, header->cols, 0, 0, "Vol/%d: (%f)  %.0f%%  (%f)", maxorder, amount_double(bid_btc_total),((double)ask_btc_total / bid_btc_total)*100, amount_double(ask_btc_total));
+    render_line(header, 8, line);
     
     
     int lockarrow = 0;
     
-    for(int i = 0; i < 40; i++){
-        //for(int i = 0; i < json_array_size(asks); i++){
-        
-        bid_pair = json_array_get(bids, i);
-        bid_price = json_real_value(json_array_get(bid_pair, 0));
-        bid_btc = json_real_value(json_array_get(bid_pair, 1));
-        
-        ask_pair = json_array_get(asks, i);
-        ask_price = json_real_value(json_array_get(ask_pair, 0));
-        ask_btc = json_real_value(json_array_get(ask_pair, 1));
+    for(int i = 0; i < rows->rows; i++){
         
+        bid_price = book_price(bids, i);
+        bid_btc = book_amount(bids, i);
         
+        ask_price = book_price(asks, i);
+        ask_btc = book_amount(asks, i);
         
-        attron(COLOR_PAIR(3));
-        
-        printw("%3d. %9.6f ", i + 1, bid_btc);
-        
+        col = render_text(line, rows->cols, 0, COLOR_PAIR(3), "%3d. %9.6f ", i + 1, amount_double(bid_btc));
         
         
         /////////////////////////////// HIGHLIGHT CURRENT BID/ASK POSITION /////////////////////////////
         
         if((mytype && strcmp(mytype, "buy") == 0 && myprice == bid_price)){
-            //printw("PRICE HERE IS %f", myprice);
-            if(!price_index){
-                adj_price->higher_bid_ask = (int)json_real_value(json_array_get(json_array_get(bids, i-1), 0));    /* higher bid*/
-                adj_price->lower_bid_ask = (int)json_real_value(json_array_get(json_array_get(bids, i+2), 0));    /* lower bid*/
-            }else{
-                adj_price->index_bid_ask = (int)json_real_value(json_array_get(json_array_get(bids, i+price_index), 0));
-            }
-            
-            attron(COLOR_PAIR(3));
-            printw("(%4.2f)", bid_price);
+            col = render_text(line, rows->cols, col, COLOR_PAIR(3), "(%4.2f)", price_double(bid_price));
         }else{
-            //printw("PRICE IS %f", myprice);
-            //printw("\n\nBID_PRICE IS %f", bid_price);
-            
-            attron(COLOR_PAIR(2));
-            printw("%4.2f ", bid_price);
+            col = render_text(line, rows->cols, col, COLOR_PAIR(2), "%4.2f ", price_double(bid_price));
         }
         
-        
         if(((mytype && strcmp(mytype, "sell") == 0 && myprice == ask_price))){
-            
-            if(!price_index){
-                adj_price->higher_bid_ask = (int)json_real_value(json_array_get(json_array_get(asks, i+2), 0)); /* higher ask */
-                adj_price->lower_bid_ask = (int)json_real_value(json_array_get(json_array_get(asks, i-1), 0)); /* lower ask */
-            }else{
-                adj_price->index_bid_ask = (int)json_real_value(json_array_get(json_array_get(asks, i+price_index), 0));
-                
-            }
-            attron(COLOR_PAIR(3));
-            printw("(%4.2f) ", ask_price);
-            
+            col = render_text(line, rows->cols, col, COLOR_PAIR(3), "(%4.2f) ", price_double(ask_price));
         }else{
-            attron(COLOR_PAIR(1));
-            printw("%4.2f ", ask_price);
+            col = render_text(line, rows->cols, col, COLOR_PAIR(1), "%4.2f ", price_double(ask_price));
         }
         
+        col = render_text(line, rows->cols, col, COLOR_PAIR(3), "%9.6f", amount_double(ask_btc));
         
         
-        attron(COLOR_PAIR(3));
-        printw("%9.6f", ask_btc);
-        
-        
-        if(lock_index && strcmp(mytype, "buy")==0){
-            if(adj_price->lock_bid_ask == (int)bid_price)
-                if(!lockarrow){
-                    printw(" <-L%d", lock_index);
-                    lockarrow = 1;
-                }
-        }
-        
-        if(lock_index && strcmp(mytype, "sell")==0){
-            if(adj_price->lock_bid_ask == (int)ask_price){
-                if(!lockarrow){
-                    printw(" <-L%d", lock_index);
-                    lockarrow=1;
-                }
+        ///////////////////////////////// PLACE LOCK INDEX MARKER ///////////////////////////////////////////
+        if(lock_index && !lockarrow && mytype){
+            fixed_t level = strcmp(mytype, "buy") == 0 ? bid_price : strcmp(mytype, "sell") == 0 ? ask_price : -1;
+            if(level >= 0 && adj_price->lock_bid_ask == price_floor(level)){
+                render_text(line, rows->cols, col, COLOR_PAIR(3), " <-L%d", lock_index);
+                lockarrow = 1;
             }
         }
-        ///////////////////////////////// PLACE LOCK INDEX MARKER ///////////////////////////////////////////
-        
-        //if((lock_index && lock_index == i+1)){
-        // if((lock_index)){
-        
-        //}
-        
-        /*    printw(" <-L\n");
-         }else{
-         printw("\n");
-         }*/
         ///////////////////////////////// END PLACE LOCK INDEX MARKER //////////////////////////////////////
         
-        printw("\n");
+        render_line(rows, i, line);
         /////////////////////////////// END HIGHLIGHT CURRENT BID/ASK POSITION /////////////////////////////
         
-        
-        
-        ////////////////////////////// STORE DEFAULT HIGHER BID/ASK FOR ORDERS OUTSIDE TOP LIST ///////////////////////////////
-        if(adj_price->higher_bid_ask == 0 && i == json_array_size(asks)){
-            if ((mytype && strcmp(mytype, "buy") == 0)){
-                adj_price->higher_bid_ask = bid_price; //last bid_price value in the previous loop
-            }else{
-                adj_price->higher_bid_ask = ask_price; //last ask_price value in the previous loop
-            }
-        }
-        ////////////////////////////// END STORE DEFAULT HIGHER BID/ASK FOR ORDERS OUTSIDE TOP LIST ///////////////////////////////
-        
     }
     
+    render_flush(&screen);
+    stage_end(STAGE_RENDER, start);
 }
 
 /*---------------------------- end show_order_book ------------------------------*/
@@ -800,44 +6655,114 @@ void show_order_book(json_t *orders, const char *mytype, double myamount, double
 
 /*----------------------------------- main --------------------------------------*/
 
-int main(void){
-    
-    
-    json_t *orders, *orders_top, *ticker_root, *lastprice_root;
-    json_error_t error;
+int main(int argc, char *argv[]){
     
     
-    double cost = 0.0;
-    double btc_available = 0.0;
-    double usd_available = 0.0;
-    float trade_price = 0.0;
-    double high = 0.0;
-    double low = 0.0;
-    double lastprice = 0.0;
-    
-    char *order_type = NULL;
+    fixed_t cost = 0;
+    fixed_t btc_available = 0;
+    fixed_t usd_available = 0;
+    fixed_t trade_price = 0;
     
     const char *newtype = NULL;
     struct authdata *a = NULL;
     char ch;
     
     char *request_params = malloc(3000);
-    char nonce[11];
+    char nonce[24];
     char timestamp[30];
     
-    int price_index = 0;
-    int lock_index = 5;
-    long start_time = 0;
-    int updatetrades_count = 0;
-    int ticker_count = 0;
-    int kickcount = 0;
-    int lastprice_count = 0;
-    char oldtype[6];
+    int use_ws = 1;
+    const char *ws_url = NULL;          /* NULL: the exchange's own */
+    const char *api_url = NULL;
+    const char *control_path = NULL;
+    const char *record_path = NULL;
+    const char *backtest_path = NULL, *backtest_grid = NULL;
+    const char *bench_spec = NULL;
+    const char *trace_path = NULL, *trace_show = NULL;
+    int backtest_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
     
-    start_time = time(NULL)+300;
+    transport_init();
+    signer_init(&signer, "", "", ""); // user id, api key, secret key
+    nonce_init(&nonces, DEFAULT_HOMEDIR NONCEFILE);
+    json_object_seed(0);    /* before any thread creates a json object */
+    json_set_alloc_funcs(tick_json_malloc, tick_json_free);
     
     //////////////////////////////////////////////////////
     // PARSE CONFIG FILE
+    int opt;
+    while((opt = getopt(argc, argv, "pw:u:d:m:r:b:g:j:B:t:T:")) != -1){
+        switch(opt){
+            case 'p': // poll the REST order book, no websocket feed
+                use_ws = 0;
+                break;
+            case 'w': // websocket url, e.g. ws://127.0.0.1:8089/ for mockcex
+                ws_url = optarg;
+                break;
+            case 'u': // REST base url, e.g. http://127.0.0.1:8090/api for mockcex
+                api_url = optarg;
+                break;
+            case 'd': // headless, driven through a unix socket at this path
+                control_path = optarg;
+                break;
+            case 'r': // record the raw market data to this file
+                record_path = optarg;
+                break;
+            case 'b': // backtest the first market on a recording, no trading
+                backtest_path = optarg;
+                break;
+            case 'g': // backtest parameter grid, e.g. lock=2:8,kick=2:6
+                backtest_grid = optarg;
+                break;
+            case 'j': // backtest threads
+                backtest_threads = atoi(optarg);
+                break;
+            case 't': // trace every lock repricing to this file
+                trace_path = optarg;
+                break;
+            case 'T': // print a trace file and exit
+                trace_show = optarg;
+                break;
+            case 'B': // benchmarks, e.g. all or book_decode,tick=20000,levels=200; -b is what tick replays
+                bench_spec = optarg;
+                break;
+            case 'm': // a market to trade, repeat for more: [exchange:]BTC/USD[:price_decimals:amount_decimals]
+                if(market_add(optarg) == NULL){
+                    fprintf(stderr, "%s: bad, unknown or duplicate market\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p] [-w ws_url] [-u api_url] [-d control_socket] [-r record_file] [-b record_file [-g grid] [-j threads]] [-B benchmarks] [-t trace_file] [-T trace_file] [-m [exchange:]SYMBOL1/SYMBOL2[:price_decimals:amount_decimals]]...\n", argv[0]);
+                return 1;
+        }
+    }
+    if(nmarkets == 0)
+        market_add("cex:BTC/USD:2:8");
+    
+    // a shard per market
+    for(int i = 0; i < nmarkets; i++){
+        SHARD *s = &shards[nshards++];
+        s->market = &markets[i];
+        api_init(&s->api, s->market, api_url);
+        s->ws_url = use_ws ? (ws_url ? ws_url : s->market->exchange->ws_url) : NULL;
+    }
+    if(trace_show){
+        int status = trace_print(trace_show);
+        if(status < 0)
+            perror(trace_show);
+        transport_cleanup();
+        return status < 0 ? 1 : 0;
+    }
+    if(bench_spec){
+        int status = bench(bench_spec, backtest_path);
+        transport_cleanup();
+        return status < 0 ? 1 : 0;
+    }
+    if(backtest_path){
+        int status = backtest(backtest_path, backtest_grid, backtest_threads);
+        transport_cleanup();
+        return status < 0 ? 1 : 0;
+    }
     
     
     
@@ -861,32 +6786,57 @@ int main(void){
     
     
     
-    ARCHIVE_DBS *archivedbs;
-    archivedbs = malloc(sizeof(ARCHIVE_DBS));
-    initialize_archivedbs(archivedbs);
-    set_db_filenames(archivedbs);
-    databases_setup(archivedbs, "ctrader", NULL);
-    // UPDATE TRADE HISTORY DATABASE
-    printf("Updating Trades database..\n");
-    memset(nonce, 0, strlen(nonce));
-    memset(request_params, 0, strlen(request_params));
-    memset(timestamp, 0, strlen(timestamp));
-    get_trades(archivedbs, nonce, request_params, timestamp, a, "update", "d",0); //DOWNLOAD ALL DONE TRADES
-    memset(nonce, 0, strlen(nonce));
-    memset(request_params, 0, strlen(request_params));
-    memset(timestamp, 0, strlen(timestamp));
-    get_trades(archivedbs, nonce, request_params, timestamp, a, "update", "cd",0); //DOWNLOAD ALL PARTIAL DONE TRADES
-    
-    /// GET LAST TRADE
-    memset(nonce, 0, strlen(nonce));
-    memset(request_params, 0, strlen(request_params));
-    memset(timestamp, 0, strlen(timestamp));
-    TRADE last_trade=get_trades(archivedbs, nonce, request_params, timestamp, a, "view", "d",1);
-    databases_close(archivedbs);
-    free(archivedbs);
+    // every market's trades database opens once, in one environment
+    if(env_setup(&archive_env, DEFAULT_HOMEDIR, "ctrader", stderr) != 0)
+        fprintf(stderr, "trades databases are opened without an environment\n");
+    for(int i = 0; i < nshards; i++){
+        shard_enter(&shards[i]);
+        ARCHIVE_DBS *archivedbs = &shard->archive;
+        initialize_archivedbs(archivedbs);
+        set_db_filenames(archivedbs);
+        databases_setup(archivedbs, "ctrader", NULL);
+        // UPDATE TRADE HISTORY DATABASE
+        printf("Updating %s/%s trades database..\n", market->symbol1, market->symbol2);
+        memset(nonce, 0, strlen(nonce));
+        memset(request_params, 0, strlen(request_params));
+        memset(timestamp, 0, strlen(timestamp));
+        get_trades(archivedbs, nonce, request_params, timestamp, a, "update", "d",0); //DOWNLOAD ALL DONE TRADES
+        memset(nonce, 0, strlen(nonce));
+        memset(request_params, 0, strlen(request_params));
+        memset(timestamp, 0, strlen(timestamp));
+        get_trades(archivedbs, nonce, request_params, timestamp, a, "update", "cd",0); //DOWNLOAD ALL PARTIAL DONE TRADES
+        
+        /// GET LAST TRADE
+        memset(nonce, 0, strlen(nonce));
+        memset(request_params, 0, strlen(request_params));
+        memset(timestamp, 0, strlen(timestamp));
+        shard->last_trade = get_trades(archivedbs, nonce, request_params, timestamp, a, "view", "d",1);
+    }
     /////////////////
     
     
+    //////////////////////// START MARKET DATA AND ORDER THREADS ////////////////////////////
+    if(record_path && recorder_start(record_path) != 0)
+        perror(record_path);
+    if(trace_path && trace_start(trace_path) != 0)
+        perror(trace_path);
+    signal(SIGUSR1, latency_signal);    /* latency histograms to LATENCYFILE */
+    for(int i = 0; i < nshards; i++)
+        threads_start(&shards[i]);
+    
+    if(control_path){
+        int status = control_serve(control_path);
+        threads_stop();
+        recorder_stop();
+        trace_stop();
+        archive_close();
+        transport_thread_cleanup();
+        transport_cleanup();
+        return status < 0 ? 1 : 0;
+    }
+    //////////////////////// END START MARKET DATA AND ORDER THREADS ////////////////////////
+    
+    
     initscr();
     cbreak();
     nodelay(stdscr, TRUE);
@@ -897,6 +6847,8 @@ int main(void){
     init_pair(1, COLOR_YELLOW, COLOR_BLACK);
     init_pair(2, COLOR_GREEN, COLOR_BLACK);
     init_pair(3, COLOR_WHITE, COLOR_BLACK);
+    refresh();      /* stdscr stays blank under the panes */
+    render_init(&screen);
     struct prices *adj_price = (void*)malloc(sizeof(struct prices));
     memset(adj_price,0,sizeof(struct prices));
     
@@ -904,471 +6856,174 @@ int main(void){
     
     
     
-    //////////////////////// SET UP TALLY BOARD ASK / BID TARGET PRICE FOR AUTO TRADE MODE ////////////////////////////
-    char *ticker_url = malloc(strlen("https://cex.io/api/ticker/BTC/USD/")+1);
-    strcpy(ticker_url, "https://cex.io/api/ticker/BTC/USD/");
-    struct RespData *response = (void*)malloc(sizeof(struct RespData));
-    response->memory = (void*)malloc(1);
-    response->size = 0;
-    Getjson(response, ticker_url, NULL);
-    free(ticker_url);
-    ticker_root = json_loads(response->memory, 0, &error);
-    free(response->memory);
-    low = atof(json_string_value(json_object_get(ticker_root, "low")));
-    high = atof(json_string_value(json_object_get(ticker_root, "high")));
-    json_decref(ticker_root);
-    
-    
-    float midpoint = ((high + low) / 2);
-    int ask_tally_size = ((int)high - (int)midpoint) * 10;
-    int bid_tally_size = ((int)midpoint - (int)low)  * 10;
-    
-    int tally_counter = 0;
-    float target_price_sell = 0.0;
-    float target_price_buy = 0.0;
-    int target_price_tally = 0.0;
-    
-    
-    /// ASK TALLY
-    int **ask_tally = malloc(sizeof(int*) * ask_tally_size);
-    for(int i = 0; i < ask_tally_size; i++){
-        ask_tally[i] = malloc(sizeof(float));
-        *ask_tally[i] = 0;
-    }
-    
-    /// BID TALLY
-    int **bid_tally = malloc(sizeof(int*) * bid_tally_size);
-    for(int i = 0; i < bid_tally_size; i++){
-        bid_tally[i] = malloc(sizeof(float));
-        *bid_tally[i] = 0;
-    }
-    //////////////////////// END SET UP TALLY BOARD ASK / BID TARGET PRICE FOR AUTO TRADE MODE ////////////////////////
-    
-    
-    
-    
+    struct md_state *md = malloc(sizeof(struct md_state));
+    struct order_state orders;
+    struct notice notice;
+    ORDER_BOOK book;                    /* view of md, nothing to free */
+    unsigned long shown_md = 0, shown_orders = 0, range_breaks[MAX_MARKETS] = { 0 };
+    int current = 0;                    /* shard on screen, 'm' moves to the next */
+    shard_enter(&shards[current]);
     
     for (;;)
     {
-        ++updatetrades_count;
-        if(updatetrades_count == 3000){
-            //clear();
-            printw("Updating Trades database..\n");
-            refresh();
-            //erase();
-            updatetrades_count = 0;
-            ARCHIVE_DBS *archivedbs = malloc(sizeof(ARCHIVE_DBS));
-            initialize_archivedbs(archivedbs);
-            set_db_filenames(archivedbs);
-            databases_setup(archivedbs, "ctrader", NULL);
-            // UPDATE TRADE HISTORY DATABASE
-            memset(nonce, 0, strlen(nonce));
-            memset(request_params, 0, strlen(request_params));
-            memset(timestamp, 0, strlen(timestamp));
-            
-            get_trades(archivedbs, nonce, request_params, timestamp, a, "update", "d",0);
-            databases_close(archivedbs);
-            free(archivedbs);
-        }
-        
-        
+        // a key, or once a frame look for new snapshots
+        struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+        poll(&input, 1, UI_FRAME_MS);
+        int keypressed = kbhit();       /* also sees keys ncurses buffered already */
+        latency_dump();
+        trace_drain();
         
+        snapshot_read(&shard->md.seq, md, &shard->md.state, sizeof(struct md_state));
+        snapshot_read(&shard->orders.seq, &orders, &shard->orders.state, sizeof(orders));
+        md_state_book(md, &book);
+        struct order openorders = orders.open;
+        int lock_index = orders.lock_index;
+        book_adjust(&book, openorders.type, openorders.price, adj_price, 0, lock_index);
         
-        struct order openorders;
-        struct RespData *response = (void*)malloc(sizeof(struct RespData));
-        
-        char *replace_json = malloc(strlen("{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"type\":\"%s\",\"amount\":\"%f\",\"price\":\"%f\",\"order_id\":\"%s\"}")+1);
-        strcpy(replace_json, "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"type\":\"%s\",\"amount\":\"%f\",\"price\":\"%f\",\"order_id\":\"%s\"}");
-        char *replace_url = malloc(strlen("https://cex.io/api/cancel_replace_order/BTC/USD/")+1);
-        strcpy(replace_url,"https://cex.io/api/cancel_replace_order/BTC/USD/");
-        
-        
-        char *cancel_json = malloc(strlen("{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"id\":\"%s\"}")+1);
-        strcpy(cancel_json, "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"id\":\"%s\"}");
-        char *cancel_url = malloc(strlen("https://cex.io/api/cancel_order/")+1);
-        strcpy(cancel_url, "https://cex.io/api/cancel_order/");
-        
-        char *open_order_json = malloc(strlen("{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\"}")+1);
-        strcpy(open_order_json, "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\"}");
-        char *open_order_url = malloc(strlen("https://cex.io/api/open_orders/")+1);
-        strcpy(open_order_url, "https://cex.io/api/open_orders/");
-        
-        char *order_book_url = malloc(strlen("https://cex.io/api/order_book/BTC/USD/")+1);
-        strcpy(order_book_url, "https://cex.io/api/order_book/BTC/USD/");
-        char *order_book_top_url = malloc(strlen("https://cex.io/api/order_book/BTC/USD/?depth=1")+1);
-        strcpy(order_book_top_url, "https://cex.io/api/order_book/BTC/USD/?depth=1");
-        
-        char *ticker_url = malloc(strlen("https://cex.io/api/ticker/BTC/USD/")+1);
-        strcpy(ticker_url, "https://cex.io/api/ticker/BTC/USD/");
-        
-        char *lastprice_url = malloc(strlen("https://cex.io/api/last_prices/BTC/USD/")+1);
-        strcpy(lastprice_url, "https://cex.io/api/last_prices/BTC/USD/");
-        
-        char *balance_json = malloc(strlen("{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\"}")+1);
-        strcpy(balance_json,"{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\"}" );
-        char *balance_url = malloc(strlen("https://cex.io/api/balance/")+1);
-        strcpy(balance_url, "https://cex.io/api/balance/");
-        
-        char *place_order_json = malloc(strlen("{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"type\":\"%s\",\"amount\":\"%f\",\"price\":\"%f\"}")+1);
-        strcpy(place_order_json, "{\"key\":\"%s\",\"signature\":\"%s\",\"nonce\":\"%s\",\"type\":\"%s\",\"amount\":\"%f\",\"price\":\"%f\"}");
-        char *place_order_url = malloc(strlen("https://cex.io/api/place_order/BTC/USD/")+1);
-        strcpy(place_order_url, "https://cex.io/api/place_order/BTC/USD/");
-        
-        /////////////// GET TICKER /////////////////////////////////////////////////
-        ticker_count++;
-        if(ticker_count == 1 || ticker_count == 3){
-            response->memory = (void*)malloc(1);
-            response->size = 0;
-            Getjson(response, ticker_url, NULL);
-            ticker_root = json_loads(response->memory, 0, &error);
-            free(response->memory);
-            double oldlow = low;
-            double oldhigh = high;
-             low = atof(json_string_value(json_object_get(ticker_root, "low")));
-            high = atof(json_string_value(json_object_get(ticker_root, "high")));
-            
-            if((oldlow != oldhigh) && (low < oldlow || high > oldhigh)){
-                flash();
-                beep();
-            }
-            json_decref(ticker_root);
-            if (ticker_count == 3)
-                ticker_count=0;
-        }
-        /////////////// END GET TICKER /////////////////////////////////////////////////
-        
-        /////////////// GET LAST PRICE /////////////////////////////////////////////////
-        lastprice_count++;
-        if(lastprice_count == 1 || lastprice_count == 3){
-            response->memory = (void*)malloc(1);
-            response->size = 0;
-            Getjson(response, lastprice_url, NULL);
-            lastprice_root = json_loads(response->memory, 0, &error);
-            free(response->memory);
-            json_t *last_price_data, *data_pair;
-            last_price_data = json_object_get(lastprice_root, "data");
-            //for(int i = 0; i < json_array_size(last_price_data); i++){
-            data_pair = json_array_get(last_price_data, 0);
-            lastprice = atof(json_string_value(json_object_get(data_pair, "lprice")));
-            //}
-            
-            
-            json_decref(lastprice_root);
-            if (lastprice_count == 3)
-                lastprice_count=0;
-        }
-        /////////////// END GET LAST PRICE /////////////////////////////////////////////////
-        
-        
-        
-        /////////////// GET OPEN ORDERS /////////////////////////////////////////////////
-        memset(nonce, 0, strlen(nonce));
-        memset(request_params, 0, strlen(request_params));
-        strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-        a =  (void *)malloc(sizeof(struct authdata));
-        create_authdata(a, nonce);
-        sprintf(request_params, open_order_json, a->apikey, a->signature, nonce);
-        free(a);
-        response->memory = (void*)malloc(1);
-        response->size = 0;
-        Getjson(response, open_order_url, request_params);
-        open_orders_root = json_loads(response->memory, 0, &error);
-        free(response->memory);
-        
-        if (json_object_get(json_array_get(open_orders_root, 0), "type")){
-            openorders.placed = 1;
-            strcpy(openorders.type, json_string_value(json_object_get(json_array_get(open_orders_root, 0), "type")));
-            strcpy(oldtype,openorders.type);
-            openorders.amount = atof(json_string_value(json_object_get(json_array_get(open_orders_root, 0), "amount")));
-            openorders.price = atof(json_string_value(json_object_get(json_array_get(open_orders_root, 0), "price")));
-            strcpy(openorders.order_id, json_string_value(json_object_get(json_array_get(open_orders_root, 0), "id")));
-        }else{
-            
-            /////////////// GET CURRENT BALANCE /////////////////////////////////////////////////
-            memset(nonce, 0, strlen(nonce));
-            memset(request_params, 0, strlen(request_params));
-            strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-            a =  (void *)malloc(sizeof(struct authdata));
-            
-            create_authdata(a, nonce);
-            sprintf(request_params, balance_json, a->apikey, a->signature, nonce);
-            free(a);
-            response->memory = (void*)malloc(1);
-            response->size = 0;
-            Getjson(response, balance_url, request_params);
-            account_balance_root = json_loads(response->memory, 0, &error);
-            free(response->memory);
-            if(json_string_value(json_object_get(json_object_get(account_balance_root, "BTC"), "available"))){
-                btc_available = atof(json_string_value(json_object_get(json_object_get(account_balance_root, "BTC"), "available")));
-            }
-            if(json_string_value(json_object_get(json_object_get(account_balance_root, "USD"), "available"))){
-                usd_available = atof(json_string_value(json_object_get(json_object_get(account_balance_root, "USD"), "available")));
-            }
-            json_decref(account_balance_root);
-            /////////////// END GET CURRENT BALANCE /////////////////////////////////////////////////
-            
-            if(openorders.placed){ /// SEND NOTIFICATION IF ORDER WAS FULFILLED.
-                if((btc_available  < openorders.amount && strcmp(oldtype,"sell")==0) || (usd_available < openorders.amount * openorders.price && strcmp(oldtype,"buy")==0)){
-                    printw("%s order completed!", oldtype);
-                    refresh();
-                    beep();
-                    beep();
+        // every market's notices, the ones of markets not on screen say which they are from
+        for(int s = 0; s < nshards; s++){
+            while(notice_pop(&shards[s], &notice)){
+                if(s != current)
+                    wprintw(screen.log, "%s/%s: ", shards[s].market->symbol1, shards[s].market->symbol2);
+                wprintw(screen.log, "%s", notice.text);
+                for(int i = 0; i < notice.beeps; i++)
                     beep();
+                if(notice.beeps)
                     flash();
-                    ARCHIVE_DBS *archivedbs;
-                    archivedbs = malloc(sizeof(ARCHIVE_DBS));
-                    initialize_archivedbs(archivedbs);
-                    set_db_filenames(archivedbs);
-                    databases_setup(archivedbs, "ctrader", NULL);
-                    
-                    // UPDATE TRADE HISTORY DATABASE
-                    printf("Updating Trades database..\n");
-                    refresh();
-                    memset(nonce, 0, strlen(nonce));
-                    memset(request_params, 0, strlen(request_params));
-                    memset(timestamp, 0, strlen(timestamp));
-                    get_trades(archivedbs, nonce, request_params, timestamp, a, "update", "d",0); //DOWNLOAD ALL DONE TRADES
-                    memset(nonce, 0, strlen(nonce));
-                    memset(request_params, 0, strlen(request_params));
-                    memset(timestamp, 0, strlen(timestamp));
-                    get_trades(archivedbs, nonce, request_params, timestamp, a, "update", "cd",0); //DOWNLOAD ALL PARTIAL DONE TRADES
-                    databases_close(archivedbs);
-                    free(archivedbs);
-                    /////////////////
-                }else{
-                    printw("%s order cancelled.", oldtype);
-                }
-                
-                
-                openorders.placed = 0;
-            }else{
-                ///////////////////////////// AUTO-PLACE ORDER /////////////////////////////////////////
-                if(btc_available > .01 && usd_available <= 100){
-                    //printw("ORDER TYPE IS SELL\n");
-                    //refresh();
-                    order_type = "sell";
-                    if(adj_price->lowest_ask && ((high - adj_price->lowest_ask) < (adj_price->lowest_ask - low))){ //SELL AT PAST MID
-                        if(target_price_sell){
-                            printw("WE ARE PLACING ORDER AT %.02f\n", target_price_sell);
-                            refresh();
-                            //exit(0);
-                            /*memset(nonce, 0, strlen(nonce));
-                             memset(request_params, 0, strlen(request_params));
-                             strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-                             a =  (void *)malloc(sizeof(struct authdata));
-                             create_authdata(a, nonce);
-                             sprintf(request_params, place_order_json, a->apikey, a->signature, nonce, order_type, btc_available, target_price_sell);
-                             
-                             free(a);
-                             response->memory = (void*)malloc(1);
-                             response->size = 0;
-                             Getjson(response, place_order_url, request_params);
-                             free(response->memory);*/
-                            
-                        }else{
-                            // index = (p - m) * 10
-                            int i =  (adj_price->lowest_ask - (int)midpoint) * 10;
-                            //printw("SAVING %f AT POSITION %d\n", adj_price->lowest_ask, i);
-                            *ask_tally[i] = *ask_tally[i]+1;
-                            tally_counter++;
-                            //printw("TALLY COUNTER IS %d\n", tally_counter);
-                            refresh();
-                            if (tally_counter == 60){
-                                for(int i = 0; i < ask_tally_size; i++){
-                                    if(*ask_tally[i]){ //SKIP ELEMENTS == 0
-                                        float order_price = ((float)i / 10) + (int)midpoint;
-                                        if(*ask_tally[i] >= target_price_tally){
-                                            target_price_tally = *ask_tally[i];
-                                            target_price_sell = order_price;
-                                        }
-                                        printw("%.02f - %d\n",order_price,*ask_tally[i]);
-                                        refresh();
-                                    }
-                                }
-                                //tally_counter = 0;
-                            }
-                        }
-                    }
-                }else if(btc_available < .01 && usd_available >= 100){
-                    order_type = "buy";
-                    //printw("ORDER TYPE IS BUY\n");
-                    refresh();
-                    if(adj_price->highest_bid && ((adj_price->highest_bid - low) < (high - adj_price->highest_bid))){  //BUY BELOW MID
-                        if(target_price_buy){
-                            /*printw("WE ARE PLACING ORDER AT %.02f\n", target_price_buy);*/
-                            refresh();
-                            /*memset(nonce, 0, strlen(nonce));
-                             memset(request_params, 0, strlen(request_params));
-                             strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-                             a =  (void *)malloc(sizeof(struct authdata));
-                             create_authdata(a, nonce);
-                             sprintf(request_params, place_order_json, a->apikey, a->signature, nonce, order_type, btc_available, target_price_sell);
-                             
-                             free(a);
-                             response->memory = (void*)malloc(1);
-                             response->size = 0;
-                             Getjson(response, place_order_url, request_params);
-                             free(response->memory);*/
-                            
-                        }else{
-                            // index = (p - m) * 10
-                            int i =  (((int)midpoint) - adj_price->highest_bid) * 10;
-                            //printw("SAVING %f AT POSITION %d\n", adj_price->highest_bid, i);
-                            *bid_tally[i] = *bid_tally[i]+1;
-                            tally_counter++;
-                            //printw("TALLY COUNTER IS %d\n", tally_counter);
-                            refresh();
-                            if (tally_counter == 8){
-                                for(int i = 0; i < bid_tally_size; i++){
-                                    if(*bid_tally[i]){ //SKIP ELEMENTS == 0
-                                        float order_price = (int)midpoint - ((float)i / 10);
-                                        if(*bid_tally[i] >= target_price_tally){
-                                            target_price_tally = *bid_tally[i];
-                                            target_price_buy = order_price;
-                                        }
-                                        printw("%.02f - %d\n",order_price,*bid_tally[i]);
-                                        refresh();
-                                    }
-                                }
-                                //tally_counter = 0;
-                            }
-                            
-                        }
-                    }
-                    
-                }
-                
-                ///////////////////////////// END AUTO-PLACE ORDER /////////////////////////////////////
-                
+                wrefresh(screen.log);
             }
-            memset(openorders.type, 0, strlen(openorders.type));
         }
-        json_decref(open_orders_root);
-        
-        /////////////// END GET OPEN ORDERS /////////////////////////////////////////////////
-        
+        if(md->range_breaks != range_breaks[current]){
+            flash();
+            beep();
+            range_breaks[current] = md->range_breaks;
+        }
         
         
-        if (kbhit()) {
-            //if(type != NULL){
-            memset(nonce, 0, strlen(nonce));
-            memset(request_params, 0, strlen(request_params));
-            strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-            a =  (void *)malloc(sizeof(struct authdata));
-            create_authdata(a,nonce);
-            ch = getch();
+        if (keypressed) {
+            ch = wgetch(screen.log);
             if (ch =='\033'){
                 // if the first value is esc
-                getch(); // skip the [
-                switch(getch()) { // the real value
+                wgetch(screen.log); // skip the [
+                switch(wgetch(screen.log)) { // the real value
                     case 'A': //up arrow
                         if(strcmp(openorders.type, "sell") == 0){   /* up/sell */
                             for (int i = 0; openorders.price >= adj_price->lower_bid_ask; i++) //while price is higher than next lower ask
-                                openorders.price = (int)adj_price->lower_bid_ask - i; //subtract 1 from next lower ask to be ahead of that position.
+                                openorders.price = price_floor(adj_price->lower_bid_ask) - price_units(i); //subtract 1 from next lower ask to be ahead of that position.
                         }else if(strcmp(openorders.type, "buy") == 0){   /* up/buy */
-                            cost = openorders.price * openorders.amount; //current bid/ask price * amount
+                            cost = cost_of(openorders.price, openorders.amount); //current bid/ask price * amount
                             for (int i = 0; openorders.price <= adj_price->higher_bid_ask; i++) //while price is lower than next higher bid
-                                openorders.price = (int)adj_price->higher_bid_ask + i; //add 1 from next higher bid to be ahead of that position.
-                            if ((openorders.price * openorders.amount) > cost){
-                                printw("New amount: %f @ %.0f. [Y]/Esc", cost / openorders.price, openorders.price);
-                                refresh();
+                                openorders.price = price_floor(adj_price->higher_bid_ask) + price_units(i); //add 1 from next higher bid to be ahead of that position.
+                            if (cost_of(openorders.price, openorders.amount) > cost){
+                                wprintw(screen.log, "New amount: %f @ %.0f. [Y]/Esc", amount_double(amount_for(cost, openorders.price)), price_double(openorders.price));
+                                wrefresh(screen.log);
                                 char confirm;
                                 scanf("%c", &confirm);
                                 if(confirm != '\033'){
-                                    openorders.amount = cost / openorders.price;
+                                    openorders.amount = amount_for(cost, openorders.price);
                                 }
                             }
                         }else{
-                            lock_index-=2;
+                            ui_post(CMD_MOVE_LOCK, NULL, 0, 0, -2);
                             break;
                         }
                         
                         
-                        sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, openorders.amount, openorders.price, openorders.order_id);
-                        free(a);
-                        response->memory = (void*)malloc(1);
-                        response->size = 0;
-                        Getjson(response, replace_url, request_params);
-                        free(response->memory);
+                        ui_post(CMD_REPLACE, NULL, openorders.price, openorders.amount, 0);
                         break;
                         
                     case 'B': //down arrow
                         
-                        cost = (openorders.price * openorders.amount) + ((openorders.price * openorders.amount) * .0026); //current bid/ask price * amount
+                        cost = cost_of(openorders.price, openorders.amount);
+                        cost += fee_of(cost); //current bid/ask price * amount
                         if(strcmp(openorders.type, "buy") == 0){ /* down/buy */
                             for (int i = 0; openorders.price >= adj_price->lower_bid_ask; i++){ //while price is higher than next lower bid
-                                openorders.price = (int)adj_price->lower_bid_ask - i; //subtract 1 from next lower bid to be below that position
+                                openorders.price = price_floor(adj_price->lower_bid_ask) - price_units(i); //subtract 1 from next lower bid to be below that position
                             }
-                            openorders.amount = (cost - (cost * .0026)) / openorders.price; //new btc amount based on lower price (ask for confirmation if short selling)
+                            openorders.amount = amount_for(cost - fee_of(cost), openorders.price); //new btc amount based on lower price (ask for confirmation if short selling)
                             
                         }else if(strcmp(openorders.type, "sell") == 0){ /* down/sell */
                             for (int i = 0; openorders.price <= adj_price->higher_bid_ask; i++){ //while price is lower than next higher ask
-                                openorders.price = (int)adj_price->higher_bid_ask + i; //add 1 to next higher ask to be below that position
+                                openorders.price = price_floor(adj_price->higher_bid_ask) + price_units(i); //add 1 to next higher ask to be below that position
                             }
                         }else{
-                            lock_index+=2;
+                            ui_post(CMD_MOVE_LOCK, NULL, 0, 0, 2);
                             break;
                         }
                         
-                        sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, openorders.amount, openorders.price, openorders.order_id);
-                        free(a);
-                        response->memory = (void*)malloc(1);
-                        response->size = 0;
-                        Getjson(response, replace_url, request_params);
-                        free(response->memory);
+                        ui_post(CMD_REPLACE, NULL, openorders.price, openorders.amount, 0);
                         break;
                         
                     default: //Esc only (cancels order)
                         
                         if (lock_index){
-                            //printw("REMOVING LOCK INDEX\n");
-                            lock_index = 0;
+                            //wprintw(screen.log, "REMOVING LOCK INDEX\n");
+                            ui_post(CMD_SET_LOCK, NULL, 0, 0, 0);
                             break;
                         }else{
-                            sprintf(request_params, cancel_json, a->apikey, a->signature, nonce, openorders.order_id);
-                            
-                            free(a);
-                            response->memory = (void*)malloc(1);
-                            response->size = 0;
-                            Getjson(response,cancel_url, request_params);
-                            free(response->memory);
-                            memset(nonce, 0, strlen(nonce));
-                            lock_index = 0;
+                            ui_post(CMD_CANCEL, NULL, 0, 0, 0);
                             break;
                         }
                 }
             }else if (ch == 'j' || ch == 'k' || ch == 'l'){ //if j | k | l followed by digit(s).
                 int pos = 0;
-                nodelay(stdscr, FALSE);
+                int price_index = 0;
+                nodelay(screen.log, FALSE);
                 echo();
-                printw("\nIndex No.: ");
-                scanw("%d", &pos);
-                nodelay(stdscr, TRUE);
+                wprintw(screen.log, "\nIndex No.: ");
+                wscanw(screen.log, "%d", &pos);
+                nodelay(screen.log, TRUE);
                 noecho();
                 
                 if (ch == 'j'){
-                    printw("skipping down %d position(s).", pos);
+                    wprintw(screen.log, "skipping down %d position(s).", pos);
                     price_index = pos;
                 }else if (ch == 'k'){
-                    printw("skipping up %d position(s).", pos);
+                    wprintw(screen.log, "skipping up %d position(s).", pos);
                     price_index = pos * -1;
                 }else if (ch == 'l'){
-                    lock_index = pos;
-                    printw("setting price lock at position %d", pos);
+                    ui_post(CMD_SET_LOCK, NULL, 0, 0, pos);
+                    wprintw(screen.log, "setting price lock at position %d", pos);
+                    
+                }
+                
+                if (price_index && openorders.type[0]){ //replace order at the selected price index
+                    fixed_t newprice = 0;
+                    fixed_t newamount = 0;
                     
+                    // adj_price->index_bid_ask contains the whole-dollar price @ selected price index.
+                    book_adjust(&book, openorders.type, openorders.price, adj_price, price_index, lock_index);
+                    cost = cost_of(openorders.price, openorders.amount); //current bid cost
+                    newprice = adj_price->index_bid_ask;
+                    openorders.amount = amount_for(cost, openorders.price);
+                    newamount = amount_for(cost, newprice);
+                    
+                    if ((cost_of(newprice, openorders.amount) > cost) && strcmp(openorders.type, "buy") == 0){
+                        //if total cost of BTC at new target price is greater than what was spent on current bid.
+                        //lower the amount of BTC to be purchased as per available funds (long position).
+                        wprintw(screen.log, "New amount: %f @ %.0f. [Y]/Esc", amount_double(newamount), price_double(newprice));
+                        wrefresh(screen.log);
+                        char confirm;
+                        scanf("%c", &confirm);
+                        if(confirm != '\033'){
+                            ui_post(CMD_REPLACE, NULL, newprice, newamount, 0);
+                        }
+                    }else{
+                        ui_post(CMD_REPLACE, NULL, newprice, openorders.amount, 0);
+                    }
                 }
                 
             }else if (ch == 32){ //if space bar
                 
                 
-                nodelay(stdscr, FALSE);
+                nodelay(screen.log, FALSE);
                 echo();
-                printw("\nNew Price: ");
-                refresh();
-                scanw("%f", &trade_price);
-                nodelay(stdscr, TRUE);
+                wprintw(screen.log, "\nNew Price: ");
+                wrefresh(screen.log);
+                trade_price = scan_price();
+                nodelay(screen.log, TRUE);
                 noecho();
-                refresh();
+                wrefresh(screen.log);
                 
                 
                 ////////////   RETRIEVE PRICE VALUE ENTERED, SET MAX @ < HIGHEST BID, MIN @ > LOWEST ASK  //////////////
@@ -1376,91 +7031,64 @@ int main(void){
                 if (openorders.type[0] && (strcmp(openorders.type, "buy") == 0)){
                     
                     while((trade_price > adj_price->highest_bid)){
-                        nodelay(stdscr, FALSE);
+                        nodelay(screen.log, FALSE);
                         echo();
-                        printw("\nmust be < highest bid (%f)\n", adj_price->highest_bid);
-                        refresh();
-                        scanw("%f", &trade_price);
-                        nodelay(stdscr, TRUE);
+                        wprintw(screen.log, "\nmust be < highest bid (%f)\n", price_double(adj_price->highest_bid));
+                        wrefresh(screen.log);
+                        trade_price = scan_price();
+                        nodelay(screen.log, TRUE);
                         noecho();
-                        refresh();
+                        wrefresh(screen.log);
                     }
                 }else if (openorders.type[0] && (strcmp(openorders.type, "sell") == 0)){
                     
                     while((trade_price < adj_price->lowest_ask)){
-                        nodelay(stdscr, FALSE);
+                        nodelay(screen.log, FALSE);
                         echo();
-                        printw("\nmust be > lowest ask (%f)\n", adj_price->lowest_ask);
-                        refresh();
-                        scanw("%f", &trade_price);
-                        nodelay(stdscr, TRUE);
+                        wprintw(screen.log, "\nmust be > lowest ask (%f)\n", price_double(adj_price->lowest_ask));
+                        wrefresh(screen.log);
+                        trade_price = scan_price();
+                        nodelay(screen.log, TRUE);
                         noecho();
-                        refresh();
+                        wrefresh(screen.log);
                     }
                 }else{
                     
                     
-                    /////////////// GET CURRENT BALANCE /////////////////////////////////////////////////
-                    memset(nonce, 0, strlen(nonce));
-                    memset(request_params, 0, strlen(request_params));
-                    strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-                    a =  (void *)malloc(sizeof(struct authdata));
-                    
-                    create_authdata(a, nonce);
-                    sprintf(request_params, balance_json, a->apikey, a->signature, nonce);
-                    free(a);
-                    response->memory = (void*)malloc(1);
-                    response->size = 0;
-                    Getjson(response, balance_url, request_params);
-                    account_balance_root = json_loads(response->memory, 0, &error);
-                    free(response->memory);
-                    btc_available = atof(json_string_value(json_object_get(json_object_get(account_balance_root, "BTC"), "available")));
-                    usd_available = atof(json_string_value(json_object_get(json_object_get(account_balance_root, "USD"), "available")));
-                    json_decref(account_balance_root);
-                    
-                    //////////////////////////////////////////////////////////////////////////////////////////////////////
-                    
+                    /////////////// CURRENT BALANCE AND HIGHEST BID / LOWEST ASK FROM THE SNAPSHOTS //////////////////
+                    btc_available = orders.btc_available;
+                    usd_available = orders.usd_available;
                     
-                    
-                    
-                    /////////////// GET HIGHEST BID / LOWEST ASK BALANCE ADJUST ENTERED PRICE /////////////////////////////////////////////////
-                    response->memory = (void*)malloc(1);
-                    response->size = 0;
-                    Getjson(response, order_book_top_url, NULL);
-                    orders_top = json_loads(response->memory, 0, &error);
-                    free(response->memory);
-                    
-                    if ((usd_available < 100.0) && (btc_available > .02)){
+                    if ((usd_available < price_units(100)) && (btc_available > to_amount(.02))){
                         newtype = "sell";
                         openorders.amount = btc_available;
-                        double top_ask_price = json_real_value(json_array_get(json_array_get(json_object_get(orders_top, "asks"), 0), 0));
+                        fixed_t top_ask_price = book_price(&book.asks, 0);
                         while(trade_price < top_ask_price){
-                            nodelay(stdscr, FALSE);
+                            nodelay(screen.log, FALSE);
                             echo();
-                            printw("\nmust be > highest ask (%f)\n", top_ask_price);
-                            refresh();
-                            scanw("%f", &trade_price);
-                            nodelay(stdscr, TRUE);
+                            wprintw(screen.log, "\nmust be > highest ask (%f)\n", price_double(top_ask_price));
+                            wrefresh(screen.log);
+                            trade_price = scan_price();
+                            nodelay(screen.log, TRUE);
                             noecho();
-                            refresh();
+                            wrefresh(screen.log);
                         }
                     }else{
                         newtype = "buy";
-                        openorders.amount = (usd_available - (usd_available * .0026)) / trade_price;
-                        double top_bid_price = json_real_value(json_array_get(json_array_get(json_object_get(orders_top, "bids"), 0), 0));
+                        openorders.amount = amount_for(usd_available - fee_of(usd_available), trade_price);
+                        fixed_t top_bid_price = book_price(&book.bids, 0);
                         while(trade_price > top_bid_price){
-                            nodelay(stdscr, FALSE);
+                            nodelay(screen.log, FALSE);
                             echo();
-                            printw("\nmust be < highest bid (%f)\n", top_bid_price);
-                            refresh();
-                            scanw("%f", &trade_price);
-                            nodelay(stdscr, TRUE);
+                            wprintw(screen.log, "\nmust be < highest bid (%f)\n", price_double(top_bid_price));
+                            wrefresh(screen.log);
+                            trade_price = scan_price();
+                            nodelay(screen.log, TRUE);
                             noecho();
-                            refresh();
+                            wrefresh(screen.log);
                         }
                         
                     }
-                    json_decref(orders_top);
                     
                     
                     
@@ -1468,100 +7096,70 @@ int main(void){
                     
                     
                     ////////////// PLACE BUY OR SELL ORDER //////////////////////////////////////////////
-                    
-                    memset(nonce, 0, strlen(nonce));
-                    memset(request_params, 0, strlen(request_params));
-                    strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-                    a =  (void *)malloc(sizeof(struct authdata));
-                    create_authdata(a, nonce);
-                    sprintf(request_params, place_order_json, a->apikey, a->signature, nonce, newtype, (float)openorders.amount, trade_price);
-                    
-                    free(a);
-                    response->memory = (void*)malloc(1);
-                    response->size = 0;
-                    Getjson(response, place_order_url, request_params);
-                    free(response->memory);
+                    ui_post(CMD_PLACE, newtype, trade_price, openorders.amount, 0);
                     /////////////////////////////////////////////////////////////////////////////////
                     
                     
                     
                 }
-                refresh();
+                wrefresh(screen.log);
                 /////////////////////////////////////////////////////////////////////////////
                 
                 
                 
-                double newamount = cost / trade_price;
+                fixed_t newamount = amount_for(cost, trade_price);
                 
                 if(openorders.type[0] && strcmp(openorders.type, "buy") == 0){
-                    cost = openorders.price * openorders.amount; //current bid/ask price * amount
-                    if ((trade_price * openorders.amount) > cost){
-                        printw("New target amount: %f @ %.0f. [Y]/Esc", cost / trade_price, trade_price);
-                        refresh();
+                    cost = cost_of(openorders.price, openorders.amount); //current bid/ask price * amount
+                    if (cost_of(trade_price, openorders.amount) > cost){
+                        wprintw(screen.log, "New target amount: %f @ %.0f. [Y]/Esc", amount_double(amount_for(cost, trade_price)), price_double(trade_price));
+                        wrefresh(screen.log);
                         char confirm;
                         scanf("%c", &confirm);
                         if(confirm != '\033'){
-                            openorders.amount = cost / trade_price;
-                            sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, openorders.amount, trade_price, openorders.order_id);
-                            
-                            free(a);
-                            response->memory = (void*)malloc(1);
-                            response->size = 0;
-                            Getjson(response, replace_url, request_params);
-                            free(response->memory);
+                            ui_post(CMD_REPLACE, NULL, trade_price, amount_for(cost, trade_price), 0);
                         }
                     }else{
-                        sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, newamount, trade_price, openorders.order_id);
-                        
-                        free(a);
-                        response->memory = (void*)malloc(1);
-                        response->size = 0;
-                        Getjson(response, replace_url, request_params);
-                        free(response->memory);
+                        ui_post(CMD_REPLACE, NULL, trade_price, newamount, 0);
                     }
                     
                 }else if(openorders.type[0] && strcmp(openorders.type, "sell") == 0 ){
-                    memset(nonce, 0, strlen(nonce));
-                    memset(request_params, 0, strlen(request_params));
-                    strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-                    a =  (void *)malloc(sizeof(struct authdata));
-                    
-                    create_authdata(a, nonce);
-                    printw("New %s order @ %.2f...\n", openorders.type, trade_price);
-                    refresh();
-                    sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, (float)openorders.amount, trade_price, openorders.order_id);
-                    
-                    free(a);
-                    response->memory = (void*)malloc(1);
-                    response->size = 0;
-                    Getjson(response, replace_url, request_params);
-                    free(response->memory);
+                    wprintw(screen.log, "New %s order @ %.2f...\n", openorders.type, price_double(trade_price));
+                    wrefresh(screen.log);
+                    ui_post(CMD_REPLACE, NULL, trade_price, openorders.amount, 0);
                     
                 }else{ //no type (no existing order)
-                    ;//printw("PLACE SELL/BUY ORDER CODE HERE");;
+                    ;//wprintw(screen.log, "PLACE SELL/BUY ORDER CODE HERE");;
                 }
+            }else if(ch == 'm' && nshards > 1){
+                current = (current + 1) % nshards;
+                shard_enter(&shards[current]);
+                wprintw(screen.log, "\n%s %s/%s\n", market->exchange->title, market->symbol1, market->symbol2);
+                render_invalidate(&screen);
+                shown_md = shown_orders = 0;
+                snapshot_read(&shard->md.seq, md, &shard->md.state, sizeof(struct md_state));
+                range_breaks[current] = md->range_breaks;   /* breaks of before are not news */
             }else if(ch == 104){
                 
                 const char *mode = "view";
-                if(getch() == 104){
+                if(wgetch(screen.log) == 104){
                     mode = "update";
                 }
                 
                 
                 
                 
-                ARCHIVE_DBS *archivedbs = malloc(sizeof(ARCHIVE_DBS));
-                initialize_archivedbs(archivedbs);
-                set_db_filenames(archivedbs);
-                databases_setup(archivedbs, "ctrader", NULL);
+                // the history takes the whole screen for a moment, the panes are redrawn after
+                erase();
+                pthread_mutex_lock(&archive_lock);
+                ARCHIVE_DBS *archivedbs = &shard->archive;
                 // VIEW TRADE HISTORY
                 memset(nonce, 0, strlen(nonce));
                 memset(request_params, 0, strlen(request_params));
                 memset(timestamp, 0, strlen(timestamp));
                 
                 get_trades(archivedbs, nonce, request_params, timestamp, a, mode, "d",0);
-                databases_close(archivedbs);
-                free(archivedbs);
+                pthread_mutex_unlock(&archive_lock);
                 char contchar;
                 nodelay(stdscr, FALSE);
                 echo();
@@ -1569,150 +7167,38 @@ int main(void){
                 scanw("%c", &contchar);
                 nodelay(stdscr, TRUE);
                 noecho();
+                render_invalidate(&screen);
+                shown_md = 0;
             }else{
                 ;
-                //printw("\nHit space to change/place order.\n");
+                //wprintw(screen.log, "\nHit space to change/place order.\n");
             }
-            refresh();
+            wrefresh(screen.log);
             
-        } else { // if not kbhit(), just show order book
+        } else if (md->version != shown_md || orders.version != shown_orders) { // no key, redraw if a snapshot moved on
             
             
             
             
             ///////////////  SHOW ORDER BOOK ///////////////////////////////////////////////
-            response->memory = (void*)malloc(1);
-            response->size = 0;
-            Getjson(response, order_book_url, NULL);
-            orders = json_loads(response->memory, 0, &error);
-            free(response->memory);
-            show_order_book(orders, openorders.type, openorders.amount, openorders.price, adj_price, price_index, lock_index, low, high, lastprice, last_trade);
-            json_decref(orders);
+            show_order_book(&book, openorders.type, openorders.amount, openorders.price, adj_price, lock_index, md->low, md->high, md->lastprice, shard->last_trade);
             ///////////////  END SHOW ORDER BOOK ///////////////////////////////////////////////
             
-            
-            
-            if (price_index){ //replace order if there was index selected (0-9 then j or k);
-                double newprice = 0.0;
-                double newamount = 0.0;
-                memset(nonce, 0, strlen(nonce));
-                memset(request_params, 0, strlen(request_params));
-                strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-                a =  (void *)malloc(sizeof(struct authdata));
-                create_authdata(a, nonce);
-                
-                cost = openorders.price * openorders.amount ; //current bid cost
-                newprice = (int)adj_price->index_bid_ask; //adj_price->index_bid_ask contains the price @ selected price index.
-                openorders.amount = cost / openorders.price;
-                newamount = cost / newprice;
-                
-                if (((newprice * openorders.amount) > cost) && strcmp(openorders.type, "buy") == 0){
-                    //if total cost of BTC at new target price is greater than what was spent on current bid.
-                    //lower the amount of BTC to be purchased as per available funds (long position).
-                    printw("New amount: %f @ %.0f. [Y]/Esc", newamount, newprice);
-                    refresh();
-                    char confirm;
-                    scanf("%c", &confirm);
-                    if(confirm != '\033'){
-                        sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, newamount, newprice, openorders.order_id);
-                        
-                        free(a);
-                        response->memory = (void*)malloc(1);
-                        response->size = 0;
-                        Getjson(response, replace_url, request_params);
-                        free(response->memory);
-                    }
-                }else{
-                    sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, openorders.amount, newprice, openorders.order_id);
-                    
-                    free(a);
-                    response->memory = (void*)malloc(1);
-                    response->size = 0;
-                    Getjson(response, replace_url, request_params);
-                    free(response->memory);
-                }
-            }
-            
-            if(lock_index){
-                memset(nonce, 0, strlen(nonce));
-                memset(request_params, 0, strlen(request_params));
-                strcpy(nonce, itoa((unsigned long)time(NULL)+300, timestamp) );
-                a =  (void *)malloc(sizeof(struct authdata));
-                create_authdata(a, nonce);
-                cost = openorders.price * openorders.amount ; //current bid cost
-                
-                
-                if(openorders.type[0] && strcmp(openorders.type, "buy") == 0){
-                    while(openorders.price >= adj_price->lock_bid_ask){
-                        kickcount++;
-                        beep();
-                        flash();
-                        if(kickcount==4 && lock_index <= 5){
-                            lock_index++;
-                            kickcount = 0;
-                        }
-                        openorders.price = adj_price->lock_bid_ask - 2.0;
-                        openorders.amount = cost / openorders.price;
-                        printw("adjusting buy price.. (%f @ %f)\n", openorders.price, openorders.amount);
-                        refresh();
-                        sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, (float)openorders.amount, openorders.price, openorders.order_id);
-                        response->memory = (void*)malloc(1);
-                        response->size = 0;
-                        Getjson(response, replace_url, request_params);
-                        free(response->memory);
-                        
-                        
-                    }
-                }else if(openorders.type[0] && strcmp(openorders.type, "sell") == 0){
-                    while(openorders.price <= adj_price->lock_bid_ask){
-                        beep();
-                        flash();
-                        kickcount++;
-                        if(kickcount==4 && lock_index <= 5){
-                            lock_index++;
-                            kickcount = 0;
-                        }
-                        openorders.price = adj_price->lock_bid_ask + 2.0;
-                        printw("adjusting sell price.. (%f @ %f)\n", openorders.price, openorders.amount);
-                        refresh();
-                        sprintf(request_params, replace_json, a->apikey, a->signature, nonce, openorders.type, openorders.amount, openorders.price, openorders.order_id);
-                        response->memory = (void*)malloc(1);
-                        Getjson(response, replace_url, request_params);
-                        free(response->memory);
-                    }
-                }
-                free(a);
-            }
-            
-            price_index=0;
-            memset(openorders.type, 0, strlen(openorders.type));
-            memset(nonce, 0, strlen(nonce));
-            refresh();
+            shown_md = md->version;
+            shown_orders = orders.version;
+            wrefresh(screen.log);
             
         }
-        free(response);
-        curl_global_cleanup();
         //free(adj_price);
-        if(replace_json != NULL)
-            free(replace_json);
-        if(replace_url != NULL)
-            free(replace_url);
-        if(cancel_json != NULL)
-            free(cancel_json);
-        if(cancel_url != NULL)
-            free(cancel_url);
-        if(open_order_json != NULL)
-            free(open_order_json);
-        if(open_order_url != NULL)
-            free(open_order_url);
-        if(order_book_url != NULL)
-            free(order_book_url);
-        if(order_book_top_url != NULL)
-            free(order_book_top_url);
-        
-        
     }
     
+    threads_stop();
+    recorder_stop();
+    trace_stop();
+    archive_close();
+    free(md);
+    transport_thread_cleanup();
+    transport_cleanup();
     return 0;
     
     
@@ -0,0 +1,773 @@
+/*
+ //  mockcex.c
+ //  ctrader
+ //  Local stand-in for CEX.io. Replays recorded websocket frames so the streaming
+ //  order book in ctrader can be exercised without the exchange, and serves the REST
+ //  API from a simulated market with a matching engine for the account's orders.
+ //
+ //      mockcex [-f frames.txt] [-p port] [-s speed] [-H http_port] [-l latency_ms]
+ //              [-j jitter_ms] [-S seed] [-P start_price] [-U usd] [-B btc]
+ //      ctrader -u http://127.0.0.1:8090/api -w ws://127.0.0.1:8089/
+ //
+ //  frames.txt holds one recorded message per line, prefixed with the time in ms
+ //  since the recording started:  "1520 {"e":"md_update","data":{...}}"
+ //  Lines starting with '#' are skipped. Without -f only the REST API is served.
+ //
+ //  REST: ticker, last_prices, order_book, open_orders, balance, place_order,
+ //  cancel_order, cancel_replace_order and archived_orders, any pair. The market
+ //  price random-walks with the clock; a resting order fills, whole, once the
+ //  book moves through its price, and fills pay the 0.26% fee. Every response is
+ //  held back latency_ms plus a uniform 0..jitter_ms.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#define DEFAULT_PORT 8089
+#define DEFAULT_HTTP_PORT 8090
+#define BOOK_LEVELS 50
+#define MAX_ORDERS 64
+#define MAX_FILLS 4096
+#define FEE_PPM 2600
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+/*****************************  STRUCTURES *****************************************/
+
+
+struct frame {
+    long offset_ms;     /* when it was received, relative to the first frame */
+    char *message;
+};
+
+
+typedef struct replay {
+    struct frame *frames;
+    long nframes;
+    long next;          /* next frame to send */
+    long started_ms;    /* clock at which frame 0 was (re)played, -1 before subscribe */
+    double speed;       /* 2 = twice as fast, 0 = as fast as the socket allows */
+} REPLAY;
+
+
+struct mock_order {
+    long id;
+    char type[5];               /* "buy" or "sell" */
+    char symbol1[8], symbol2[8];
+    double price;
+    double amount;
+    long placed_ms;             /* wall clock */
+};
+
+
+struct mock_fill {
+    struct mock_order order;
+    long done_ms;               /* lastTxTime */
+    double cost;                /* price * amount */
+    double fee;
+};
+
+
+// One account on one simulated market: the price random-walks with the clock and the
+// book is drawn around it, so every request sees a book consistent with the last one.
+typedef struct mock_exchange {
+    pthread_mutex_t lock;
+    unsigned seed;
+    double mid;
+    double tick;                /* level spacing */
+    long book_id;
+    long walked_ms;             /* clock the price walked up to */
+    double low, high;           /* since start */
+    double usd, btc;            /* available */
+    struct mock_order orders[MAX_ORDERS];
+    int norders;
+    struct mock_fill fills[MAX_FILLS];  /* oldest first, the oldest go when it is full */
+    int nfills;
+    long next_id;
+    int latency_ms, jitter_ms;
+} MOCK_EXCHANGE;
+
+/***************************** END STRUCTURES *****************************************/
+
+
+
+/*****************************  FUNCTION PROTOTYPES ****************************/
+int load_frames(REPLAY *replay, const char *file_name);
+int ws_handshake(int fd);
+int ws_send(int fd, int opcode, const char *payload, size_t len);
+long ws_recv(int fd, int *opcode, char *payload, size_t len);
+void serve_client(int fd, REPLAY *replay);
+long now_ms(void);
+long wall_ms(void);
+void *ws_server(void *arg);
+void mock_walk(MOCK_EXCHANGE *ex);
+void mock_match(MOCK_EXCHANGE *ex);
+int json_param(const char *body, const char *key, char *value, size_t size);
+size_t mock_route(MOCK_EXCHANGE *ex, const char *path, const char *body, char *out, size_t size);
+void *http_client(void *arg);
+/***************************** END FUNCTION PROTOTYPES *************************/
+
+
+
+/***************************** GLOBAL VARIABLES ********************************/
+
+MOCK_EXCHANGE exchange;
+int ws_sock = -1;
+
+/***************************** END GLOBAL VARIABLES ****************************/
+
+
+
+/***************************** FUNCTION DEFINITION *****************************/
+
+long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long wall_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*------------------------------- load_frames  ------------------------------------*/
+
+int load_frames(REPLAY *replay, const char *file_name){
+
+    FILE *fp = fopen(file_name, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    long alloc = 0;
+
+    if(fp == NULL){
+        perror(file_name);
+        return -1;
+    }
+
+    while((len = getline(&line, &cap, fp)) != -1){
+        char *message;
+        long offset;
+
+        if(line[0] == '#' || len < 3)
+            continue;
+        while(len && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = 0;
+        offset = strtol(line, &message, 10);
+        while(*message == ' ' || *message == '\t')
+            message++;
+        if(*message == 0)
+            continue;
+
+        if(replay->nframes == alloc){
+            alloc = alloc ? alloc * 2 : 256;
+            replay->frames = realloc(replay->frames, sizeof(struct frame) * alloc);
+        }
+        replay->frames[replay->nframes].offset_ms = offset;
+        replay->frames[replay->nframes].message = strdup(message);
+        replay->nframes++;
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+/*------------------------------- end load_frames ---------------------------------*/
+
+
+/*------------------------------- websocket  ------------------------------------*/
+
+int ws_handshake(int fd){
+
+    char request[4096], response[512], accept_src[128];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    unsigned char accept[64];
+    size_t used = 0;
+    char *key, *end;
+
+    // read the upgrade request headers
+    while(used < sizeof(request) - 1){
+        ssize_t n = recv(fd, request + used, sizeof(request) - 1 - used, 0);
+        if(n <= 0)
+            return -1;
+        used += n;
+        request[used] = 0;
+        if(strstr(request, "\r\n\r\n"))
+            break;
+    }
+
+    key = strcasestr(request, "Sec-WebSocket-Key:");
+    if(key == NULL)
+        return -1;
+    key += strlen("Sec-WebSocket-Key:");
+    while(*key == ' ')
+        key++;
+    end = strstr(key, "\r\n");
+    if(end == NULL || end - key > 64)
+        return -1;
+
+    snprintf(accept_src, sizeof(accept_src), "%.*s%s", (int)(end - key), key, WS_GUID);
+    SHA1((unsigned char *)accept_src, strlen(accept_src), digest);
+    EVP_EncodeBlock(accept, digest, SHA_DIGEST_LENGTH);
+
+    snprintf(response, sizeof(response),
+             "HTTP/1.1 101 Switching Protocols\r\n"
+             "Upgrade: websocket\r\n"
+             "Connection: Upgrade\r\n"
+             "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    return send(fd, response, strlen(response), 0) == (ssize_t)strlen(response) ? 0 : -1;
+}
+
+// server frames go out unmasked in a single fragment
+int ws_send(int fd, int opcode, const char *payload, size_t len){
+
+    unsigned char header[10];
+    size_t hlen = 2;
+
+    header[0] = 0x80 | (opcode & 0x0f);
+    if(len < 126){
+        header[1] = len;
+    }else if(len < 65536){
+        header[1] = 126;
+        header[2] = len >> 8;
+        header[3] = len;
+        hlen = 4;
+    }else{
+        header[1] = 127;
+        for(int i = 0; i < 8; i++)
+            header[2+i] = (unsigned char)((unsigned long long)len >> (56 - 8*i));
+        hlen = 10;
+    }
+    if(send(fd, header, hlen, MSG_NOSIGNAL) != (ssize_t)hlen)
+        return -1;
+    if(len && send(fd, payload, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+static int recv_all(int fd, void *buffer, size_t len){
+    size_t got = 0;
+    while(got < len){
+        ssize_t n = recv(fd, (char *)buffer + got, len - got, 0);
+        if(n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// read one client frame and unmask it, returns payload length or -1
+long ws_recv(int fd, int *opcode, char *payload, size_t len){
+
+    unsigned char header[2], ext[8], mask[4];
+    unsigned long long plen;
+
+    if(recv_all(fd, header, 2) < 0)
+        return -1;
+    *opcode = header[0] & 0x0f;
+    plen = header[1] & 0x7f;
+    if(plen == 126){
+        if(recv_all(fd, ext, 2) < 0)
+            return -1;
+        plen = (ext[0] << 8) | ext[1];
+    }else if(plen == 127){
+        if(recv_all(fd, ext, 8) < 0)
+            return -1;
+        plen = 0;
+        for(int i = 0; i < 8; i++)
+            plen = (plen << 8) | ext[i];
+    }
+    if(plen >= len)
+        return -1;
+    if((header[1] & 0x80) && recv_all(fd, mask, 4) < 0)
+        return -1;
+    if(recv_all(fd, payload, plen) < 0)
+        return -1;
+    if(header[1] & 0x80){
+        for(unsigned long long i = 0; i < plen; i++)
+            payload[i] ^= mask[i % 4];
+    }
+    payload[plen] = 0;
+    return (long)plen;
+}
+/*------------------------------- end websocket ---------------------------------*/
+
+
+/*------------------------------- serve_client  ------------------------------------*/
+// Behaves like ws.cex.io as far as ctrader cares: "connected" on open, "ok" for auth,
+// recorded frames from the first order-book-subscribe on. A second subscribe (the
+// client resyncing after a sequence gap) skips ahead to the next recorded snapshot.
+
+void serve_client(int fd, REPLAY *replay){
+
+    char payload[65536];
+    int opcode;
+    long n;
+
+    if(ws_handshake(fd) < 0)
+        return;
+    ws_send(fd, 1, "{\"e\":\"connected\"}", strlen("{\"e\":\"connected\"}"));
+    replay->next = 0;
+    replay->started_ms = -1;
+
+    for(;;){
+        int timeout = -1;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        if(replay->started_ms >= 0 && replay->next < replay->nframes){
+            long due = replay->started_ms;
+            if(replay->speed > 0)
+                due += (long)((replay->frames[replay->next].offset_ms - replay->frames[0].offset_ms) / replay->speed);
+            timeout = due > now_ms() ? (int)(due - now_ms()) : 0;
+        }
+
+        if(poll(&pfd, 1, timeout) < 0)
+            return;
+
+        if(pfd.revents & (POLLIN | POLLHUP | POLLERR)){
+            n = ws_recv(fd, &opcode, payload, sizeof(payload));
+            if(n < 0 || opcode == 8)
+                return;
+            if(opcode == 9){
+                ws_send(fd, 10, payload, n);
+            }else if(opcode == 1){
+                if(strstr(payload, "\"auth\"")){
+                    const char *ok = "{\"e\":\"auth\",\"data\":{\"ok\":\"ok\"},\"ok\":\"ok\"}";
+                    ws_send(fd, 1, ok, strlen(ok));
+                }else if(strstr(payload, "\"order-book-subscribe\"")){
+                    if(replay->started_ms < 0){
+                        replay->started_ms = now_ms();
+                    }else{
+                        while(replay->next < replay->nframes && !strstr(replay->frames[replay->next].message, "\"order-book-subscribe\""))
+                            replay->next++;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // send everything that is due
+        while(replay->started_ms >= 0 && replay->next < replay->nframes){
+            long due = replay->started_ms;
+            if(replay->speed > 0)
+                due += (long)((replay->frames[replay->next].offset_ms - replay->frames[0].offset_ms) / replay->speed);
+            if(due > now_ms())
+                break;
+            if(ws_send(fd, 1, replay->frames[replay->next].message, strlen(replay->frames[replay->next].message)) < 0)
+                return;
+            replay->next++;
+        }
+    }
+}
+/*------------------------------- end serve_client ---------------------------------*/
+
+
+/*------------------------------- exchange  ------------------------------------*/
+// Everything below runs under exchange.lock.
+
+static double mock_random(MOCK_EXCHANGE *ex){
+    return (double)rand_r(&ex->seed) / RAND_MAX;
+}
+
+// a step of up to 0.1% every 100ms since the last request
+void mock_walk(MOCK_EXCHANGE *ex){
+    long now = now_ms();
+    if(ex->walked_ms == 0)
+        ex->walked_ms = now;
+    for(; ex->walked_ms + 100 <= now; ex->walked_ms += 100){
+        ex->mid *= 1 + (mock_random(ex) - 0.5) * 0.002;
+        ex->mid = floor(ex->mid / ex->tick + 0.5) * ex->tick;
+        ex->low = ex->mid < ex->low || ex->low == 0 ? ex->mid : ex->low;
+        ex->high = ex->mid > ex->high ? ex->mid : ex->high;
+        ex->book_id++;
+    }
+    mock_match(ex);
+}
+
+// the account's orders the market went through fill at their own price
+void mock_match(MOCK_EXCHANGE *ex){
+    double best_bid = ex->mid - ex->tick, best_ask = ex->mid + ex->tick;
+    for(int i = 0; i < ex->norders; ){
+        struct mock_order *o = &ex->orders[i];
+        int buy = strcmp(o->type, "buy") == 0;
+        if(buy ? o->price < best_ask : o->price > best_bid){
+            i++;
+            continue;
+        }
+        if(ex->nfills == MAX_FILLS){
+            memmove(&ex->fills[0], &ex->fills[1], sizeof(struct mock_fill) * (MAX_FILLS - 1));
+            ex->nfills--;
+        }
+        struct mock_fill *f = &ex->fills[ex->nfills++];
+        f->order = *o;
+        f->done_ms = wall_ms();
+        f->cost = o->price * o->amount;
+        f->fee = f->cost * FEE_PPM / 1e6;
+        if(buy){
+            ex->btc += o->amount;
+            ex->usd -= f->fee;         /* the cost was held when the order was placed */
+        }else{
+            ex->usd += f->cost - f->fee;
+        }
+        ex->orders[i] = ex->orders[--ex->norders];
+    }
+}
+
+static int mock_place(MOCK_EXCHANGE *ex, const char *type, double amount, double price, const char *s1, const char *s2){
+    int buy = strcmp(type, "buy") == 0;
+    if((!buy && strcmp(type, "sell") != 0) || amount <= 0 || price <= 0 || ex->norders == MAX_ORDERS)
+        return -1;
+    if(buy ? ex->usd < amount * price : ex->btc < amount)
+        return -1;
+    // a crossing order takes the touch, a buy gets back what it held above it
+    if(buy && price >= ex->mid + ex->tick){
+        price = ex->mid + ex->tick;
+    }else if(!buy && price <= ex->mid - ex->tick){
+        price = ex->mid - ex->tick;
+    }
+    if(buy)
+        ex->usd -= amount * price;
+    else
+        ex->btc -= amount;
+    struct mock_order *o = &ex->orders[ex->norders++];
+    memset(o, 0, sizeof(*o));
+    o->id = ex->next_id++;
+    snprintf(o->type, sizeof(o->type), "%s", type);
+    snprintf(o->symbol1, sizeof(o->symbol1), "%s", s1);
+    snprintf(o->symbol2, sizeof(o->symbol2), "%s", s2);
+    o->price = price;
+    o->amount = amount;
+    o->placed_ms = wall_ms();
+    mock_match(ex);     /* a crossing order fills right away */
+    return ex->norders && ex->orders[ex->norders - 1].id == o->id ? ex->norders - 1 : -2;
+}
+
+static int mock_cancel(MOCK_EXCHANGE *ex, long id){
+    for(int i = 0; i < ex->norders; i++){
+        struct mock_order *o = &ex->orders[i];
+        if(o->id != id)
+            continue;
+        if(strcmp(o->type, "buy") == 0)
+            ex->usd += o->amount * o->price;
+        else
+            ex->btc += o->amount;
+        ex->orders[i] = ex->orders[--ex->norders];
+        return 0;
+    }
+    return -1;
+}
+
+// "key":"value" or "key":value of a flat json object, 0 if it is there
+int json_param(const char *body, const char *key, char *value, size_t size){
+    char pattern[64];
+    const char *at;
+    size_t len = 0;
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if(body == NULL || (at = strstr(body, pattern)) == NULL)
+        return -1;
+    at += strlen(pattern);
+    while(*at == ' ' || *at == ':')
+        at++;
+    if(*at == '"')
+        at++;
+    while(at[len] && at[len] != '"' && at[len] != ',' && at[len] != '}' && len < size - 1)
+        len++;
+    memcpy(value, at, len);
+    value[len] = 0;
+    return 0;
+}
+
+static void iso_time(long ms, char *out, size_t size){
+    time_t seconds = ms / 1000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    snprintf(out, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ms % 1000);
+}
+
+static size_t mock_book(MOCK_EXCHANGE *ex, int depth, const char *s1, const char *s2, char *out, size_t size){
+    size_t n = snprintf(out, size, "{\"timestamp\":%ld,\"bids\":[", wall_ms() / 1000);
+    for(int side = 0; side < 2; side++){
+        for(int i = 0; i < depth && n < size; i++){
+            double price = side == 0 ? ex->mid - (i + 1) * ex->tick : ex->mid + (i + 1) * ex->tick;
+            double amount = 0.01 + (double)((ex->book_id * 7 + i * 13 + side) % 97) / 50;
+            for(int o = 0; o < ex->norders; o++)   /* the account's orders are in the book too */
+                if(fabs(ex->orders[o].price - price) < ex->tick / 2 && (strcmp(ex->orders[o].type, "buy") == 0) == (side == 0))
+                    amount += ex->orders[o].amount;
+            n += snprintf(out + n, size - n, "%s[%.2f,%.8f]", i ? "," : "", price, amount);
+        }
+        if(n < size)
+            n += snprintf(out + n, size - n, side == 0 ? "],\"asks\":[" : "],\"pair\":\"%s:%s\",\"id\":%ld}", s1, s2, ex->book_id);
+    }
+    return n;
+}
+
+// the answer to one request, path after the host, e.g. /api/ticker/BTC/USD/
+size_t mock_route(MOCK_EXCHANGE *ex, const char *path, const char *body, char *out, size_t size){
+    char route[32] = "", s1[8] = "BTC", s2[8] = "USD", value[64], time_text[80];
+    const char *api = strstr(path, "/api/");
+    size_t n = 0;
+    
+    sscanf(api ? api + 5 : path + 1, "%31[^/?]/%7[^/?]/%7[^/?]", route, s1, s2);
+    mock_walk(ex);
+    
+    if(strcmp(route, "ticker") == 0){
+        n = snprintf(out, size, "{\"timestamp\":\"%ld\",\"low\":\"%.2f\",\"high\":\"%.2f\",\"last\":\"%.2f\",\"volume\":\"100.0\",\"bid\":%.2f,\"ask\":%.2f}",
+                     wall_ms() / 1000, ex->low, ex->high, ex->mid, ex->mid - ex->tick, ex->mid + ex->tick);
+    }else if(strcmp(route, "last_prices") == 0){
+        n = snprintf(out, size, "{\"e\":\"last_prices\",\"ok\":\"ok\",\"data\":[{\"symbol1\":\"%s\",\"symbol2\":\"%s\",\"lprice\":\"%.2f\"}]}", s1, s2, ex->mid);
+    }else if(strcmp(route, "order_book") == 0){
+        n = mock_book(ex, strstr(path, "depth=1") ? 1 : BOOK_LEVELS, s1, s2, out, size);
+    }else if(strcmp(route, "open_orders") == 0){
+        n = snprintf(out, size, "[");
+        for(int i = 0; i < ex->norders && n < size; i++){
+            struct mock_order *o = &ex->orders[i];
+            n += snprintf(out + n, size - n, "%s{\"id\":\"%ld\",\"time\":\"%ld\",\"type\":\"%s\",\"price\":\"%.2f\",\"amount\":\"%.8f\",\"pending\":\"%.8f\",\"symbol1\":\"%s\",\"symbol2\":\"%s\"}",
+                          i ? "," : "", o->id, o->placed_ms, o->type, o->price, o->amount, o->amount, o->symbol1, o->symbol2);
+        }
+        if(n < size)
+            n += snprintf(out + n, size - n, "]");
+    }else if(strcmp(route, "balance") == 0){
+        n = snprintf(out, size, "{\"timestamp\":\"%ld\",\"username\":\"mock\",\"BTC\":{\"available\":\"%.8f\",\"orders\":\"0.00000000\"},\"USD\":{\"available\":\"%.2f\",\"orders\":\"0.00\"}}",
+                     wall_ms() / 1000, ex->btc, ex->usd);
+    }else if(strcmp(route, "place_order") == 0 || strcmp(route, "cancel_replace_order") == 0){
+        char type[8] = "", amount[32] = "0", price[32] = "0";
+        int placed;
+        json_param(body, "type", type, sizeof(type));
+        json_param(body, "amount", amount, sizeof(amount));
+        json_param(body, "price", price, sizeof(price));
+        if(route[0] == 'c' && (json_param(body, "order_id", value, sizeof(value)) != 0 || mock_cancel(ex, atol(value)) != 0))
+            return snprintf(out, size, "{\"error\":\"Order not found\"}");
+        placed = mock_place(ex, type, atof(amount), atof(price), s1, s2);
+        if(placed == -1)
+            return snprintf(out, size, "{\"error\":\"Error: Place order error: Insufficient funds.\"}");
+        n = snprintf(out, size, "{\"complete\":%s,\"id\":\"%ld\",\"time\":%ld,\"pending\":\"%s\",\"amount\":\"%s\",\"type\":\"%s\",\"price\":\"%s\"}",
+                     placed == -2 ? "true" : "false", ex->next_id - 1, wall_ms(), placed == -2 ? "0.00000000" : amount, amount, type, price);
+    }else if(strcmp(route, "cancel_order") == 0){
+        json_param(body, "id", value, sizeof(value));
+        n = snprintf(out, size, "%s", mock_cancel(ex, atol(value)) == 0 ? "true" : "{\"error\":\"Order not found\"}");
+    }else if(strcmp(route, "archived_orders") == 0){
+        // newest first, lastTxDateFrom/To inclusive, only done orders
+        char from[32] = "", to[32] = "", status[8] = "d", limit[16] = "100";
+        int max, count = 0;
+        json_param(body, "lastTxDateFrom", from, sizeof(from));
+        json_param(body, "lastTxDateTo", to, sizeof(to));
+        json_param(body, "status", status, sizeof(status));
+        json_param(body, "limit", limit, sizeof(limit));
+        max = atoi(limit) > 0 ? atoi(limit) : 100;
+        n = snprintf(out, size, "[");
+        for(int i = ex->nfills - 1; i >= 0 && count < max && n < size && strcmp(status, "d") == 0; i--){
+            struct mock_fill *f = &ex->fills[i];
+            iso_time(f->done_ms, time_text, sizeof(time_text));
+            if((from[0] && strcmp(time_text, from) < 0) || (to[0] && strcmp(time_text, to) > 0))
+                continue;
+            if(strcmp(f->order.symbol1, s1) != 0 || strcmp(f->order.symbol2, s2) != 0)
+                continue;
+            n += snprintf(out + n, size - n, "%s{\"id\":\"%ld\",\"orderId\":\"%ld\",\"type\":\"%s\",\"time\":\"%s\",\"lastTxTime\":\"%s\",\"symbol1\":\"%s\",\"symbol2\":\"%s\","
+                          "\"amount\":\"%.8f\",\"price\":\"%.2f\",\"status\":\"d\",\"ta:%s\":\"%.2f\",\"fa:%s\":\"%.2f\"}",
+                          count ? "," : "", f->order.id, f->order.id, f->order.type, time_text, time_text, s1, s2,
+                          f->order.amount, f->order.price, s2, f->cost, s2, f->fee);
+            count++;
+        }
+        if(n < size)
+            n += snprintf(out + n, size - n, "]");
+    }else{
+        n = snprintf(out, size, "{\"error\":\"unknown method %s\"}", route);
+    }
+    return n < size ? n : size - 1;
+}
+/*------------------------------- end exchange ---------------------------------*/
+
+
+/*------------------------------- http  ------------------------------------*/
+// HTTP/1.1 with keep-alive, a thread per connection. Only what libcurl sends.
+
+void *http_client(void *arg){
+    int fd = (int)(long)arg;
+    static const size_t cap = 1 << 16;
+    char *request = malloc(cap), *response = malloc(1 << 20), header[256];
+    size_t used = 0;
+    
+    for(;;){
+        char *end, *length, *body, path[256] = "/";
+        size_t head, content = 0, n;
+        int delay;
+        
+        while((end = memmem(request, used, "\r\n\r\n", 4)) == NULL){
+            ssize_t got = used < cap - 1 ? recv(fd, request + used, cap - 1 - used, 0) : -1;
+            if(got <= 0)
+                goto done;
+            used += got;
+        }
+        head = end + 4 - request;
+        request[head - 1] = 0;
+        length = strcasestr(request, "Content-Length:");
+        if(length)
+            content = strtoul(length + strlen("Content-Length:"), NULL, 10);
+        if(head + content >= cap)
+            goto done;
+        while(used < head + content){
+            ssize_t got = recv(fd, request + used, cap - 1 - used, 0);
+            if(got <= 0)
+                goto done;
+            used += got;
+        }
+        body = request + head;
+        sscanf(request, "%*s %255s", path);
+        char saved = body[content];
+        body[content] = 0;
+        
+        pthread_mutex_lock(&exchange.lock);
+        delay = exchange.latency_ms + (exchange.jitter_ms ? rand_r(&exchange.seed) % (exchange.jitter_ms + 1) : 0);
+        n = mock_route(&exchange, path, content ? body : NULL, response, 1 << 20);
+        pthread_mutex_unlock(&exchange.lock);
+        body[content] = saved;
+        
+        if(delay)
+            usleep(delay * 1000);
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", n);
+        if(send(fd, header, strlen(header), MSG_NOSIGNAL) < 0 || send(fd, response, n, MSG_NOSIGNAL) < 0)
+            goto done;
+        memmove(request, request + head + content, used - head - content);
+        used -= head + content;
+    }
+done:
+    free(request);
+    free(response);
+    close(fd);
+    return NULL;
+}
+/*------------------------------- end http ---------------------------------*/
+
+
+/*----------------------------------- main --------------------------------------*/
+
+// replays to one websocket client at a time
+void *ws_server(void *arg){
+    REPLAY *replay = (REPLAY *)arg;
+    int one = 1;
+    for(;;){
+        int fd = accept(ws_sock, NULL, NULL);
+        if(fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        serve_client(fd, replay);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int listen_on(int port){
+    struct sockaddr_in addr;
+    int one = 1, sock = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char *argv[]){
+
+    REPLAY replay;
+    const char *frames_file = NULL;
+    int port = DEFAULT_PORT, http_port = DEFAULT_HTTP_PORT;
+    int opt, one = 1, http_sock;
+    pthread_t tid;
+
+    memset(&replay, 0, sizeof(REPLAY));
+    replay.speed = 1.0;
+    memset(&exchange, 0, sizeof(MOCK_EXCHANGE));
+    pthread_mutex_init(&exchange.lock, NULL);
+    exchange.seed = 1;
+    exchange.mid = 7000;
+    exchange.tick = 0.1;
+    exchange.usd = 1000;
+    exchange.next_id = 1000000;
+
+    while((opt = getopt(argc, argv, "f:p:s:H:l:j:S:P:U:B:")) != -1){
+        switch(opt){
+            case 'f':
+                frames_file = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                replay.speed = atof(optarg);
+                break;
+            case 'H':
+                http_port = atoi(optarg);
+                break;
+            case 'l':
+                exchange.latency_ms = atoi(optarg);
+                break;
+            case 'j':
+                exchange.jitter_ms = atoi(optarg);
+                break;
+            case 'S':
+                exchange.seed = (unsigned)atoi(optarg);
+                break;
+            case 'P':
+                exchange.mid = atof(optarg);
+                break;
+            case 'U':
+                exchange.usd = atof(optarg);
+                break;
+            case 'B':
+                exchange.btc = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f frames.txt] [-p port] [-s speed] [-H http_port] [-l latency_ms] [-j jitter_ms] [-S seed] [-P price] [-U usd] [-B btc]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(frames_file && load_frames(&replay, frames_file) < 0)
+        return 1;
+    exchange.low = exchange.high = exchange.mid;
+
+    if(frames_file){
+        if((ws_sock = listen_on(port)) < 0){
+            perror("mockcex");
+            return 1;
+        }
+        printf("mockcex: %ld frames, listening on ws://127.0.0.1:%d/\n", replay.nframes, port);
+        pthread_create(&tid, NULL, ws_server, &replay);
+    }
+    if((http_sock = listen_on(http_port)) < 0){
+        perror("mockcex");
+        return 1;
+    }
+    printf("mockcex: REST on http://127.0.0.1:%d/api, latency %d+%dms\n", http_port, exchange.latency_ms, exchange.jitter_ms);
+    fflush(stdout);
+
+    for(;;){
+        int fd = accept(http_sock, NULL, NULL);
+        if(fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(pthread_create(&tid, NULL, http_client, (void *)(long)fd) != 0)
+            close(fd);
+        else
+            pthread_detach(tid);
+    }
+
+    return 0;
+}
+
+/*----------------------------------- main --------------------------------------*/